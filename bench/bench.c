@@ -0,0 +1,232 @@
+/*	
+ *	SPDX-License-Identifier: GPL-3.0-only
+ *
+ *  Virtual Orchestra - Musical Instrument Simulation
+ *  Copyright (C) 2024 Garnek0 (Popa Vlad) and Contributors
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "midi_generator.h"
+
+#include <vo/debug.h>
+#include <vo/gfxui/renderer.h>
+#include <vo/event.h>
+#include <vo/audio.h>
+#include <vo/midi.h>
+#include <vo/playback.h>
+
+#include <vo/instruments/instrument.h>
+#include <vo/instruments/piano.h>
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <SDL2/SDL.h>
+
+#define BENCH_MIDI_PATH "build/bench/bench.mid"
+
+// Every frame advances playback by the same amount, so that two runs over
+// the same file do the same work no matter how fast the machine is.
+#define BENCH_FRAME_MS 16
+
+struct bench_stats {
+	double mean;
+	double p50, p99, max;
+};
+
+static int bench_compare_samples(const void* a, const void* b) {
+	double x = *(const double*)a;
+	double y = *(const double*)b;
+
+	return (x > y) - (x < y);
+}
+
+static struct bench_stats bench_summarize(double* samples, int count) {
+	struct bench_stats stats = {0};
+	if (count == 0)
+		return stats;
+
+	double total = 0;
+	for (int i = 0; i < count; i++)
+		total += samples[i];
+
+	qsort((void*)samples, count, sizeof(double), bench_compare_samples);
+
+	stats.mean = total / count;
+	stats.p50 = samples[(count - 1) / 2];
+	stats.p99 = samples[(int)((count - 1) * 0.99)];
+	stats.max = samples[count - 1];
+
+	return stats;
+}
+
+static double bench_elapsed_us(Uint64 start) {
+	return (double)(SDL_GetPerformanceCounter() - start) * 1000000.0 / SDL_GetPerformanceFrequency();
+}
+
+static void bench_print_stats(const char* name, struct bench_stats stats, bool last) {
+	printf("\t\t\"%s\": {\"mean\": %.2f, \"p50\": %.2f, \"p99\": %.2f, \"max\": %.2f}%s\n", name, stats.mean, stats.p50, stats.p99, stats.max, last ? "" : ",");
+}
+
+// Generate a MIDI file, then time loading it and playing it back frame by
+// frame with the renderer on the dummy video driver and no soundfont. The
+// results are printed to stdout as JSON, logs go to stderr.
+int main(int argc, char** argv) {
+	struct midi_generator_params params = MIDI_GENERATOR_DEFAULT_PARAMS;
+	int frameCount = 600;
+	bool validArgs = true;
+
+	for (int i = 1; i < argc && validArgs; i++) {
+		int* value = NULL;
+
+		if (strcmp(argv[i], "--notes") == 0)
+			value = &params.noteCount;
+		else if (strcmp(argv[i], "--polyphony") == 0)
+			value = &params.polyphony;
+		else if (strcmp(argv[i], "--tracks") == 0)
+			value = &params.trackCount;
+		else if (strcmp(argv[i], "--tempo-changes") == 0)
+			value = &params.tempoChanges;
+		else if (strcmp(argv[i], "--frames") == 0)
+			value = &frameCount;
+		else
+			validArgs = false;
+
+		if (value) {
+			validArgs = ++i < argc;
+			if (validArgs)
+				*value = atoi(argv[i]);
+		}
+	}
+
+	if (!validArgs || frameCount < 1) {
+		debug_log(LOGLEVEL_FATAL, "Bench: Invalid arguments!\nUsage: %s [--notes n] [--polyphony n] [--tracks n] [--tempo-changes n] [--frames n]\n", argv[0]);
+		return 1;
+	}
+
+	SDL_setenv("SDL_VIDEODRIVER", "dummy", 1);
+
+	if (SDL_Init(SDL_INIT_VIDEO | SDL_INIT_TIMER) != 0) {
+		debug_log(LOGLEVEL_FATAL, "Bench: SDL init failed: %s\n", SDL_GetError());
+		return 1;
+	}
+
+	if (event_init() != 0 || renderer_init() != 0 || audio_init_offline() != 0 || instrument_init() != 0 || playback_init() != 0) {
+		debug_log(LOGLEVEL_FATAL, "Bench: Init failed!\n");
+		return 1;
+	}
+
+	struct instrument_new_args args;
+	args.x = args.y = 0;
+	args.init = piano_init_88;
+	args.fini = piano_fini;
+	args.play_note = piano_play_note;
+	args.release_note = piano_release_note;
+	args.update_visuals = piano_update_visuals;
+	// Synthesis would dominate the timings, the bench measures the player.
+	args.soundfontPath = NULL;
+	args.bank = 0;
+	args.preset = 0;
+	args.polyphony = 61;
+
+	struct instrument* piano = instrument_new(args);
+	if (!piano) {
+		debug_log(LOGLEVEL_FATAL, "Bench: Failed to create the piano!\n");
+		return 1;
+	}
+
+	if (midi_generator_write(BENCH_MIDI_PATH, &params) != 0) {
+		debug_log(LOGLEVEL_FATAL, "Bench: Failed to write %s!\n", BENCH_MIDI_PATH);
+		return 1;
+	}
+
+	struct midi_route routes[] = {
+		{.track = MIDI_ROUTE_ANY, .channel = MIDI_ROUTE_ANY, .instr = piano}
+	};
+
+	// Time parsing, not a note cache left over from an earlier run.
+	remove(BENCH_MIDI_PATH ".vocache");
+
+	Uint64 start = SDL_GetPerformanceCounter();
+
+	if (midi_load_file_routed(BENCH_MIDI_PATH, routes, sizeof(routes)/sizeof(routes[0])) != 0) {
+		debug_log(LOGLEVEL_FATAL, "Bench: Failed to load %s!\n", BENCH_MIDI_PATH);
+		return 1;
+	}
+
+	double loadTime = bench_elapsed_us(start);
+
+	// The first load parsed the file and wrote the note cache, this one
+	// maps the cache.
+	start = SDL_GetPerformanceCounter();
+
+	if (midi_load_file_routed(BENCH_MIDI_PATH, routes, sizeof(routes)/sizeof(routes[0])) != 0) {
+		debug_log(LOGLEVEL_FATAL, "Bench: Failed to reload %s!\n", BENCH_MIDI_PATH);
+		return 1;
+	}
+
+	double cachedLoadTime = bench_elapsed_us(start);
+
+	double* playbackSamples = malloc(sizeof(double)*frameCount);
+	double* renderSamples = malloc(sizeof(double)*frameCount);
+
+	if (!playbackSamples || !renderSamples) {
+		debug_log(LOGLEVEL_FATAL, "Bench: Failed to allocate %d frame samples!\n", frameCount);
+		return 1;
+	}
+
+	int frames = 0;
+
+	playback_start();
+
+	for (; frames < frameCount && !playback_finished(); frames++) {
+		start = SDL_GetPerformanceCounter();
+		playback_advance(NOTE_TIME_FROM_MS(BENCH_FRAME_MS));
+		playbackSamples[frames] = bench_elapsed_us(start);
+
+		start = SDL_GetPerformanceCounter();
+		renderer_iteration();
+		renderSamples[frames] = bench_elapsed_us(start);
+	}
+
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+
+	printf("{\n");
+	printf("\t\"notes\": %d,\n", params.noteCount);
+	printf("\t\"polyphony\": %d,\n", params.polyphony);
+	printf("\t\"tracks\": %d,\n", params.trackCount);
+	printf("\t\"tempo_changes\": %d,\n", params.tempoChanges);
+	printf("\t\"frames\": %d,\n", frames);
+	printf("\t\"load_us\": %.2f,\n", loadTime);
+	printf("\t\"cached_load_us\": %.2f,\n", cachedLoadTime);
+	printf("\t\"frame_us\": {\n");
+	bench_print_stats("playback", bench_summarize(playbackSamples, frames), false);
+	bench_print_stats("render", bench_summarize(renderSamples, frames), true);
+	printf("\t},\n");
+	// Kilobytes on Linux
+	printf("\t\"peak_rss_kb\": %ld\n", usage.ru_maxrss);
+	printf("}\n");
+
+	free((void*)playbackSamples);
+	free((void*)renderSamples);
+
+	SDL_Quit();
+
+	return 0;
+}
@@ -0,0 +1,238 @@
+/*	
+ *	SPDX-License-Identifier: GPL-3.0-only
+ *
+ *  Virtual Orchestra - Musical Instrument Simulation
+ *  Copyright (C) 2024 Garnek0 (Popa Vlad) and Contributors
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "midi_generator.h"
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Bytes of a track chunk, grown as events are added.
+struct midi_generator_buffer {
+	uint8_t* data;
+	size_t length;
+	size_t capacity;
+	// Set once the buffer couldn't grow, later bytes are dropped.
+	bool failed;
+};
+
+static void midi_generator_put(struct midi_generator_buffer* buffer, uint8_t byte) {
+	if (buffer->failed)
+		return;
+
+	if (buffer->length == buffer->capacity) {
+		size_t newCapacity = buffer->capacity ? buffer->capacity*2 : 4096;
+		uint8_t* newData = realloc((void*)buffer->data, newCapacity);
+
+		if (!newData) {
+			buffer->failed = true;
+			return;
+		}
+
+		buffer->data = newData;
+		buffer->capacity = newCapacity;
+	}
+
+	buffer->data[buffer->length++] = byte;
+}
+
+static void midi_generator_put_varlen(struct midi_generator_buffer* buffer, uint32_t value) {
+	uint8_t bytes[4];
+	int count = 0;
+
+	do {
+		bytes[count++] = value & 0x7F;
+		value >>= 7;
+	} while (value && count < 4);
+
+	while (count > 1)
+		midi_generator_put(buffer, bytes[--count] | 0x80);
+
+	midi_generator_put(buffer, bytes[0]);
+}
+
+static void midi_generator_put_tempo(struct midi_generator_buffer* buffer, uint32_t delta, uint32_t tempo) {
+	midi_generator_put_varlen(buffer, delta);
+	midi_generator_put(buffer, 0xFF);
+	midi_generator_put(buffer, 0x51);
+	midi_generator_put(buffer, 0x03);
+	midi_generator_put(buffer, tempo >> 16);
+	midi_generator_put(buffer, tempo >> 8);
+	midi_generator_put(buffer, tempo);
+}
+
+static void midi_generator_write_u32(FILE* file, uint32_t value) {
+	uint8_t bytes[4] = {value >> 24, value >> 16, value >> 8, value};
+	fwrite(bytes, 1, 4, file);
+}
+
+// Returns -1 if the track didn't fit in memory.
+static int midi_generator_write_track(FILE* file, struct midi_generator_buffer* buffer) {
+	// End of track
+	midi_generator_put_varlen(buffer, 0);
+	midi_generator_put(buffer, 0xFF);
+	midi_generator_put(buffer, 0x2F);
+	midi_generator_put(buffer, 0x00);
+
+	if (buffer->failed)
+		return -1;
+
+	fwrite("MTrk", 1, 4, file);
+	midi_generator_write_u32(file, (uint32_t)buffer->length);
+	fwrite(buffer->data, 1, buffer->length, file);
+
+	buffer->length = 0;
+
+	return 0;
+}
+
+// Same numbers on every platform, unlike rand().
+static uint32_t midi_generator_random(uint32_t* state) {
+	*state ^= *state << 13;
+	*state ^= *state >> 17;
+	*state ^= *state << 5;
+
+	return *state;
+}
+
+// Write a format 1 file with a tempo track and params->trackCount note
+// tracks. Notes start at even intervals so that params->polyphony of them
+// overlap, and are spread over the tracks round-robin. Keys are random,
+// within the range of an 88-key piano.
+int midi_generator_write(const char* path, const struct midi_generator_params* params) {
+	if (params->noteCount < 0 || params->polyphony < 1 || params->trackCount < 1 || params->trackCount > 65534 || params->noteLength < 1 || params->ticksPerQuarter < 1 || params->ticksPerQuarter > 0x7FFF)
+		return -1;
+
+	FILE* file = fopen(path, "wb");
+	if (!file)
+		return -1;
+
+	int spacing = params->noteLength / params->polyphony;
+	if (spacing < 1)
+		spacing = 1;
+
+	uint32_t songLength = (uint32_t)params->noteCount * spacing + params->noteLength;
+
+	fwrite("MThd", 1, 4, file);
+	midi_generator_write_u32(file, 6);
+	uint8_t header[6] = {0, 1, (params->trackCount + 1) >> 8, (params->trackCount + 1) & 0xFF, params->ticksPerQuarter >> 8, params->ticksPerQuarter & 0xFF};
+	fwrite(header, 1, sizeof(header), file);
+
+	struct midi_generator_buffer buffer = {0};
+	uint8_t* pendingKeys = NULL;
+	uint32_t* pendingEnds = NULL;
+
+	// Tempo track, 120 BPM to start with and then swinging between ~100
+	// and ~150 BPM.
+	midi_generator_put_tempo(&buffer, 0, 500000);
+
+	uint32_t previousTick = 0;
+	for (int i = 1; i <= params->tempoChanges; i++) {
+		uint32_t tick = (uint32_t)((uint64_t)songLength * i / (params->tempoChanges + 1));
+
+		midi_generator_put_tempo(&buffer, tick - previousTick, (i % 2) ? 400000 : 600000);
+		previousTick = tick;
+	}
+
+	if (midi_generator_write_track(file, &buffer) != 0)
+		goto fail;
+
+	// Every note has the same length, so the noteOffs of a track come in
+	// the same order as its noteOns and a FIFO is enough to interleave them.
+	pendingKeys = malloc((size_t)params->polyphony + 1);
+	pendingEnds = malloc(sizeof(uint32_t)*((size_t)params->polyphony + 1));
+
+	if (!pendingKeys || !pendingEnds)
+		goto fail;
+
+	uint32_t random = params->seed ? params->seed : 1;
+
+	for (int track = 0; track < params->trackCount; track++) {
+		int channel = track % 16;
+		int pendingFirst = 0, pendingCount = 0;
+		int capacity = params->polyphony + 1;
+
+		previousTick = 0;
+
+		// Running status throughout, noteOffs are noteOns with a velocity
+		// of 0.
+		bool statusWritten = false;
+
+		for (int note = track; note < params->noteCount || pendingCount > 0; note += params->trackCount) {
+			uint32_t start = note < params->noteCount ? (uint32_t)note * spacing : UINT32_MAX;
+
+			// Release before striking at the same tick.
+			while (pendingCount > 0 && pendingEnds[pendingFirst] <= start) {
+				midi_generator_put_varlen(&buffer, pendingEnds[pendingFirst] - previousTick);
+				if (!statusWritten) {
+					midi_generator_put(&buffer, 0x90 | channel);
+					statusWritten = true;
+				}
+				midi_generator_put(&buffer, pendingKeys[pendingFirst]);
+				midi_generator_put(&buffer, 0);
+
+				previousTick = pendingEnds[pendingFirst];
+				pendingFirst = (pendingFirst + 1) % capacity;
+				pendingCount--;
+			}
+
+			if (note >= params->noteCount)
+				continue;
+
+			uint8_t key = 21 + midi_generator_random(&random) % 88;
+
+			midi_generator_put_varlen(&buffer, start - previousTick);
+			if (!statusWritten) {
+				midi_generator_put(&buffer, 0x90 | channel);
+				statusWritten = true;
+			}
+			midi_generator_put(&buffer, key);
+			midi_generator_put(&buffer, 64 + midi_generator_random(&random) % 64);
+
+			previousTick = start;
+
+			int slot = (pendingFirst + pendingCount) % capacity;
+			pendingKeys[slot] = key;
+			pendingEnds[slot] = start + params->noteLength;
+			pendingCount++;
+		}
+
+		if (midi_generator_write_track(file, &buffer) != 0)
+			goto fail;
+	}
+
+	free((void*)pendingKeys);
+	free((void*)pendingEnds);
+	free((void*)buffer.data);
+
+	return fclose(file) == 0 ? 0 : -1;
+
+fail:
+	free((void*)pendingKeys);
+	free((void*)pendingEnds);
+	free((void*)buffer.data);
+
+	fclose(file);
+	remove(path);
+
+	return -1;
+}
@@ -0,0 +1,46 @@
+/*	
+ *	SPDX-License-Identifier: GPL-3.0-only
+ *
+ *  Virtual Orchestra - Musical Instrument Simulation
+ *  Copyright (C) 2024 Garnek0 (Popa Vlad) and Contributors
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+// Shape of a synthetic MIDI file.
+struct midi_generator_params {
+	int noteCount;
+	int polyphony; // Notes sounding at the same time
+	int trackCount; // Note tracks, the tempo track comes on top of these
+	int tempoChanges;
+
+	int ticksPerQuarter;
+	int noteLength; // In ticks
+
+	unsigned int seed;
+};
+
+#define MIDI_GENERATOR_DEFAULT_PARAMS { \
+	.noteCount = 100000, \
+	.polyphony = 16, \
+	.trackCount = 4, \
+	.tempoChanges = 16, \
+	.ticksPerQuarter = 480, \
+	.noteLength = 240, \
+	.seed = 1 \
+}
+
+int midi_generator_write(const char* path, const struct midi_generator_params* params);
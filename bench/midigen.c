@@ -0,0 +1,71 @@
+/*	
+ *	SPDX-License-Identifier: GPL-3.0-only
+ *
+ *  Virtual Orchestra - Musical Instrument Simulation
+ *  Copyright (C) 2024 Garnek0 (Popa Vlad) and Contributors
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "midi_generator.h"
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Write a synthetic MIDI file, for reproducing benchmark runs or stress
+// testing the player by hand.
+int main(int argc, char** argv) {
+	struct midi_generator_params params = MIDI_GENERATOR_DEFAULT_PARAMS;
+	const char* outputPath = NULL;
+	bool validArgs = true;
+
+	for (int i = 1; i < argc && validArgs; i++) {
+		int* value = NULL;
+
+		if (strcmp(argv[i], "--notes") == 0)
+			value = &params.noteCount;
+		else if (strcmp(argv[i], "--polyphony") == 0)
+			value = &params.polyphony;
+		else if (strcmp(argv[i], "--tracks") == 0)
+			value = &params.trackCount;
+		else if (strcmp(argv[i], "--tempo-changes") == 0)
+			value = &params.tempoChanges;
+		else if (strcmp(argv[i], "--seed") == 0)
+			value = (int*)&params.seed;
+		else if (!outputPath)
+			outputPath = argv[i];
+		else
+			validArgs = false;
+
+		if (value) {
+			validArgs = ++i < argc;
+			if (validArgs)
+				*value = atoi(argv[i]);
+		}
+	}
+
+	if (!validArgs || !outputPath) {
+		fprintf(stderr, "Usage: %s [--notes n] [--polyphony n] [--tracks n] [--tempo-changes n] [--seed n] output.mid\n", argv[0]);
+		return 1;
+	}
+
+	if (midi_generator_write(outputPath, &params) != 0) {
+		fprintf(stderr, "Failed to write %s\n", outputPath);
+		return 1;
+	}
+
+	return 0;
+}
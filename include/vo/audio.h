@@ -23,7 +23,67 @@
 #include <vo/instruments/instrument.h>
 #include <vo/note.h>
 
+struct audio_latency_profile {
+	const char* name;
+
+	// Frames per period and number of periods in the device buffer.
+	int periodSize;
+	int periods;
+};
+
+// Render times are bucketed by their share of the period budget, in steps
+// of AUDIO_STATS_BUCKET_PERCENT. The last bucket also takes everything
+// slower than that.
+#define AUDIO_STATS_HISTOGRAM_BUCKETS 16
+#define AUDIO_STATS_BUCKET_PERCENT 10
+
+struct audio_timing_stats {
+	unsigned long long count;
+	// In ms.
+	double averageTime, lastTime, maxTime;
+	unsigned int histogram[AUDIO_STATS_HISTOGRAM_BUCKETS];
+};
+
+struct audio_stats {
+	// Size of the last period and how long it lasts when played.
+	int periodSize;
+	double periodBudget; // ms
+	// Worked out from when the mixer is called, not reported by the device.
+	unsigned int estimatedUnderrunCount;
+
+	// Voices playing on the shared synth and how many it may play at once.
+	int activeVoices;
+	int polyphony;
+	// FluidSynth's own estimate, in percent of real time.
+	double cpuLoad;
+
+	// The whole mix, every instrument included.
+	struct audio_timing_stats callback;
+};
+
+struct audio_instrument_stats {
+	// Voices playing on the instrument's channel.
+	int activeVoices;
+	int peakVoices;
+	// Share of the synth's polyphony the instrument asked for.
+	int polyphony;
+};
+
+int audio_set_latency_profile(const char* name);
 int audio_init();
+int audio_init_offline();
+void audio_fini();
+double audio_get_sample_rate();
+void audio_render(float* left, float* right, int len);
+unsigned int audio_get_estimated_underrun_count();
+void audio_get_stats(struct audio_stats* stats);
+int audio_get_instrument_stats(struct instrument* instr, struct audio_instrument_stats* stats);
+void audio_reset_stats();
 int audio_init_instrument(struct instrument* instr, const char* soundfontPath, int bank, int preset, int polyphony);
+bool audio_is_instrument_loading(struct instrument* instr);
+int audio_wait_instrument(struct instrument* instr);
+void audio_fini_instrument(struct instrument* instr);
+void audio_sync(int64_t playbackTime);
+void audio_flush();
 void audio_note_on(struct instrument* instr, struct simple_note note);
 void audio_note_off(struct instrument* instr, struct simple_note note);
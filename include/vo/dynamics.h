@@ -28,3 +28,6 @@
 #define DYNAMICS_P 6
 #define DYNAMICS_PP 7
 #define DYNAMICS_PPP 8
+
+// Map a dynamic to a 0-127 MIDI velocity.
+#define DYNAMICS_TO_VELOCITY(dynamic) (127 - ((dynamic) - 1)*(127/8))
@@ -39,6 +39,16 @@ struct mouse_callback {
 	void (*callback)(int relX, int relY);
 };
 
+struct window_callback {
+	// windowEvent is one of the SDL_WINDOWEVENT_* values.
+	void (*callback)(Uint8 windowEvent, int data1, int data2);
+};
+
+struct render_reset_callback {
+	// Called when the renderer's targets or device were reset.
+	void (*callback)(void);
+};
+
 int event_init();
 void event_iteration();
 
@@ -51,5 +61,11 @@ void event_remove_mouse_wheel_callback(struct mouse_wheel_callback* mouseWheelCa
 struct mouse_callback* event_register_mouse_callback(Uint32 button, void (*callback)(int, int));
 void event_remove_mouse_callback(struct mouse_callback* mouseCallback);
 
+struct window_callback* event_register_window_callback(void (*callback)(Uint8, int, int));
+void event_remove_window_callback(struct window_callback* windowCallback);
+
+struct render_reset_callback* event_register_render_reset_callback(void (*callback)(void));
+void event_remove_render_reset_callback(struct render_reset_callback* renderResetCallback);
+
 bool event_has_signaled_quit();
 void event_get_mouse_position(int* x, int* y);
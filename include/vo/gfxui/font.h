@@ -0,0 +1,33 @@
+/*	
+ *	SPDX-License-Identifier: GPL-3.0-only
+ *
+ *  Virtual Orchestra - Musical Instrument Simulation
+ *  Copyright (C) 2024 Garnek0 (Popa Vlad) and Contributors
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <SDL2/SDL.h>
+
+// Tiny built-in bitmap font for overlays. Glyphs are 3x5 pixels, times
+// scale, with one pixel of spacing. Only upper case letters, digits and a
+// few symbols exist, lower case is drawn as upper case and anything else
+// as a blank.
+#define FONT_GLYPH_WIDTH 3
+#define FONT_GLYPH_HEIGHT 5
+
+int font_text_width(const char* text, int scale);
+void font_draw_text(SDL_Renderer* renderer, int x, int y, int scale, const char* text);
@@ -21,25 +21,40 @@
 #pragma once
 
 #include <vo/instruments/instrument.h>
+#include <vo/gfxui/texture_cache.h>
 
 struct renderer_instrument_texture {
-	SDL_Texture* loadedTexture;
+	// Shared image on the texture atlas. NULL when running headless.
+	struct texture_cache_entry* image;
+	// Size of the image, 0 when running headless.
+	int width, height;
+
+	// Where the texture is on the stage.
+	SDL_FRect bounds;
 
 	int offsetX;
 	int offsetY;
 
-	// This is not global! It is per instrument! If instrument 1 has
-	// one texture at layer 0 and instrument 2 has one texture at layer 70,
-	// and they are overlapped, instrument 1's texture will be drawn on top
-	// of instrument 2's if it just so happens that instrument 1 is rendered
-	// last.
+	// Textures on higher layers are drawn on top. This is global, a
+	// texture at layer 70 covers every texture at layer 0 no matter which
+	// instrument they belong to. Within a layer, instruments are drawn in
+	// the order they were created.
 	int layer; 
+
+	// 0 - 100
+	int opacity;
+};
+
+struct renderer_overlay {
+	// Called after the stage is drawn, with the size of the screen.
+	void (*draw)(SDL_Renderer* renderer, int outputWidth, int outputHeight);
 };
 
 void renderer_coord_screen_to_stage(int screenX, int screenY, float* stageX, float* stageY);
 void renderer_coord_stage_to_screen(float stageX, float stageY, int* screenX, int* screenY);
 
 int renderer_init();
+int renderer_init_headless();
 void renderer_iteration();
 int renderer_load_instrument_texture(struct instrument* instr, const char* path, int offsetX, int offsetY, int layer);
 void renderer_set_instrument_texture_draw(struct instrument* instr, int textureIndex, bool doDraw);
@@ -47,7 +62,11 @@ void renderer_set_instrument_texture_offset(struct instrument* instr, int textur
 void renderer_set_instrument_texture_opacity(struct instrument* instr, int textureIndex, int opacity);
 void renderer_set_instrument_texture_layer(struct instrument* instr, int textureIndex, int layer);
 void renderer_free_instrument_textures(struct instrument* instr);
-void renderer_render_instrument(struct instrument* instr);
+void renderer_update_instrument_bounds(struct instrument* instr);
+void renderer_invalidate();
+void renderer_invalidate_rect(const SDL_Rect* rect);
+struct renderer_overlay* renderer_add_overlay(void (*draw)(SDL_Renderer*, int, int));
+void renderer_remove_overlay(struct renderer_overlay* overlay);
 
 void renderer_get_screen_offset(float* x, float* y);
 void renderer_set_screen_offset(float x, float y);
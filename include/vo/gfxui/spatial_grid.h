@@ -0,0 +1,52 @@
+/*	
+ *	SPDX-License-Identifier: GPL-3.0-only
+ *
+ *  Virtual Orchestra - Musical Instrument Simulation
+ *  Copyright (C) 2024 Garnek0 (Popa Vlad) and Contributors
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <SDL2/SDL.h>
+
+// An item in a cell of the grid.
+struct spatial_grid_entry {
+	int cellX, cellY;
+	void* item;
+};
+
+// Cells are hashed into a fixed number of buckets, so the grid covers an
+// unbounded area.
+struct spatial_grid_bucket {
+	int entryCount;
+	int maxEntriesBeforeRealloc;
+	struct spatial_grid_entry* entries;
+};
+
+// Uniform grid over stage coordinates for finding the items that overlap
+// an area without looking at all of them.
+struct spatial_grid {
+	float cellSize;
+
+	int bucketCount;
+	struct spatial_grid_bucket* buckets;
+};
+
+struct spatial_grid* spatial_grid_create(float cellSize);
+void spatial_grid_destroy(struct spatial_grid* grid);
+int spatial_grid_insert(struct spatial_grid* grid, void* item, const SDL_FRect* bounds);
+void spatial_grid_remove(struct spatial_grid* grid, void* item, const SDL_FRect* bounds);
+int spatial_grid_query(struct spatial_grid* grid, const SDL_FRect* area, void*** items, int* maxItems);
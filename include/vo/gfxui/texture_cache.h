@@ -0,0 +1,51 @@
+/*	
+ *	SPDX-License-Identifier: GPL-3.0-only
+ *
+ *  Virtual Orchestra - Musical Instrument Simulation
+ *  Copyright (C) 2024 Garnek0 (Popa Vlad) and Contributors
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <SDL2/SDL.h>
+
+// A page of the texture atlas. Images are packed onto it in rows
+// ("shelves") from top to bottom.
+struct texture_atlas_page {
+	SDL_Texture* texture;
+	int width, height;
+
+	int shelfX, shelfY;
+	int shelfHeight;
+
+	// Number of cache entries living on this page.
+	int entryCount;
+};
+
+// An image file loaded once and shared by everyone who uses it.
+struct texture_cache_entry {
+	char* path;
+	int refCount;
+
+	struct texture_atlas_page* page;
+	// Where the image is on its atlas page.
+	SDL_Rect rect;
+};
+
+int texture_cache_init(SDL_Renderer* renderer);
+void texture_cache_prefetch(const char* path);
+struct texture_cache_entry* texture_cache_acquire(const char* path);
+void texture_cache_release(struct texture_cache_entry* entry);
@@ -25,6 +25,10 @@
 #include <SDL2/SDL.h>
 #include <fluidsynth.h>
 #include <vo/note.h>
+#include <vo/note_store.h>
+#include <vo/ringbuffer.h>
+#include <vo/key_state.h>
+#include <vo/task.h>
 
 struct instrument {
 	int id; // Instrument ID
@@ -35,6 +39,7 @@ struct instrument {
 	int (*fini)(struct instrument* instr); // Instrument fini function
 	int (*play_note)(struct instrument* instr, struct complex_note note); // Start playing note
 	int (*release_note)(struct instrument* instr, struct complex_note note); // Stop playing note
+	void (*update_visuals)(struct instrument* instr, const struct key_state_snapshot* keys); // Show which keys are pressed
 
 	// Max number of textures that can be loaded before the texture
 	// array is reallocated as double the size.
@@ -42,16 +47,50 @@ struct instrument {
 
 	int textureCount;
 	struct renderer_instrument_texture* textures;
+	// Texture indexes sorted by layer, in the order they are drawn. Kept up
+	// to date by the renderer whenever a texture is loaded or moved to
+	// another layer.
+	int* textureDrawOrder;
+
+	// Area covered by all of the instrument's textures, in stage
+	// coordinates, and whether the renderer's spatial index knows about it.
+	SDL_FRect bounds;
+	bool boundsIndexed;
 
 	// fff, mf, pp etc.
 	int dynamic;
 
-	struct list* noteList;
+	// Instrument-specific state. Set up by init and freed by fini.
+	void* data;
+	// Whether init has run successfully, see instrument_finish_new().
+	bool initialized;
+
+	// Keys held down right now. play_note and release_note (called by the
+	// playback thread) update it, update_visuals (called on the main
+	// thread) shows it.
+	struct key_state keyState;
+	// Key state sequence the visuals were last updated for. Only touched
+	// by the main thread.
+	unsigned int visualKeyStateSequence;
+
+	// Time-sorted notes to be played by this instrument.
+	struct note_store* noteList;
 
-	// Fluidsynth instance for this instrument.
-	fluid_synth_t* synth;
-	// Fluidsynth audio driver.
-	fluid_audio_driver_t* audioDriver;
+	// MIDI channel of the audio engine's synth this instrument plays on,
+	// -1 until its sound is loaded or if it is silent.
+	int audioChannel;
+	// Shared soundfont the channel's program comes from.
+	int soundfontID;
+	// Loads the soundfont and sets up the channel in the background. NULL
+	// once audio_wait_instrument() has collected it.
+	struct task* audioLoadTask;
+
+	// Timestamped note events on their way to the audio thread.
+	struct ringbuffer* audioEvents;
+	// Sample and flush generation of the last event queued. The mixer only
+	// looks at the head of the queue, so it must stay in sample order.
+	uint64_t audioLastQueuedSample;
+	unsigned int audioLastQueuedFlushGeneration;
 };
 
 struct instrument_new_args {
@@ -60,6 +99,7 @@ struct instrument_new_args {
 	int (*fini)(struct instrument* instr);
 	int (*play_note)(struct instrument* instr, struct complex_note note);
 	int (*release_note)(struct instrument* instr, struct complex_note note);
+	void (*update_visuals)(struct instrument* instr, const struct key_state_snapshot* keys);
 
 	const char* soundfontPath;
 	int bank, preset;
@@ -69,7 +109,13 @@ struct instrument_new_args {
 int instrument_init();
 
 struct instrument* instrument_new(struct instrument_new_args args);
+struct instrument* instrument_new_deferred(struct instrument_new_args args);
+int instrument_finish_new(struct instrument* instr);
 void instrument_set_position(struct instrument* instr, float x, float y);
 void instrument_destroy(struct instrument* instr);
 
+bool instrument_is_loading();
+void instrument_wait_loaded();
+void instrument_update_visuals();
+
 struct list* instrument_get_list();
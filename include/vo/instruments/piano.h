@@ -23,7 +23,23 @@
 #include <vo/instruments/instrument.h>
 #include <vo/note.h>
 
+// Key textures of a single piano.
+struct piano {
+	int lowestKey, highestKey;
+
+	// Texture indexes by MIDI key, -1 for keys outside the piano's range.
+	int keyTextureIndexes[128];
+	int pressedKeyTextureIndexes[128];
+
+	// Keys currently shown as pressed. Only touched by the main thread.
+	struct key_state_snapshot shownKeys;
+};
+
+void piano_prefetch_textures();
 int piano_init(struct instrument* instr);
+int piano_init_76(struct instrument* instr);
+int piano_init_88(struct instrument* instr);
 int piano_fini(struct instrument* instr);
 int piano_play_note(struct instrument* instr, struct complex_note note);
 int piano_release_note(struct instrument* instr, struct complex_note note);
+void piano_update_visuals(struct instrument* instr, const struct key_state_snapshot* keys);
@@ -0,0 +1,45 @@
+/*	
+ *	SPDX-License-Identifier: GPL-3.0-only
+ *
+ *  Virtual Orchestra - Musical Instrument Simulation
+ *  Copyright (C) 2024 Garnek0 (Popa Vlad) and Contributors
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+// Finds the intervals that contain a point in O(log n + k). The intervals
+// are kept in start order and form an implicit binary tree: the element at
+// index i sits at the level given by the number of trailing 1 bits in i,
+// and maxEnd[i] is the largest end in its subtree.
+struct interval_index {
+	int count;
+	int capacity;
+
+	// Sorted. Borrowed from whoever built the index, must stay valid
+	// (and unchanged) for as long as the index is used.
+	const int64_t* start;
+	int64_t* end;
+	int64_t* maxEnd;
+
+	int rootLevel;
+};
+
+struct interval_index* interval_index_create();
+void interval_index_destroy(struct interval_index* index);
+int interval_index_build(struct interval_index* index, const int64_t* start, const int64_t* end, int count);
+int interval_index_query(struct interval_index* index, int64_t time, int** results, int* maxResults);
@@ -0,0 +1,47 @@
+/*	
+ *	SPDX-License-Identifier: GPL-3.0-only
+ *
+ *  Virtual Orchestra - Musical Instrument Simulation
+ *  Copyright (C) 2024 Garnek0 (Popa Vlad) and Contributors
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#define KEY_STATE_IS_PRESSED(snapshot, midiKey) \
+	(((snapshot)->pressed[(midiKey) / 64] >> ((midiKey) % 64)) & 1)
+
+// Which of the 128 MIDI keys of an instrument are held down. There is a
+// single writer (the playback thread), readers (the renderer) never block
+// it and retry instead if they catch it in the middle of a write.
+struct key_state {
+	// Odd while a write is in progress.
+	atomic_uint sequence;
+
+	_Atomic uint64_t pressed[2];
+};
+
+// A consistent copy of a key state.
+struct key_state_snapshot {
+	uint64_t pressed[2];
+};
+
+void key_state_set(struct key_state* state, int midiKey, bool pressed);
+unsigned int key_state_get_sequence(struct key_state* state);
+unsigned int key_state_read(struct key_state* state, struct key_state_snapshot* snapshot);
@@ -22,4 +22,42 @@
 
 #include <vo/instruments/instrument.h>
 
+#include <stdint.h>
+
+#define MIDI_CHANNEL_COUNT 16
+#define MIDI_KEY_COUNT 128
+
+// Matches any track or channel in a struct midi_route.
+#define MIDI_ROUTE_ANY -1
+
+// 120 BPM, until the file says otherwise.
+#define MIDI_DEFAULT_TEMPO 500000
+
+// Sends the notes found on a track/channel pair to an instrument. When
+// several routes match the same notes, the first one wins.
+struct midi_route {
+	int track;
+	int channel;
+	struct instrument* instr;
+};
+
+// Turns ticks into playback times exactly, with integer math only. The
+// time up to the last tempo change is kept in microseconds times the
+// division, so nothing is rounded until a time is read out and rounding
+// never adds up over a long piece.
+struct midi_tempo_map {
+	int division; // Ticks per quarter note
+	uint64_t tempoTick; // Tick of the last tempo change
+	int64_t scaledTime; // Time at tempoTick, in microseconds times division
+	int64_t tempo; // Microseconds per quarter note
+};
+
+void midi_tempo_map_init(struct midi_tempo_map* map, int division);
+void midi_tempo_map_set_tempo(struct midi_tempo_map* map, uint64_t tick, int64_t tempo);
+int64_t midi_tempo_map_get_time(struct midi_tempo_map* map, uint64_t tick);
+
 int midi_load_file(struct instrument* instr, const char* path, int track);
+int midi_load_file_routed(const char* path, const struct midi_route* routes, int routeCount);
+int midi_parse_file_routed(const char* path, const struct midi_route* routes, int routeCount);
+struct task* midi_parse_file_async(const char* path, const struct midi_route* routes, int routeCount);
+struct instrument** midi_resolve_routes(const char* path, const struct midi_route* routes, int routeCount, int trackCount);
@@ -0,0 +1,117 @@
+/*	
+ *	SPDX-License-Identifier: GPL-3.0-only
+ *
+ *  Virtual Orchestra - Musical Instrument Simulation
+ *  Copyright (C) 2024 Garnek0 (Popa Vlad) and Contributors
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <vo/midi.h>
+#include <vo/ringbuffer.h>
+#include <vo/instruments/instrument.h>
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <SDL2/SDL.h>
+
+#define MIDI_STREAM_READ_BUFFER_SIZE 4096
+
+// A noteOn or noteOff read from the file, ready to be played.
+struct midi_stream_event {
+	int64_t time;
+
+	// Rewind generation the event was decoded in. Events from before the
+	// last rewind are thrown away.
+	unsigned int generation;
+
+	struct instrument* instr;
+
+	uint8_t type; // TIMELINE_EVENT_NOTE_ON or TIMELINE_EVENT_NOTE_OFF
+	uint8_t midiKey;
+};
+
+// Reads one MTrk chunk of the file, a buffer's worth at a time.
+struct midi_stream_track {
+	long start, end; // Chunk data, as file offsets
+	long position; // Next byte to be read
+
+	uint8_t buffer[MIDI_STREAM_READ_BUFFER_SIZE];
+	long bufferStart; // File offset of buffer[0]
+	int bufferLength;
+
+	uint64_t tick; // Absolute time of the next event
+	uint8_t runningStatus;
+	bool ended;
+};
+
+// Plays a MIDI file without loading it. A decoder thread reads the file
+// incrementally and keeps a few seconds of events queued ahead of the
+// playback time, so memory use depends on how dense the music is rather
+// than on how long the file is.
+struct midi_stream {
+	FILE* file;
+	char* path;
+
+	int division;
+	int trackCount;
+	struct midi_stream_track* tracks;
+
+	// (track, channel) -> instrument, see midi_resolve_routes()
+	struct instrument** routeTable;
+
+	// Decoder thread state
+
+	// Tracks by the tick of their next event, soonest first.
+	int* trackHeap;
+	int trackHeapSize;
+
+	// Tempo map, built as tempo changes are read.
+	struct midi_tempo_map tempoMap;
+
+	// Number of notes started but not stopped yet, by (track, channel, key).
+	uint16_t* openNotes;
+
+	// When the decoder last woke up, for the profiler.
+	Uint64 decodeStart;
+
+	// Shared between the decoder and the playback thread
+
+	struct ringbuffer* events;
+	SDL_Thread* thread;
+	SDL_sem* wakeSemaphore;
+	atomic_bool quit;
+
+	atomic_int_least64_t playbackTime;
+	atomic_uint generation;
+	// Generation whose events have all been decoded, or -1.
+	atomic_int finishedGeneration;
+
+	// Playback thread state
+
+	// Playback time of the last wake-up sent to the decoder.
+	int64_t lastWakeTime;
+};
+
+struct midi_stream* midi_stream_open(const char* path, const struct midi_route* routes, int routeCount);
+void midi_stream_close(struct midi_stream* stream);
+void midi_stream_set_time(struct midi_stream* stream, int64_t time);
+void midi_stream_rewind(struct midi_stream* stream);
+bool midi_stream_peek(struct midi_stream* stream, struct midi_stream_event* event);
+void midi_stream_pop(struct midi_stream* stream);
+bool midi_stream_finished(struct midi_stream* stream);
@@ -21,6 +21,7 @@
 #pragma once
 
 #include <stdbool.h>
+#include <stdint.h>
 
 #define NOTE_C 0
 #define NOTE_Cs_Db 1
@@ -44,6 +45,13 @@
 #define NOTE_MIDI_TO_OCTAVE(midiKey) ((midiKey) / 12) - 1
 #define NOTE_MIDI_TO_KEY(midiKey) ((midiKey) % 12)
 
+// Playback times are in microseconds from the start of the piece. 64 bits
+// so that a long performance neither overflows nor has to be rounded.
+#define NOTE_TIME_FROM_MS(ms) ((int64_t)(ms) * 1000)
+
+// Scheduled time of a note that should sound as soon as possible.
+#define NOTE_TIME_NOW -1
+
 struct complex_note {
 	int key;
 	int octave;
@@ -56,9 +64,18 @@ struct complex_note {
 	bool marcato;
 	bool legatoNextNote;
 
-	int startTime;
-	int endTime;
+	int64_t startTime;
+	int64_t endTime;
 	bool playing;
+
+	// 0-127 value the note should be played at, with dynamics and
+	// articulations already taken into account. 0 means the instrument
+	// should work it out from its current dynamic.
+	int velocity;
+
+	// Playback time at which this noteOn or noteOff should be heard, or
+	// NOTE_TIME_NOW.
+	int64_t scheduledTime;
 };
 
 struct simple_note {
@@ -68,4 +85,8 @@ struct simple_note {
 	// (Optional) 0-127 value representing how loud the
 	// note should be.
 	int velocity;
+
+	// Playback time at which the note should start/stop sounding, or
+	// NOTE_TIME_NOW.
+	int64_t scheduledTime;
 };
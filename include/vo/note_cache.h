@@ -0,0 +1,41 @@
+/*	
+ *	SPDX-License-Identifier: GPL-3.0-only
+ *
+ *  Virtual Orchestra - Musical Instrument Simulation
+ *  Copyright (C) 2024 Garnek0 (Popa Vlad) and Contributors
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <vo/midi.h>
+
+// Bump whenever the layout of cache files or the way notes are parsed
+// changes, old cache files are then ignored.
+#define NOTE_CACHE_VERSION 2
+
+// Identifies the notes a MIDI file produces for a set of routes. A cache
+// file is only used if its key matches exactly.
+struct note_cache_key {
+	uint64_t sourceSize;
+	int64_t sourceModifiedTime;
+	uint64_t sourceHash; // FNV-1a over the whole file
+	uint64_t routeSignature;
+};
+
+int note_cache_make_key(const char* midiPath, const struct midi_route* routes, int routeCount, struct note_cache_key* key);
+int note_cache_load(const char* midiPath, const struct note_cache_key* key, const struct midi_route* routes, int routeCount);
+int note_cache_save(const char* midiPath, const struct note_cache_key* key, const struct midi_route* routes, int routeCount);
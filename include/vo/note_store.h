@@ -0,0 +1,78 @@
+/*	
+ *	SPDX-License-Identifier: GPL-3.0-only
+ *
+ *  Virtual Orchestra - Musical Instrument Simulation
+ *  Copyright (C) 2024 Garnek0 (Popa Vlad) and Contributors
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <vo/note.h>
+
+// Packed versions of the bools in struct complex_note.
+#define NOTE_FLAG_SFZ (1 << 0)
+#define NOTE_FLAG_ACCENT (1 << 1)
+#define NOTE_FLAG_STACCATO (1 << 2)
+#define NOTE_FLAG_MARCATO (1 << 3)
+#define NOTE_FLAG_LEGATO_NEXT_NOTE (1 << 4)
+#define NOTE_FLAG_PLAYING (1 << 5)
+// Scratch mark used by playback while seeking.
+#define NOTE_FLAG_SEEK_ACTIVE (1 << 6)
+// Reached by seeking while paused. The key is shown as pressed, but the
+// note is only struck once playback resumes.
+#define NOTE_FLAG_STRIKE_PENDING (1 << 7)
+
+// Memory mapping shared by the note stores that borrow their arrays from
+// it. Unmapped once the last of them lets go.
+struct note_store_mapping {
+	void* address;
+	size_t length;
+	int refCount;
+};
+
+// All the notes of an instrument, sorted by start time. Each property lives
+// in its own contiguous array, so a scan over the start times doesn't have
+// to drag the rest of the note through the cache with it.
+struct note_store {
+	int count;
+	int capacity;
+
+	// False if a note was appended out of order and note_store_sort()
+	// hasn't been called since.
+	bool sorted;
+
+	int64_t* startTime;
+	int64_t* endTime;
+	uint8_t* midiKey;
+	uint8_t* flags;
+
+	// Set if the arrays point into a mapping instead of being owned by the
+	// store. The mapping must be private and writable, so that changing a
+	// note (e.g. its flags during playback) only copies the page it is on.
+	// Appending copies the arrays out first.
+	struct note_store_mapping* mapping;
+};
+
+struct note_store* note_store_create();
+void note_store_destroy(struct note_store* store);
+void note_store_clear(struct note_store* store);
+int note_store_append(struct note_store* store, int64_t startTime, int64_t endTime, int midiKey, uint8_t flags);
+void note_store_sort(struct note_store* store);
+void note_store_borrow(struct note_store* store, struct note_store_mapping* mapping, int count, int64_t* startTime, int64_t* endTime, uint8_t* midiKey, uint8_t* flags);
+void note_store_get(struct note_store* store, int index, struct complex_note* note);
@@ -20,6 +20,21 @@
 
 #pragma once
 
+#include <stdbool.h>
+#include <vo/note.h>
+#include <vo/instruments/instrument.h>
+#include <vo/midi_stream.h>
+
 int playback_init();
 void playback_iteration();
 void playback_reset();
+void playback_start();
+void playback_advance(int64_t deltaTime);
+void playback_seek(int64_t time);
+void playback_set_stream(struct midi_stream* midiStream);
+bool playback_finished();
+bool playback_is_playing();
+int playback_start_thread();
+void playback_stop_thread();
+void playback_play_note(struct instrument* instr, struct complex_note note);
+void playback_release_note(struct instrument* instr, struct complex_note note);
@@ -0,0 +1,73 @@
+/*	
+ *	SPDX-License-Identifier: GPL-3.0-only
+ *
+ *  Virtual Orchestra - Musical Instrument Simulation
+ *  Copyright (C) 2024 Garnek0 (Popa Vlad) and Contributors
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <SDL2/SDL.h>
+
+// Threads that can record events at the same time.
+#define PROFILER_MAX_THREADS 8
+// Events kept per thread, older ones get overwritten. Must be a power of
+// two.
+#define PROFILER_EVENTS_PER_THREAD 8192
+// Different scope names the summary keeps apart.
+#define PROFILER_MAX_SCOPES 16
+
+struct profiler_event {
+	// Must outlive the profiler, normally a string literal.
+	const char* name;
+	// Performance counter values.
+	Uint64 start, end;
+};
+
+// Timings of one scope over the summarized period, in ms.
+struct profiler_scope_stats {
+	const char* name;
+	int count;
+	double p50, p95, p99, max;
+};
+
+// Use profiler_set_enabled() to change this.
+extern atomic_bool profilerEnabled;
+
+// Time a scope on a registered thread:
+//
+//     Uint64 start = PROFILER_BEGIN();
+//     ...
+//     PROFILER_END("name", start);
+//
+// While the profiler is off this costs a relaxed load and a branch.
+#define PROFILER_BEGIN() \
+	(atomic_load_explicit(&profilerEnabled, memory_order_relaxed) ? SDL_GetPerformanceCounter() : 0)
+#define PROFILER_END(name, start) \
+	do { if (start) profiler_record((name), (start), SDL_GetPerformanceCounter()); } while (0)
+
+void profiler_init();
+int profiler_register_thread(const char* name);
+void profiler_unregister_thread();
+void profiler_set_enabled(bool enabled);
+bool profiler_is_enabled();
+void profiler_record(const char* name, Uint64 start, Uint64 end);
+void profiler_mark_frame();
+int profiler_get_events(int thread, struct profiler_event* events, int maxEvents);
+int profiler_summarize(struct profiler_scope_stats* stats, int maxScopes, int periodMs);
+int profiler_export_trace(const char* path);
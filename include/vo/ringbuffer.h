@@ -0,0 +1,46 @@
+/*	
+ *	SPDX-License-Identifier: GPL-3.0-only
+ *
+ *  Virtual Orchestra - Musical Instrument Simulation
+ *  Copyright (C) 2024 Garnek0 (Popa Vlad) and Contributors
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+// Lock-free queue of fixed-size elements. Exactly one thread may push and
+// exactly one (possibly different) thread may peek/pop.
+struct ringbuffer {
+	void* data;
+	size_t elementSize;
+
+	// Always a power of two
+	unsigned int capacity;
+
+	// Free-running counters, masked with capacity-1 to index data.
+	atomic_uint head; // Next element to be read
+	atomic_uint tail; // Next element to be written
+};
+
+struct ringbuffer* ringbuffer_create(size_t elementSize, unsigned int capacity);
+void ringbuffer_destroy(struct ringbuffer* ring);
+bool ringbuffer_push(struct ringbuffer* ring, const void* element);
+bool ringbuffer_peek(struct ringbuffer* ring, void* element);
+bool ringbuffer_pop(struct ringbuffer* ring, void* element);
+unsigned int ringbuffer_count(struct ringbuffer* ring);
@@ -0,0 +1,42 @@
+/*	
+ *	SPDX-License-Identifier: GPL-3.0-only
+ *
+ *  Virtual Orchestra - Musical Instrument Simulation
+ *  Copyright (C) 2024 Garnek0 (Popa Vlad) and Contributors
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <SDL2/SDL.h>
+
+// A piece of work running on a thread of its own, e.g. loading a file
+// while the main thread gets on with something else.
+struct task {
+	const char* name;
+	SDL_Thread* thread;
+
+	int (*function)(void* data);
+	void* data;
+
+	atomic_bool done;
+	int result;
+};
+
+struct task* task_start(const char* name, int (*function)(void* data), void* data);
+bool task_is_done(struct task* task);
+int task_wait(struct task* task);
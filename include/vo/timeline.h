@@ -0,0 +1,70 @@
+/*	
+ *	SPDX-License-Identifier: GPL-3.0-only
+ *
+ *  Virtual Orchestra - Musical Instrument Simulation
+ *  Copyright (C) 2024 Garnek0 (Popa Vlad) and Contributors
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <vo/list.h>
+#include <vo/interval_index.h>
+#include <vo/instruments/instrument.h>
+
+#define TIMELINE_EVENT_NOTE_OFF 0
+#define TIMELINE_EVENT_NOTE_ON 1
+
+struct timeline_event {
+	int64_t time;
+
+	struct instrument* instr;
+	int note; // Index into instr->noteList
+
+	uint8_t type;
+	uint8_t velocity;
+};
+
+// The notes of one instrument by when they actually sound, for finding
+// the ones that are playing at any point in time.
+struct timeline_instrument {
+	struct instrument* instr;
+	struct interval_index* activeNotes;
+};
+
+// Every noteOn and noteOff of every instrument, sorted by time, with
+// articulations already applied. Playback only has to walk it forward.
+struct timeline {
+	int eventCount;
+	int maxEventsBeforeRealloc;
+
+	struct timeline_event* events;
+
+	int instrumentCount;
+	int maxInstrumentsBeforeRealloc;
+	struct timeline_instrument* instruments;
+
+	// Scratch space for the note end times while indexing an instrument.
+	int maxNoteEndsBeforeRealloc;
+	int64_t* noteEnds;
+};
+
+struct timeline* timeline_create();
+void timeline_destroy(struct timeline* timeline);
+int timeline_build(struct timeline* timeline, struct list* instruments);
+int timeline_find_event(struct timeline* timeline, int64_t time);
+int timeline_note_velocity(struct instrument* instr, uint8_t flags);
+int64_t timeline_get_end_time(struct timeline* timeline);
@@ -22,47 +22,701 @@
 #include <vo/debug.h>
 #include <vo/list.h>
 #include <vo/note.h>
+#include <vo/profiler.h>
+#include <vo/ringbuffer.h>
+#include <vo/soundfont.h>
+#include <vo/task.h>
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
 
 // Virtual Orchestra's audio engine uses fluidsynth 
 // for SF loading and playing, but I am hoping to 
 // write my own thing in the future.
 
+#define AUDIO_EVENT_NOTE_ON 0
+#define AUDIO_EVENT_NOTE_OFF 1
+
+// How many note events can be waiting for the audio thread per instrument.
+#define AUDIO_EVENT_QUEUE_SIZE 1024
+
+// Notes are scheduled the device buffer plus this far ahead of the audio
+// thread's position. Covers the playback thread waking up late, otherwise
+// notes arrive after the sample they were meant for.
+#define AUDIO_SCHEDULE_MARGIN_MS 5
+
+// Max number of instruments the mixer can pull from. Each one plays on its
+// own MIDI channel of the shared synth, so this must be a multiple of 16.
+#define AUDIO_MAX_INSTRUMENTS 64
+
+// Upper limit on the shared synth's polyphony.
+#define AUDIO_MAX_VOICES 4096
+
+// Selectable device buffer sizes. Smaller periods mean lower latency but
+// less room for the mixer to be late before the device runs dry.
+static const struct audio_latency_profile latencyProfiles[] = {
+	{.name = "low", .periodSize = 64, .periods = 2},
+	{.name = "medium", .periodSize = 128, .periods = 2},
+	{.name = "high", .periodSize = 256, .periods = 2},
+	{.name = "safe", .periodSize = 1024, .periods = 4}
+};
+
+static const struct audio_latency_profile* latencyProfile = &latencyProfiles[2];
+
+// Render time counters. Only the audio thread adds to them, readers may
+// see the fields of one period only partly updated.
+struct audio_timing_counters {
+	atomic_uint_least64_t count;
+	// Performance counter ticks.
+	atomic_uint_least64_t totalTicks, lastTicks, maxTicks;
+	atomic_uint histogram[AUDIO_STATS_HISTOGRAM_BUCKETS];
+};
+
+struct audio_instrument_counters {
+	atomic_int activeVoices, peakVoices;
+	atomic_int polyphony;
+};
+
+struct audio_event {
+	uint64_t sample;
+	unsigned int flushGeneration;
+
+	uint8_t type;
+	uint8_t midiKey;
+	uint8_t velocity;
+};
+
 static fluid_settings_t* settings;
 
+// Every instrument plays through this one synth, on the MIDI channel of its
+// mixer slot. That way a soundfont's samples are only loaded once no matter
+// how many instruments use it.
+static fluid_synth_t* synth;
+
+// Sum of the polyphony every instrument asked for. FluidSynth can only
+// limit voices for the whole synth, not per channel.
+static int totalPolyphony;
+static SDL_mutex* polyphonyMutex;
+
+// Set when rendering offline. There is no output stream then and nothing
+// is ever late, so notes are scheduled without any delay.
+static bool offline;
+
+// The one output stream every instrument is mixed into.
+static fluid_audio_driver_t* audioDriver;
+
+static double sampleRate;
+static uint64_t scheduleDelaySamples;
+
+// Number of samples the mixer has rendered.
+static atomic_uint_least64_t sampleClock;
+
+// Bumped to make the audio thread silence every synth and drop every event
+// queued before the bump.
+static atomic_uint flushGeneration;
+
+// Incremented every time the mixer finishes a period. Used to tell when
+// the audio thread can no longer be touching a removed instrument.
+static atomic_uint mixPasses;
+
+// Instruments the mixer pulls from, by channel. A slot is reserved by the
+// thread loading the instrument, filled in once its channel is set up and
+// emptied by audio_fini_instrument().
+static _Atomic(struct instrument*) mixInstruments[AUDIO_MAX_INSTRUMENTS];
+static atomic_bool channelReserved[AUDIO_MAX_INSTRUMENTS];
+
+// Last audio flush the synth was silenced for. Only touched by the audio
+// thread.
+static unsigned int appliedFlushGeneration;
+
+// Voices playing on the synth, refilled every period by the audio thread.
+static fluid_voice_t* voiceList[AUDIO_MAX_VOICES];
+
+// Estimated device buffer fill (in samples) and the time of the previous
+// period. Only touched by the audio thread.
+static double bufferFill;
+static Uint64 lastMixTime;
+
+static atomic_uint estimatedUnderrunCount;
+
+// Frames rendered by the last call to audio_render().
+static atomic_int lastRenderSize;
+
+static struct audio_timing_counters mixCounters;
+// Same slots as mixInstruments.
+static struct audio_instrument_counters instrumentCounters[AUDIO_MAX_INSTRUMENTS];
+
+// Sample at which the playback time passed to audio_sync() is heard, and
+// that playback time.
+static uint64_t syncSample;
+static int64_t syncTime;
+
+// Pop the earliest event of any instrument that is due within the len
+// samples starting at now. Returns the channel it is for, or -1 if no event
+// is due.
+static int audio_pop_next_event(uint64_t now, int len, unsigned int generation, struct audio_event* next) {
+	struct instrument* nextInstr = NULL;
+	int nextChannel = -1;
+
+	for (int i = 0; i < AUDIO_MAX_INSTRUMENTS; i++) {
+		struct instrument* instr = atomic_load_explicit(&mixInstruments[i], memory_order_acquire);
+
+		if (!instr)
+			continue;
+
+		struct audio_event event;
+		bool pending;
+
+		// Queued before a flush, drop it.
+		while ((pending = ringbuffer_peek(instr->audioEvents, &event)) && (int)(event.flushGeneration - generation) < 0)
+			ringbuffer_pop(instr->audioEvents, NULL);
+
+		// Queued after a flush we haven't seen yet, or not due yet. Wait for
+		// the next period.
+		if (!pending || event.flushGeneration != generation || event.sample >= now + len)
+			continue;
+
+		if (!nextInstr || event.sample < next->sample) {
+			*next = event;
+			nextInstr = instr;
+			nextChannel = i;
+		}
+	}
+
+	if (nextInstr)
+		ringbuffer_pop(nextInstr->audioEvents, NULL);
+
+	return nextChannel;
+}
+
+// Render the synth from *rendered up to offset.
+static void audio_render_until(float* left, float* right, int* rendered, int offset) {
+	if (offset <= *rendered)
+		return;
+
+	fluid_synth_write_float(synth, offset - *rendered, left, *rendered, 1, right, *rendered, 1);
+	*rendered = offset;
+}
+
+// Output stream callback. Runs on the audio driver's thread.
+static int audio_mix_callback(void* data, int len, int nfx, float* fx[], int nout, float* out[]) {
+	if (nout < 2)
+		return FLUID_FAILED;
+
+	// There is no portable way to ask the device about underruns, so keep
+	// a model of how full its buffer is: it drains in real time and every
+	// period refills it. If it would have drained completely before this
+	// period, the device ran dry.
+
+	Uint64 mixTime = SDL_GetPerformanceCounter();
+	double bufferSize = (double)len * latencyProfile->periods;
+
+	if (lastMixTime) {
+		bufferFill -= (double)(mixTime - lastMixTime) / SDL_GetPerformanceFrequency() * sampleRate;
+
+		if (bufferFill < 0) {
+			atomic_fetch_add_explicit(&estimatedUnderrunCount, 1, memory_order_relaxed);
+			bufferFill = 0;
+		}
+	} else {
+		// First period, the driver's thread has just started.
+		profiler_register_thread("audio");
+		bufferFill = bufferSize;
+	}
+
+	bufferFill = bufferFill + len > bufferSize ? bufferSize : bufferFill + len;
+	lastMixTime = mixTime;
+
+	audio_render(out[0], out[1], len);
+
+	return FLUID_OK;
+}
+
+static void audio_record_timing(struct audio_timing_counters* counters, Uint64 ticks, double budgetTicks) {
+	atomic_fetch_add_explicit(&counters->count, 1, memory_order_relaxed);
+	atomic_fetch_add_explicit(&counters->totalTicks, ticks, memory_order_relaxed);
+	atomic_store_explicit(&counters->lastTicks, ticks, memory_order_relaxed);
+
+	if (ticks > atomic_load_explicit(&counters->maxTicks, memory_order_relaxed))
+		atomic_store_explicit(&counters->maxTicks, ticks, memory_order_relaxed);
+
+	int bucket = (int)(ticks * 100 / (budgetTicks * AUDIO_STATS_BUCKET_PERCENT));
+	if (bucket >= AUDIO_STATS_HISTOGRAM_BUCKETS)
+		bucket = AUDIO_STATS_HISTOGRAM_BUCKETS - 1;
+
+	atomic_fetch_add_explicit(&counters->histogram[bucket], 1, memory_order_relaxed);
+}
+
+static void audio_reset_timing(struct audio_timing_counters* counters) {
+	atomic_store_explicit(&counters->count, 0, memory_order_relaxed);
+	atomic_store_explicit(&counters->totalTicks, 0, memory_order_relaxed);
+	atomic_store_explicit(&counters->lastTicks, 0, memory_order_relaxed);
+	atomic_store_explicit(&counters->maxTicks, 0, memory_order_relaxed);
+
+	for (int i = 0; i < AUDIO_STATS_HISTOGRAM_BUCKETS; i++)
+		atomic_store_explicit(&counters->histogram[i], 0, memory_order_relaxed);
+}
+
+static void audio_read_timing(struct audio_timing_counters* counters, struct audio_timing_stats* stats) {
+	double tickTime = 1000.0 / SDL_GetPerformanceFrequency();
+
+	stats->count = atomic_load_explicit(&counters->count, memory_order_relaxed);
+	stats->averageTime = stats->count ? atomic_load_explicit(&counters->totalTicks, memory_order_relaxed) * tickTime / stats->count : 0;
+	stats->lastTime = atomic_load_explicit(&counters->lastTicks, memory_order_relaxed) * tickTime;
+	stats->maxTime = atomic_load_explicit(&counters->maxTicks, memory_order_relaxed) * tickTime;
+
+	for (int i = 0; i < AUDIO_STATS_HISTOGRAM_BUCKETS; i++)
+		stats->histogram[i] = atomic_load_explicit(&counters->histogram[i], memory_order_relaxed);
+}
+
+// Render every instrument into left and right, then advance the sample
+// clock by len. Called from the output stream's callback, or directly when
+// rendering offline.
+void audio_render(float* left, float* right, int len) {
+	Uint64 renderStart = SDL_GetPerformanceCounter();
+	Uint64 profilerStart = PROFILER_BEGIN();
+
+	uint64_t now = atomic_load_explicit(&sampleClock, memory_order_relaxed);
+	unsigned int generation = atomic_load_explicit(&flushGeneration, memory_order_acquire);
+
+	if (generation != appliedFlushGeneration) {
+		fluid_synth_all_notes_off(synth, -1);
+		appliedFlushGeneration = generation;
+	}
+
+	// All instruments share the synth, so their queues are merged: render
+	// up to the next event of any instrument, apply it on that instrument's
+	// channel, repeat.
+
+	int rendered = 0;
+	struct audio_event event;
+	int channel;
+
+	while ((channel = audio_pop_next_event(now, len, generation, &event)) >= 0) {
+		audio_render_until(left, right, &rendered, event.sample > now ? (int)(event.sample - now) : 0);
+
+		if (event.type == AUDIO_EVENT_NOTE_ON)
+			fluid_synth_noteon(synth, channel, event.midiKey, event.velocity);
+		else
+			fluid_synth_noteoff(synth, channel, event.midiKey);
+	}
+
+	audio_render_until(left, right, &rendered, len);
+
+	// Count the voices of every channel.
+
+	int voices[AUDIO_MAX_INSTRUMENTS] = {0};
+
+	fluid_synth_get_voicelist(synth, voiceList, AUDIO_MAX_VOICES, -1);
+
+	for (int i = 0; i < AUDIO_MAX_VOICES && voiceList[i]; i++) {
+		int voiceChannel = fluid_voice_get_channel(voiceList[i]);
+
+		if (fluid_voice_is_playing(voiceList[i]) && voiceChannel >= 0 && voiceChannel < AUDIO_MAX_INSTRUMENTS)
+			voices[voiceChannel]++;
+	}
+
+	for (int i = 0; i < AUDIO_MAX_INSTRUMENTS; i++) {
+		if (!atomic_load_explicit(&mixInstruments[i], memory_order_acquire))
+			continue;
+
+		struct audio_instrument_counters* counters = &instrumentCounters[i];
+
+		atomic_store_explicit(&counters->activeVoices, voices[i], memory_order_relaxed);
+
+		if (voices[i] > atomic_load_explicit(&counters->peakVoices, memory_order_relaxed))
+			atomic_store_explicit(&counters->peakVoices, voices[i], memory_order_relaxed);
+	}
+
+	// Time the mix took against the time the period lasts.
+	double budgetTicks = (double)len / sampleRate * SDL_GetPerformanceFrequency();
+
+	audio_record_timing(&mixCounters, SDL_GetPerformanceCounter() - renderStart, budgetTicks);
+	atomic_store_explicit(&lastRenderSize, len, memory_order_relaxed);
+
+	atomic_store_explicit(&sampleClock, now + len, memory_order_release);
+	atomic_fetch_add_explicit(&mixPasses, 1, memory_order_release);
+
+	PROFILER_END("audio_render", profilerStart);
+}
+
+// Add to (or with a negative polyphony, take from) the synth's polyphony.
+static void audio_add_polyphony(int polyphony) {
+	SDL_LockMutex(polyphonyMutex);
+
+	totalPolyphony += polyphony;
+
+	if (totalPolyphony > 0)
+		fluid_synth_set_polyphony(synth, totalPolyphony < AUDIO_MAX_VOICES ? totalPolyphony : AUDIO_MAX_VOICES);
+
+	SDL_UnlockMutex(polyphonyMutex);
+}
+
+// What loading an instrument's sound on a worker thread needs.
+struct audio_instrument_load {
+	struct instrument* instr;
+
+	char* soundfontPath;
+	int bank, preset;
+	int polyphony;
+};
+
+// Load the instrument's soundfont (or share it with other instruments),
+// set up a channel for it and hand it to the mixer. Runs on a worker
+// thread, the soundfont can take a while.
+static int audio_load_instrument(void* data) {
+	struct audio_instrument_load* load = (struct audio_instrument_load*)data;
+	struct instrument* instr = load->instr;
+	int result = -1;
+	int channel = -1;
+
+	int soundfontID = soundfont_acquire(load->soundfontPath);
+	if (soundfontID == -1)
+		goto done;
+
+	for (int i = 0; i < AUDIO_MAX_INSTRUMENTS && channel < 0; i++) {
+		bool expected = false;
+
+		if (atomic_compare_exchange_strong(&channelReserved[i], &expected, true))
+			channel = i;
+	}
+
+	if (channel < 0) {
+		debug_log(LOGLEVEL_ERROR, "Audio Engine: Can't mix more than %d instruments!\n", AUDIO_MAX_INSTRUMENTS);
+		soundfont_release(soundfontID);
+		goto done;
+	}
+
+	if (fluid_synth_program_select(synth, channel, soundfontID, load->bank, load->preset) != FLUID_OK) {
+		debug_log(LOGLEVEL_ERROR, "Audio Engine: FluidSynth: Soundfont \"%s\" has no preset %d:%d!\n", load->soundfontPath, load->bank, load->preset);
+		soundfont_release(soundfontID);
+		atomic_store(&channelReserved[channel], false);
+		goto done;
+	}
+
+	audio_add_polyphony(load->polyphony);
+	atomic_store_explicit(&instrumentCounters[channel].polyphony, load->polyphony, memory_order_relaxed);
+
+	instr->audioChannel = channel;
+	instr->soundfontID = soundfontID;
+
+	// Hand the instrument over to the mixer only once its channel is set up.
+	atomic_store_explicit(&mixInstruments[channel], instr, memory_order_release);
+	result = 0;
+
+done:
+	free((void*)load->soundfontPath);
+	free((void*)load);
+
+	return result;
+}
+
+// A NULL soundfontPath makes a silent instrument, which is still drawn and
+// played but never reaches the mixer. Otherwise the soundfont is loaded in
+// the background, use audio_wait_instrument() before playing anything.
 int audio_init_instrument(struct instrument* instr, const char* soundfontPath, int bank, int preset, int polyphony) {
-	instr->synth = new_fluid_synth(settings);
+	instr->audioChannel = -1;
+
+	if (!soundfontPath)
+		return 0;
 
-	if (!instr->synth) {
-		debug_log(LOGLEVEL_ERROR, "Audio Engine: FluidSynth: Failed to create new synth for instrument with ID %d!\n", instr->id);
+	instr->audioEvents = ringbuffer_create(sizeof(struct audio_event), AUDIO_EVENT_QUEUE_SIZE);
+	if (!instr->audioEvents) {
+		debug_log(LOGLEVEL_ERROR, "Audio Engine: Failed to create event queue for instrument with ID %d!\n", instr->id);
 		return -1;
 	}
 
-	int soundfontID;
-	if ((soundfontID = fluid_synth_sfload(instr->synth, soundfontPath, 1)) == -1) {
-		debug_log(LOGLEVEL_ERROR, "Audio Engine: FluidSynth: Failed to load soundfont file \"%s\"!\n", soundfontPath);
-		return -1;
+	struct audio_instrument_load* load = malloc(sizeof(struct audio_instrument_load));
+
+	if (load) {
+		load->instr = instr;
+		load->soundfontPath = strdup(soundfontPath);
+		load->bank = bank;
+		load->preset = preset;
+		load->polyphony = polyphony;
+
+		instr->audioLoadTask = task_start("vo-soundfont", audio_load_instrument, (void*)load);
 	}
 
-	fluid_synth_set_polyphony(instr->synth, polyphony);
-	fluid_synth_set_gain(instr->synth, 5.0);
+	if (!instr->audioLoadTask) {
+		debug_log(LOGLEVEL_ERROR, "Audio Engine: Failed to start loading instrument with ID %d!\n", instr->id);
 
-	instr->audioDriver = new_fluid_audio_driver(settings, instr->synth);
-	if (!instr->audioDriver) {
-		debug_log(LOGLEVEL_ERROR, "Audio Engine: FluidSynth: Failed to create new audio driver for instrument with ID %d!\n", instr->id);
+		if (load)
+			free((void*)load->soundfontPath);
+		free((void*)load);
+
+		ringbuffer_destroy(instr->audioEvents);
+		instr->audioEvents = NULL;
 		return -1;
 	}
 
-	fluid_synth_program_select(instr->synth, 0, soundfontID, bank, preset);
+	return 0;
+}
+
+bool audio_is_instrument_loading(struct instrument* instr) {
+	return instr->audioLoadTask && !task_is_done(instr->audioLoadTask);
+}
+
+// Wait for the instrument's sound to finish loading. Returns -1 if it
+// failed, the instrument is silent from then on.
+int audio_wait_instrument(struct instrument* instr) {
+	if (!instr->audioLoadTask)
+		return 0;
+
+	int result = task_wait(instr->audioLoadTask);
+	instr->audioLoadTask = NULL;
+
+	if (result != 0) {
+		ringbuffer_destroy(instr->audioEvents);
+		instr->audioEvents = NULL;
+	}
+
+	return result;
+}
+
+void audio_fini_instrument(struct instrument* instr) {
+	audio_wait_instrument(instr);
+
+	int channel = instr->audioChannel;
+
+	if (channel < 0)
+		return;
+
+	atomic_store(&mixInstruments[channel], NULL);
+
+	// The mixer may still be in the middle of applying this instrument's
+	// events. Once two more periods have started it can't be anymore.
+	// Don't wait forever in case the audio device has stopped calling us.
+	unsigned int passes = atomic_load(&mixPasses);
+	for (int i = 0; i < 500 && audioDriver && atomic_load(&mixPasses) - passes < 2; i++)
+		SDL_Delay(1);
+
+	// Cut off whatever still rings on the channel before its soundfont may
+	// go away.
+	fluid_synth_all_sounds_off(synth, channel);
+	soundfont_release(instr->soundfontID);
+	audio_add_polyphony(-atomic_load(&instrumentCounters[channel].polyphony));
+
+	// The next instrument on this channel starts counting from scratch.
+	atomic_store(&instrumentCounters[channel].activeVoices, 0);
+	atomic_store(&instrumentCounters[channel].peakVoices, 0);
+	atomic_store(&instrumentCounters[channel].polyphony, 0);
+
+	atomic_store(&channelReserved[channel], false);
+
+	ringbuffer_destroy(instr->audioEvents);
+	instr->audioEvents = NULL;
+	instr->audioChannel = -1;
+}
+
+// Map a playback time to the sample of the output stream at which it
+// should be heard.
+static uint64_t audio_schedule_sample(int64_t time) {
+	uint64_t now = atomic_load_explicit(&sampleClock, memory_order_acquire);
+
+	if (time == NOTE_TIME_NOW)
+		return now;
+
+	// Exact in integers, so a late note lands on the same sample however
+	// long playback has been running.
+	int64_t sample = (int64_t)syncSample + (time - syncTime) * (int64_t)sampleRate / 1000000;
+
+	// If the event would land in the past (playback stalled for longer than
+	// the schedule delay) or suspiciously far in the future (the clocks
+	// drifted apart), move the sync point so that this event lands exactly
+	// one schedule delay ahead again. Later events keep the new spacing.
+	if (!offline && (sample < (int64_t)now || sample > (int64_t)(now + 2*scheduleDelaySamples))) {
+		int64_t target = (int64_t)(now + scheduleDelaySamples);
+
+		syncSample += target - sample;
+		sample = target;
+	}
+
+	return (uint64_t)sample;
+}
+
+// Move an instrument's queued events into a queue twice the size. Only
+// safe offline, when nothing pops from the queue meanwhile.
+static int audio_grow_event_queue(struct instrument* instr) {
+	struct ringbuffer* newEvents = ringbuffer_create(sizeof(struct audio_event), instr->audioEvents->capacity * 2);
+	if (!newEvents)
+		return -1;
+
+	struct audio_event event;
+
+	while (ringbuffer_pop(instr->audioEvents, &event))
+		ringbuffer_push(newEvents, &event);
+
+	ringbuffer_destroy(instr->audioEvents);
+	instr->audioEvents = newEvents;
 
 	return 0;
 }
 
+static void audio_queue_event(struct instrument* instr, int type, struct simple_note note) {
+	struct audio_event event;
+
+	// Silent instrument
+	if (!instr->audioEvents)
+		return;
+
+	event.sample = audio_schedule_sample(note.scheduledTime);
+	event.flushGeneration = atomic_load_explicit(&flushGeneration, memory_order_relaxed);
+
+	// A re-sync can move the schedule back. Keep the event from landing
+	// before one already queued, it would be stuck behind it until then.
+	if (event.flushGeneration == instr->audioLastQueuedFlushGeneration && event.sample < instr->audioLastQueuedSample)
+		event.sample = instr->audioLastQueuedSample;
+
+	instr->audioLastQueuedSample = event.sample;
+	instr->audioLastQueuedFlushGeneration = event.flushGeneration;
+	event.type = type;
+	event.midiKey = NOTE_TO_MIDI_KEY(note.key, note.octave);
+	event.velocity = note.velocity;
+
+	// Offline, a whole block's notes are queued before the block is
+	// rendered, and dense music can have more than fit. Nothing drains the
+	// queue in between, so make room instead of losing notes.
+	if (offline && ringbuffer_count(instr->audioEvents) == instr->audioEvents->capacity && audio_grow_event_queue(instr) != 0)
+		debug_log(LOGLEVEL_ERROR, "Audio Engine: Failed to grow the event queue for instrument with ID %d!\n", instr->id);
+
+	if (!ringbuffer_push(instr->audioEvents, &event))
+		debug_log(LOGLEVEL_WARN, "Audio Engine: Event queue for instrument with ID %d is full, dropping note!\n", instr->id);
+}
+
 void audio_note_on(struct instrument* instr, struct simple_note note) {
-	fluid_synth_noteon(instr->synth, 0, NOTE_TO_MIDI_KEY(note.key, note.octave), note.velocity);
+	audio_queue_event(instr, AUDIO_EVENT_NOTE_ON, note);
 }
 
 void audio_note_off(struct instrument* instr, struct simple_note note) {
-	fluid_synth_noteoff(instr->synth, 0, NOTE_TO_MIDI_KEY(note.key, note.octave));
+	audio_queue_event(instr, AUDIO_EVENT_NOTE_OFF, note);
+}
+
+// Notes scheduled for playbackTime from now on will be heard one schedule
+// delay from now. Call whenever playback (re)starts.
+void audio_sync(int64_t playbackTime) {
+	syncTime = playbackTime;
+	syncSample = atomic_load_explicit(&sampleClock, memory_order_acquire) + scheduleDelaySamples;
+}
+
+// Drop every note that hasn't been heard yet and silence all instruments.
+void audio_flush() {
+	atomic_fetch_add_explicit(&flushGeneration, 1, memory_order_release);
+}
+
+// Pick a latency profile by name or by period size. Must be called before
+// audio_init().
+int audio_set_latency_profile(const char* name) {
+	for (size_t i = 0; i < sizeof(latencyProfiles)/sizeof(latencyProfiles[0]); i++) {
+		if (strcmp(name, latencyProfiles[i].name) == 0 || atoi(name) == latencyProfiles[i].periodSize) {
+			latencyProfile = &latencyProfiles[i];
+			return 0;
+		}
+	}
+
+	debug_log(LOGLEVEL_ERROR, "Audio Engine: Unknown latency profile \"%s\"! Available profiles are:\n", name);
+
+	for (size_t i = 0; i < sizeof(latencyProfiles)/sizeof(latencyProfiles[0]); i++)
+		debug_log(LOGLEVEL_ERROR, "  %s (%d frames x %d periods)\n", latencyProfiles[i].name, latencyProfiles[i].periodSize, latencyProfiles[i].periods);
+
+	return -1;
+}
+
+// Underruns as estimated by the mix callback's model of the device buffer.
+// FluidSynth doesn't pass on the drivers' own xrun counts.
+unsigned int audio_get_estimated_underrun_count() {
+	return atomic_load_explicit(&estimatedUnderrunCount, memory_order_relaxed);
+}
+
+void audio_get_stats(struct audio_stats* stats) {
+	stats->periodSize = atomic_load_explicit(&lastRenderSize, memory_order_relaxed);
+	stats->periodBudget = sampleRate > 0 ? stats->periodSize * 1000.0 / sampleRate : 0;
+	stats->estimatedUnderrunCount = audio_get_estimated_underrun_count();
+
+	stats->activeVoices = fluid_synth_get_active_voice_count(synth);
+	stats->polyphony = fluid_synth_get_polyphony(synth);
+	stats->cpuLoad = fluid_synth_get_cpu_load(synth);
+
+	audio_read_timing(&mixCounters, &stats->callback);
+}
+
+// Returns -1 if the instrument isn't mixed (e.g. it is silent).
+int audio_get_instrument_stats(struct instrument* instr, struct audio_instrument_stats* stats) {
+	for (int i = 0; i < AUDIO_MAX_INSTRUMENTS; i++) {
+		if (atomic_load_explicit(&mixInstruments[i], memory_order_acquire) != instr)
+			continue;
+
+		struct audio_instrument_counters* counters = &instrumentCounters[i];
+
+		stats->activeVoices = atomic_load_explicit(&counters->activeVoices, memory_order_relaxed);
+		stats->peakVoices = atomic_load_explicit(&counters->peakVoices, memory_order_relaxed);
+		stats->polyphony = atomic_load_explicit(&counters->polyphony, memory_order_relaxed);
+
+		return 0;
+	}
+
+	return -1;
+}
+
+// Start the render time statistics and voice peaks over. The underrun count
+// is kept. A period that is being recorded meanwhile may be partly lost.
+void audio_reset_stats() {
+	audio_reset_timing(&mixCounters);
+
+	for (int i = 0; i < AUDIO_MAX_INSTRUMENTS; i++)
+		atomic_store_explicit(&instrumentCounters[i].peakVoices, 0, memory_order_relaxed);
+}
+
+double audio_get_sample_rate() {
+	return sampleRate;
+}
+
+// Create the synth every instrument plays through. The settings must be
+// final by now.
+static int audio_init_synth() {
+	fluid_settings_setint(settings, "synth.midi-channels", AUDIO_MAX_INSTRUMENTS);
+
+	synth = new_fluid_synth(settings);
+	if (!synth) {
+		debug_log(LOGLEVEL_ERROR, "Audio Engine: FluidSynth: Failed to create new synth!\n");
+		return -1;
+	}
+
+	fluid_synth_set_gain(synth, 5.0);
+
+	polyphonyMutex = SDL_CreateMutex();
+	if (!polyphonyMutex) {
+		debug_log(LOGLEVEL_ERROR, "Audio Engine: Failed to create mutex: %s\n", SDL_GetError());
+		return -1;
+	}
+
+	return soundfont_init(synth);
+}
+
+// Set up the audio engine without opening an output stream. Samples are
+// only produced by calling audio_render().
+int audio_init_offline() {
+	settings = new_fluid_settings();
+
+	if (!settings) {
+		debug_log(LOGLEVEL_ERROR, "Audio Engine: FluidSynth: Failed to create new settings!\n");
+		return -1;
+	}
+
+	offline = true;
+
+	fluid_settings_getnum(settings, "synth.sample-rate", &sampleRate);
+	scheduleDelaySamples = 0;
+	syncSample = 0;
+
+	if (audio_init_synth() != 0)
+		return -1;
+
+	debug_log(LOGLEVEL_INFO, "Audio Engine: Rendering offline at %.0f Hz.\n", sampleRate);
+
+	return 0;
 }
 
 int audio_init() {
@@ -74,9 +728,59 @@ int audio_init() {
 		return -1;
 	}
 
-	// Default values are too low for what we're trying to do
-	fluid_settings_setint(settings, "audio.period-size", 1024);
-	fluid_settings_setint(settings, "audio.periods", 4);
+	fluid_settings_setint(settings, "audio.period-size", latencyProfile->periodSize);
+	fluid_settings_setint(settings, "audio.periods", latencyProfile->periods);
+
+	fluid_settings_getnum(settings, "synth.sample-rate", &sampleRate);
+	// A note has to wait for the buffer ahead of it to play out anyway, so
+	// smaller profiles schedule notes closer to the playback time too.
+	scheduleDelaySamples = (uint64_t)latencyProfile->periodSize * latencyProfile->periods + (uint64_t)(sampleRate * AUDIO_SCHEDULE_MARGIN_MS / 1000);
+	syncSample = scheduleDelaySamples;
+
+	if (audio_init_synth() != 0)
+		return -1;
+
+	// A single output stream for the whole stage, so adding instruments
+	// doesn't add audio threads.
+	audioDriver = new_fluid_audio_driver2(settings, audio_mix_callback, NULL);
+	if (!audioDriver) {
+		debug_log(LOGLEVEL_ERROR, "Audio Engine: FluidSynth: Failed to create audio driver!\n");
+		return -1;
+	}
+
+	// Report what was asked for. The size of the periods the device really
+	// asks for shows up in the audio stats (F5) and on exit.
+
+	char driverName[64] = "unknown";
+	int periodSize, periods;
+
+	fluid_settings_copystr(settings, "audio.driver", driverName, sizeof(driverName));
+	fluid_settings_getint(settings, "audio.period-size", &periodSize);
+	fluid_settings_getint(settings, "audio.periods", &periods);
+
+	debug_log(LOGLEVEL_INFO, "Audio Engine: Driver \"%s\", latency profile \"%s\": %d frames x %d periods at %.0f Hz.\n", driverName, latencyProfile->name, periodSize, periods, sampleRate);
+	debug_log(LOGLEVEL_INFO, "Audio Engine: Estimated output latency %.1f ms, notes are scheduled %.1f ms ahead.\n", periodSize * periods * 1000.0 / sampleRate, scheduleDelaySamples * 1000.0 / sampleRate);
 
 	return 0;	
 }
+
+void audio_fini() {
+	if (offline)
+		return;
+
+	delete_fluid_audio_driver(audioDriver);
+	audioDriver = NULL;
+
+	unsigned int underruns = audio_get_estimated_underrun_count();
+
+	if (underruns)
+		debug_log(LOGLEVEL_WARN, "Audio Engine: An estimated %u underruns with latency profile \"%s\", consider a larger one.\n", underruns, latencyProfile->name);
+	else
+		debug_log(LOGLEVEL_INFO, "Audio Engine: No underruns estimated with latency profile \"%s\".\n", latencyProfile->name);
+
+	struct audio_stats stats;
+	audio_get_stats(&stats);
+
+	if (stats.callback.count)
+		debug_log(LOGLEVEL_INFO, "Audio Engine: Mixing took %.2f ms on average and %.2f ms at worst, of a %.2f ms (%d frame) period.\n", stats.callback.averageTime, stats.callback.maxTime, stats.periodBudget, stats.periodSize);
+}
@@ -19,7 +19,6 @@
  */
 
 #include <vo/event.h>
-#include <vo/gfxui/renderer.h>
 #include <vo/list.h>
 
 #include <SDL2/SDL.h>
@@ -29,11 +28,15 @@ static bool quitSignaled = false;
 static struct list* keyboardCallbackList;
 static struct list* mouseWheelCallbackList;
 static struct list* mouseCallbackList;
+static struct list* windowCallbackList;
+static struct list* renderResetCallbackList;
 
 int event_init() {
 	keyboardCallbackList = list_create();
 	mouseWheelCallbackList = list_create();
 	mouseCallbackList = list_create();
+	windowCallbackList = list_create();
+	renderResetCallbackList = list_create();
 
 	return 0;
 }
@@ -42,6 +45,8 @@ void event_iteration() {
 	struct keyboard_callback* keyboardCallback;
 	struct mouse_wheel_callback* mouseWheelCallback;
 	struct mouse_callback* mouseCallback;
+	struct window_callback* windowCallback;
+	struct render_reset_callback* renderResetCallback;
 
 	SDL_Event event;
 	while(SDL_PollEvent(&event)) {
@@ -49,6 +54,16 @@ void event_iteration() {
 			case SDL_QUIT:
 				quitSignaled = true;
 				break;
+			// The renderer's textures (and whatever was drawn on them)
+			// are gone.
+			case SDL_RENDER_TARGETS_RESET:
+			case SDL_RENDER_DEVICE_RESET:
+				list_foreach(node, renderResetCallbackList) {
+					renderResetCallback = (struct render_reset_callback*)node->data;
+
+					renderResetCallback->callback();
+				}
+				break;
 			// Check for mouse wheel events. If there is a mouse wheel
 			// event in the event queue, call every registered mouse 
 			// wheel event callback.
@@ -66,6 +81,14 @@ void event_iteration() {
 					mouseWheelCallback->callback(event.wheel.x, event.wheel.y, event.wheel.preciseX, event.wheel.preciseY);
 				}	
 				break;
+			// Window state changes (resizing, minimizing, focus etc.)
+			case SDL_WINDOWEVENT:
+				list_foreach(node, windowCallbackList) {
+					windowCallback = (struct window_callback*)node->data;
+
+					windowCallback->callback(event.window.event, event.window.data1, event.window.data2);
+				}
+				break;
 			default:
 				break;
 		}
@@ -150,6 +173,36 @@ void event_remove_mouse_callback(struct mouse_callback* mouseCallback) {
 	free((void*)mouseCallback);
 }
 
+struct window_callback* event_register_window_callback(void (*callback)(Uint8, int, int)) {
+	struct window_callback* windowCallback = malloc(sizeof(struct window_callback));
+	windowCallback->callback = callback;
+
+	list_insert(windowCallbackList, (void*)windowCallback);
+
+	return windowCallback;
+}
+
+void event_remove_window_callback(struct window_callback* windowCallback) {
+	list_remove(windowCallbackList, (void*)windowCallback);
+
+	free((void*)windowCallback);
+}
+
+struct render_reset_callback* event_register_render_reset_callback(void (*callback)(void)) {
+	struct render_reset_callback* renderResetCallback = malloc(sizeof(struct render_reset_callback));
+	renderResetCallback->callback = callback;
+
+	list_insert(renderResetCallbackList, (void*)renderResetCallback);
+
+	return renderResetCallback;
+}
+
+void event_remove_render_reset_callback(struct render_reset_callback* renderResetCallback) {
+	list_remove(renderResetCallbackList, (void*)renderResetCallback);
+
+	free((void*)renderResetCallback);
+}
+
 bool event_has_signaled_quit() {
 	return quitSignaled;
 }
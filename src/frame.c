@@ -0,0 +1,155 @@
+/*	
+ *	SPDX-License-Identifier: GPL-3.0-only
+ *
+ *  Virtual Orchestra - Musical Instrument Simulation
+ *  Copyright (C) 2024 Garnek0 (Popa Vlad) and Contributors
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <vo/frame.h>
+#include <vo/debug.h>
+#include <vo/event.h>
+
+#include <SDL2/SDL.h>
+#include <math.h>
+
+// How often frame time statistics are logged.
+#define FRAME_STATS_PERIOD_MS 5000
+
+// Frame rate divider while the window is minimized.
+#define FRAME_MINIMIZED_DIVIDER 15
+
+// Frame rate divider while the window doesn't have input focus.
+#define FRAME_UNFOCUSED_DIVIDER 2
+
+static Uint64 frequency;
+static Uint64 frameInterval; // In performance counter ticks
+
+static Uint64 frameStart;
+
+static bool minimized;
+static bool focused = true;
+
+// Statistics accumulated since the last report
+static Uint64 statsStart;
+static int statsFrames;
+static double statsSum, statsSquareSum, statsMax;
+static struct frame_stats lastStats;
+
+static void frame_window_callback(Uint8 windowEvent, int data1, int data2) {
+	switch (windowEvent) {
+		case SDL_WINDOWEVENT_MINIMIZED:
+		case SDL_WINDOWEVENT_HIDDEN:
+			minimized = true;
+			break;
+		case SDL_WINDOWEVENT_RESTORED:
+		case SDL_WINDOWEVENT_MAXIMIZED:
+		case SDL_WINDOWEVENT_SHOWN:
+			minimized = false;
+			break;
+		case SDL_WINDOWEVENT_FOCUS_GAINED:
+			focused = true;
+			break;
+		case SDL_WINDOWEVENT_FOCUS_LOST:
+			focused = false;
+			break;
+		default:
+			break;
+	}
+}
+
+static void frame_record(Uint64 now) {
+	double frameTime = (double)(now - frameStart) * 1000 / frequency;
+
+	statsFrames++;
+	statsSum += frameTime;
+	statsSquareSum += frameTime * frameTime;
+	if (frameTime > statsMax)
+		statsMax = frameTime;
+
+	if ((now - statsStart) * 1000 / frequency < FRAME_STATS_PERIOD_MS)
+		return;
+
+	double average = statsSum / statsFrames;
+	double variance = statsSquareSum / statsFrames - average * average;
+
+	lastStats.averageFrameTime = average;
+	lastStats.jitter = variance > 0 ? sqrt(variance) : 0;
+	lastStats.maxFrameTime = statsMax;
+
+	debug_log(LOGLEVEL_DEBUG, "Frame: %.2f ms average (%.1f FPS), %.2f ms jitter, %.2f ms max.\n", lastStats.averageFrameTime, 1000 / lastStats.averageFrameTime, lastStats.jitter, lastStats.maxFrameTime);
+
+	statsStart = now;
+	statsFrames = 0;
+	statsSum = statsSquareSum = statsMax = 0;
+}
+
+int frame_init(int targetRate) {
+	frequency = SDL_GetPerformanceFrequency();
+	frameInterval = frequency / targetRate;
+
+	frameStart = statsStart = SDL_GetPerformanceCounter();
+
+	event_register_window_callback(frame_window_callback);
+
+	return 0;
+}
+
+// Sleep until the next frame is due or an input event arrives. Returns true
+// if a frame is due, false if it was woken up early by input. Playback runs
+// on its own thread, so the frame rate can drop whenever the window is out
+// of sight.
+bool frame_wait() {
+	Uint64 interval = frameInterval;
+
+	if (minimized)
+		interval *= FRAME_MINIMIZED_DIVIDER;
+	else if (!focused)
+		interval *= FRAME_UNFOCUSED_DIVIDER;
+
+	Uint64 deadline = frameStart + interval;
+
+	while (true) {
+		Uint64 now = SDL_GetPerformanceCounter();
+
+		if (now >= deadline) {
+			frame_record(now);
+
+			// Stay on the deadline grid unless we fell more than a whole
+			// frame behind, in which case catching up would only cause
+			// a burst of frames.
+			frameStart = now - deadline < interval ? deadline : now;
+
+			return true;
+		}
+
+		// Rounded up, waking up to a millisecond late is better than
+		// spinning through the rest.
+		int remaining = (int)(((deadline - now) * 1000 + frequency - 1) / frequency);
+
+		if (SDL_WaitEventTimeout(NULL, remaining))
+			return false;
+	}
+}
+
+// Whether the frame that was just started should be drawn. Nothing is drawn
+// while minimized.
+bool frame_should_draw() {
+	return !minimized;
+}
+
+void frame_get_stats(struct frame_stats* stats) {
+	*stats = lastStats;
+}
@@ -0,0 +1,164 @@
+/*	
+ *	SPDX-License-Identifier: GPL-3.0-only
+ *
+ *  Virtual Orchestra - Musical Instrument Simulation
+ *  Copyright (C) 2024 Garnek0 (Popa Vlad) and Contributors
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <vo/gfxui/audio_hud.h>
+#include <vo/gfxui/renderer.h>
+#include <vo/gfxui/font.h>
+#include <vo/instruments/instrument.h>
+#include <vo/audio.h>
+#include <vo/event.h>
+#include <vo/list.h>
+
+#include <math.h>
+#include <stdio.h>
+#include <SDL2/SDL.h>
+
+#define AUDIO_HUD_SCALE 2
+#define AUDIO_HUD_MARGIN 10
+#define AUDIO_HUD_LINE_HEIGHT ((FONT_GLYPH_HEIGHT + 2) * AUDIO_HUD_SCALE)
+#define AUDIO_HUD_CHAR_WIDTH ((FONT_GLYPH_WIDTH + 1) * AUDIO_HUD_SCALE)
+#define AUDIO_HUD_COLUMNS 56
+
+#define AUDIO_HUD_HISTOGRAM_HEIGHT 60
+#define AUDIO_HUD_HISTOGRAM_BAR_WIDTH 12
+
+static struct renderer_overlay* overlay;
+
+static void audio_hud_text(SDL_Renderer* renderer, int x, int* y, const char* text) {
+	font_draw_text(renderer, x, *y, AUDIO_HUD_SCALE, text);
+	*y += AUDIO_HUD_LINE_HEIGHT;
+}
+
+// Columns are colored by how close that render time is to running out of
+// time.
+static void audio_hud_set_bucket_color(SDL_Renderer* renderer, int bucket) {
+	int percent = bucket * AUDIO_STATS_BUCKET_PERCENT;
+
+	if (percent < 50)
+		SDL_SetRenderDrawColor(renderer, 0x40, 0xC0, 0x40, 0xFF);
+	else if (percent < 100)
+		SDL_SetRenderDrawColor(renderer, 0xE0, 0xC0, 0x40, 0xFF);
+	else
+		SDL_SetRenderDrawColor(renderer, 0xE0, 0x40, 0x40, 0xFF);
+}
+
+static void audio_hud_draw(SDL_Renderer* renderer, int outputWidth, int outputHeight) {
+	struct list* instrumentList = instrument_get_list();
+	struct audio_stats stats;
+
+	audio_get_stats(&stats);
+
+	SDL_Rect panel;
+	panel.w = AUDIO_HUD_COLUMNS * AUDIO_HUD_CHAR_WIDTH + 2*AUDIO_HUD_MARGIN;
+	panel.h = (instrumentList->nodeCount + 6) * AUDIO_HUD_LINE_HEIGHT + AUDIO_HUD_HISTOGRAM_HEIGHT + 3*AUDIO_HUD_MARGIN;
+	panel.x = outputWidth - panel.w - AUDIO_HUD_MARGIN;
+	panel.y = AUDIO_HUD_MARGIN;
+
+	SDL_SetRenderDrawBlendMode(renderer, SDL_BLENDMODE_BLEND);
+	SDL_SetRenderDrawColor(renderer, 0x00, 0x00, 0x00, 0xC0);
+	SDL_RenderFillRect(renderer, &panel);
+
+	int x = panel.x + AUDIO_HUD_MARGIN;
+	int y = panel.y + AUDIO_HUD_MARGIN;
+	char line[128];
+
+	SDL_SetRenderDrawColor(renderer, 0xFF, 0xFF, 0xFF, 0xFF);
+
+	snprintf(line, sizeof(line), "Audio: %d frames (%.2f ms), ~%u underruns", stats.periodSize, stats.periodBudget, stats.estimatedUnderrunCount);
+	audio_hud_text(renderer, x, &y, line);
+
+	double load = stats.periodBudget > 0 ? stats.callback.maxTime / stats.periodBudget * 100 : 0;
+	snprintf(line, sizeof(line), "Mix: avg %.2f, max %.2f ms (%.0f%% of period)", stats.callback.averageTime, stats.callback.maxTime, load);
+	audio_hud_text(renderer, x, &y, line);
+
+	snprintf(line, sizeof(line), "Synth: %d/%d voices, %.1f%% CPU", stats.activeVoices, stats.polyphony, stats.cpuLoad);
+	audio_hud_text(renderer, x, &y, line);
+
+	// Histogram of mix times, on a log scale so that the rare slow periods
+	// still show up next to the many fast ones.
+
+	unsigned int highest = 0;
+	for (int i = 0; i < AUDIO_STATS_HISTOGRAM_BUCKETS; i++) {
+		if (stats.callback.histogram[i] > highest)
+			highest = stats.callback.histogram[i];
+	}
+
+	y += AUDIO_HUD_MARGIN/2;
+
+	for (int i = 0; i < AUDIO_STATS_HISTOGRAM_BUCKETS; i++) {
+		unsigned int count = stats.callback.histogram[i];
+		int height = highest ? (int)(log1p(count) / log1p(highest) * AUDIO_HUD_HISTOGRAM_HEIGHT) : 0;
+
+		SDL_Rect bar = {x + i*(AUDIO_HUD_HISTOGRAM_BAR_WIDTH + 2), y + AUDIO_HUD_HISTOGRAM_HEIGHT - height, AUDIO_HUD_HISTOGRAM_BAR_WIDTH, height};
+
+		audio_hud_set_bucket_color(renderer, i);
+		SDL_RenderFillRect(renderer, &bar);
+	}
+
+	int legendX = x + AUDIO_STATS_HISTOGRAM_BUCKETS*(AUDIO_HUD_HISTOGRAM_BAR_WIDTH + 2) + AUDIO_HUD_MARGIN;
+
+	SDL_SetRenderDrawColor(renderer, 0xA0, 0xA0, 0xA0, 0xFF);
+	snprintf(line, sizeof(line), "%d%% of period per column", AUDIO_STATS_BUCKET_PERCENT);
+	font_draw_text(renderer, legendX, y + AUDIO_HUD_HISTOGRAM_HEIGHT - FONT_GLYPH_HEIGHT*AUDIO_HUD_SCALE, AUDIO_HUD_SCALE, line);
+
+	y += AUDIO_HUD_HISTOGRAM_HEIGHT + AUDIO_HUD_MARGIN;
+
+	snprintf(line, sizeof(line), "%-4s%10s%6s", "ID", "Voices", "Peak");
+	audio_hud_text(renderer, x, &y, line);
+
+	SDL_SetRenderDrawColor(renderer, 0xFF, 0xFF, 0xFF, 0xFF);
+
+	list_foreach(node, instrumentList) {
+		struct instrument* instr = (struct instrument*)node->data;
+		struct audio_instrument_stats instrumentStats;
+
+		if (audio_get_instrument_stats(instr, &instrumentStats) != 0) {
+			snprintf(line, sizeof(line), "%-4d%10s", instr->id, "Silent");
+		} else {
+			char voices[16];
+			snprintf(voices, sizeof(voices), "%d/%d", instrumentStats.activeVoices, instrumentStats.polyphony);
+			snprintf(line, sizeof(line), "%-4d%10s%6d", instr->id, voices, instrumentStats.peakVoices);
+		}
+
+		audio_hud_text(renderer, x, &y, line);
+	}
+
+	SDL_SetRenderDrawBlendMode(renderer, SDL_BLENDMODE_NONE);
+}
+
+// The statistics start over every time the overlay is opened.
+static void audio_hud_toggle() {
+	if (overlay) {
+		renderer_remove_overlay(overlay);
+		overlay = NULL;
+		return;
+	}
+
+	audio_reset_stats();
+	overlay = renderer_add_overlay(audio_hud_draw);
+}
+
+// F5 shows how much of its time budget the audio engine is using.
+int audio_hud_init() {
+	if (!event_register_keyboard_callback(SDLK_F5, KMOD_NONE, audio_hud_toggle))
+		return -1;
+
+	return 0;
+}
@@ -0,0 +1,85 @@
+/*	
+ *	SPDX-License-Identifier: GPL-3.0-only
+ *
+ *  Virtual Orchestra - Musical Instrument Simulation
+ *  Copyright (C) 2024 Garnek0 (Popa Vlad) and Contributors
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <vo/gfxui/font.h>
+
+#include <ctype.h>
+#include <string.h>
+
+struct font_glyph {
+	char character;
+	// One octal digit per row, top to bottom. The highest bit of a digit
+	// is the leftmost pixel.
+	Uint16 rows;
+};
+
+static const struct font_glyph glyphs[] = {
+	{'0', 075557}, {'1', 026227}, {'2', 071747}, {'3', 071717}, {'4', 055711},
+	{'5', 074717}, {'6', 074757}, {'7', 071111}, {'8', 075757}, {'9', 075717},
+	{'A', 025755}, {'B', 065656}, {'C', 034443}, {'D', 065556}, {'E', 074647},
+	{'F', 074644}, {'G', 034553}, {'H', 055755}, {'I', 072227}, {'J', 011152},
+	{'K', 055655}, {'L', 044447}, {'M', 057755}, {'N', 065555}, {'O', 025552},
+	{'P', 065644}, {'Q', 025563}, {'R', 065655}, {'S', 034216}, {'T', 072222},
+	{'U', 055557}, {'V', 055552}, {'W', 055775}, {'X', 055255}, {'Y', 055222},
+	{'Z', 071247}, {'.', 000002}, {':', 002020}, {'-', 000700}, {'/', 011244},
+	{'%', 051245}, {'(', 012221}, {')', 042224}, {'_', 000007}, {'=', 007070},
+	{'+', 002720}, {'[', 064446}, {']', 031113}, {'>', 042124}, {'<', 012421}
+};
+
+static Uint16 font_find_glyph(char character) {
+	character = toupper((unsigned char)character);
+
+	for (size_t i = 0; i < sizeof(glyphs)/sizeof(glyphs[0]); i++) {
+		if (glyphs[i].character == character)
+			return glyphs[i].rows;
+	}
+
+	return 0;
+}
+
+int font_text_width(const char* text, int scale) {
+	int length = strlen(text);
+	if (length == 0)
+		return 0;
+
+	return (length * (FONT_GLYPH_WIDTH + 1) - 1) * scale;
+}
+
+// Draw text with the current draw color, the top left corner at (x, y).
+void font_draw_text(SDL_Renderer* renderer, int x, int y, int scale, const char* text) {
+	SDL_Rect pixels[FONT_GLYPH_WIDTH * FONT_GLYPH_HEIGHT];
+
+	for (; *text; text++, x += (FONT_GLYPH_WIDTH + 1) * scale) {
+		Uint16 rows = font_find_glyph(*text);
+		int pixelCount = 0;
+
+		for (int row = 0; row < FONT_GLYPH_HEIGHT; row++) {
+			int bits = (rows >> ((FONT_GLYPH_HEIGHT - 1 - row) * 3)) & 07;
+
+			for (int column = 0; column < FONT_GLYPH_WIDTH; column++) {
+				if (bits & (4 >> column))
+					pixels[pixelCount++] = (SDL_Rect){x + column*scale, y + row*scale, scale, scale};
+			}
+		}
+
+		if (pixelCount)
+			SDL_RenderFillRects(renderer, pixels, pixelCount);
+	}
+}
@@ -0,0 +1,159 @@
+/*	
+ *	SPDX-License-Identifier: GPL-3.0-only
+ *
+ *  Virtual Orchestra - Musical Instrument Simulation
+ *  Copyright (C) 2024 Garnek0 (Popa Vlad) and Contributors
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <vo/gfxui/profiler_hud.h>
+#include <vo/gfxui/renderer.h>
+#include <vo/gfxui/font.h>
+#include <vo/profiler.h>
+#include <vo/event.h>
+#include <vo/debug.h>
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <time.h>
+#include <SDL2/SDL.h>
+
+// How far back the percentiles go, and how often they are recomputed.
+#define PROFILER_HUD_PERIOD_MS 2000
+#define PROFILER_HUD_REFRESH_MS 250
+
+// Bars show the p99 against the time a frame has at 60 FPS.
+#define PROFILER_HUD_BUDGET_MS (1000.0 / 60)
+#define PROFILER_HUD_BAR_WIDTH 120
+
+#define PROFILER_HUD_SCALE 2
+#define PROFILER_HUD_MARGIN 10
+#define PROFILER_HUD_LINE_HEIGHT ((FONT_GLYPH_HEIGHT + 2) * PROFILER_HUD_SCALE)
+#define PROFILER_HUD_CHAR_WIDTH ((FONT_GLYPH_WIDTH + 1) * PROFILER_HUD_SCALE)
+
+static struct renderer_overlay* overlay;
+static bool recorded;
+
+static struct profiler_scope_stats stats[PROFILER_MAX_SCOPES];
+static int scopeCount;
+static Uint32 lastRefresh;
+
+static void profiler_hud_draw(SDL_Renderer* renderer, int outputWidth, int outputHeight) {
+	Uint32 now = SDL_GetTicks();
+
+	if (now - lastRefresh >= PROFILER_HUD_REFRESH_MS) {
+		scopeCount = profiler_summarize(stats, PROFILER_MAX_SCOPES, PROFILER_HUD_PERIOD_MS);
+		lastRefresh = now;
+	}
+
+	const int nameColumns = 18;
+	const int valueColumns = 8;
+	int textWidth = (nameColumns + 4*valueColumns) * PROFILER_HUD_CHAR_WIDTH;
+
+	SDL_Rect panel = {
+		PROFILER_HUD_MARGIN,
+		PROFILER_HUD_MARGIN,
+		textWidth + PROFILER_HUD_BAR_WIDTH + 3*PROFILER_HUD_MARGIN,
+		(scopeCount + 2) * PROFILER_HUD_LINE_HEIGHT + 2*PROFILER_HUD_MARGIN
+	};
+
+	SDL_SetRenderDrawBlendMode(renderer, SDL_BLENDMODE_BLEND);
+	SDL_SetRenderDrawColor(renderer, 0x00, 0x00, 0x00, 0xC0);
+	SDL_RenderFillRect(renderer, &panel);
+
+	int x = panel.x + PROFILER_HUD_MARGIN;
+	int y = panel.y + PROFILER_HUD_MARGIN;
+	char line[128];
+
+	SDL_SetRenderDrawColor(renderer, 0xFF, 0xFF, 0xFF, 0xFF);
+	font_draw_text(renderer, x, y, PROFILER_HUD_SCALE, "Profiler (ms)   F4: export trace");
+	y += PROFILER_HUD_LINE_HEIGHT;
+
+	snprintf(line, sizeof(line), "%-*s%*s%*s%*s%*s", nameColumns, "", valueColumns, "p50", valueColumns, "p95", valueColumns, "p99", valueColumns, "max");
+	SDL_SetRenderDrawColor(renderer, 0xA0, 0xA0, 0xA0, 0xFF);
+	font_draw_text(renderer, x, y, PROFILER_HUD_SCALE, line);
+	y += PROFILER_HUD_LINE_HEIGHT;
+
+	int barX = x + textWidth + PROFILER_HUD_MARGIN;
+	int barHeight = FONT_GLYPH_HEIGHT * PROFILER_HUD_SCALE;
+
+	for (int i = 0; i < scopeCount; i++, y += PROFILER_HUD_LINE_HEIGHT) {
+		struct profiler_scope_stats* scope = &stats[i];
+
+		snprintf(line, sizeof(line), "%-*.*s%*.2f%*.2f%*.2f%*.2f", nameColumns, nameColumns - 1, scope->name, valueColumns, scope->p50, valueColumns, scope->p95, valueColumns, scope->p99, valueColumns, scope->max);
+		SDL_SetRenderDrawColor(renderer, 0xFF, 0xFF, 0xFF, 0xFF);
+		font_draw_text(renderer, x, y, PROFILER_HUD_SCALE, line);
+
+		double fraction = scope->p99 / PROFILER_HUD_BUDGET_MS;
+		SDL_Rect bar = {barX, y, (int)(fraction * PROFILER_HUD_BAR_WIDTH), barHeight};
+
+		if (bar.w > PROFILER_HUD_BAR_WIDTH)
+			bar.w = PROFILER_HUD_BAR_WIDTH;
+		if (bar.w < 1)
+			bar.w = 1;
+
+		if (fraction < 0.5)
+			SDL_SetRenderDrawColor(renderer, 0x40, 0xC0, 0x40, 0xFF);
+		else if (fraction < 1.0)
+			SDL_SetRenderDrawColor(renderer, 0xE0, 0xC0, 0x40, 0xFF);
+		else
+			SDL_SetRenderDrawColor(renderer, 0xE0, 0x40, 0x40, 0xFF);
+
+		SDL_RenderFillRect(renderer, &bar);
+	}
+
+	SDL_SetRenderDrawBlendMode(renderer, SDL_BLENDMODE_NONE);
+}
+
+// Recording only runs while the HUD is shown.
+static void profiler_hud_toggle() {
+	if (overlay) {
+		renderer_remove_overlay(overlay);
+		overlay = NULL;
+		profiler_set_enabled(false);
+		return;
+	}
+
+	overlay = renderer_add_overlay(profiler_hud_draw);
+	profiler_set_enabled(overlay != NULL);
+	recorded |= overlay != NULL;
+
+	// Summarize right away once there is something to show.
+	lastRefresh = SDL_GetTicks() - PROFILER_HUD_REFRESH_MS;
+}
+
+static void profiler_hud_export() {
+	if (!recorded) {
+		debug_log(LOGLEVEL_WARN, "Profiler: Nothing recorded, press F3 to start profiling first.\n");
+		return;
+	}
+
+	char path[64];
+	snprintf(path, sizeof(path), "vo-trace-%ld.json", (long)time(NULL));
+
+	profiler_export_trace(path);
+}
+
+// F3 shows the profiler HUD and starts recording, F4 saves what was
+// recorded as a trace.
+int profiler_hud_init() {
+	if (!event_register_keyboard_callback(SDLK_F3, KMOD_NONE, profiler_hud_toggle))
+		return -1;
+
+	if (!event_register_keyboard_callback(SDLK_F4, KMOD_NONE, profiler_hud_export))
+		return -1;
+
+	return 0;
+}
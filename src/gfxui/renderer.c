@@ -21,7 +21,10 @@
 #include <vo/debug.h>
 #include <vo/ver.h>
 #include <vo/gfxui/renderer.h>
+#include <vo/gfxui/spatial_grid.h>
 #include <vo/event.h>
+#include <vo/list.h>
+#include <vo/profiler.h>
 
 #include <SDL2/SDL.h>
 #include <SDL2/SDL_image.h>
@@ -31,6 +34,10 @@ static SDL_Renderer* renderer;
 
 static float zoomScale = 1;
 
+// No window and no SDL renderer. Texture slots are still handed out so that
+// instruments work the same, but nothing is loaded or drawn.
+static bool headless;
+
 // Stage 0, 0 - Screen 0, 0 offset. The stage is the
 // conceptual world in which all the instruments are rendered,
 // whereas the screen is... well... the screen.
@@ -39,6 +46,56 @@ static float zoomScale = 1;
 static float screenOffsetY;
 static float screenOffsetX;
 
+// Max number of separate screen areas that can be redrawn in one frame.
+// Past this the whole screen is redrawn.
+#define RENDERER_MAX_DIRTY_RECTS 32
+
+// The stage is drawn onto this texture, which keeps its contents between
+// frames, so only the parts that changed have to be redrawn. NULL if the
+// SDL renderer doesn't support render targets, in which case any change
+// redraws everything.
+static SDL_Texture* canvas;
+static int canvasWidth, canvasHeight;
+
+// Drawn on top of the stage, straight to the screen.
+static struct list* overlayList;
+
+// Screen areas that have to be redrawn in the next frame.
+static bool fullRedraw = true;
+static SDL_Rect dirtyRects[RENDERER_MAX_DIRTY_RECTS];
+static int dirtyRectCount;
+
+// Size of a cell of the instrument spatial index, in stage units.
+#define RENDERER_GRID_CELL_SIZE 512
+
+// Instruments by the area of the stage they cover, so a frame only has to
+// look at the ones that are visible.
+static struct spatial_grid* instrumentGrid;
+
+// Instruments found by the last spatial index query.
+static void** visibleInstruments;
+static int maxVisibleInstruments;
+
+// A texture to be drawn this frame.
+struct renderer_quad {
+	struct texture_cache_entry* image;
+	SDL_Rect rect;
+
+	int layer;
+	Uint8 alpha;
+};
+
+// Everything that is drawn in a frame, sorted by layer, and the vertex
+// and index buffers it is turned into. All of them hold
+// maxQuadsBeforeRealloc quads.
+static struct renderer_quad* quads;
+static int quadCount;
+static int maxQuadsBeforeRealloc;
+// Scratch space for merging the instruments' quads.
+static struct renderer_quad* mergedQuads;
+static SDL_Vertex* vertices;
+static int* indices;
+
 // Convert screen coordinates to stage coordinates. 
 void renderer_coord_screen_to_stage(int screenX, int screenY, float* stageX, float* stageY) {
 	*stageX = (float)(screenX) / zoomScale + screenOffsetX;
@@ -51,6 +108,100 @@ void renderer_coord_stage_to_screen(float stageX, float stageY, int* screenX, in
 	*screenY = (int)((stageY - screenOffsetY) * zoomScale);
 }
 
+// Where a texture of an instrument currently ends up on screen.
+static void renderer_texture_screen_rect(struct instrument* instr, int textureIndex, SDL_Rect* rect) {
+	struct renderer_instrument_texture* texture = &instr->textures[textureIndex];
+
+	renderer_coord_stage_to_screen(texture->bounds.x, texture->bounds.y, &rect->x, &rect->y);
+
+	rect->w = texture->width * zoomScale;
+	rect->h = texture->height * zoomScale;
+}
+
+// Redraw everything in the next frame.
+void renderer_invalidate() {
+	fullRedraw = true;
+}
+
+// Redraw a screen area in the next frame.
+void renderer_invalidate_rect(const SDL_Rect* rect) {
+	if (fullRedraw || rect->w <= 0 || rect->h <= 0)
+		return;
+
+	// Grow the rect by a pixel on each side to cover rounding errors in
+	// the stage to screen conversion.
+	SDL_Rect grownRect = {rect->x - 1, rect->y - 1, rect->w + 2, rect->h + 2};
+
+	// Merge with an area that's already dirty if they overlap, so the same
+	// pixels don't get drawn twice.
+	for (int i = 0; i < dirtyRectCount; i++) {
+		if (SDL_HasIntersection(&dirtyRects[i], &grownRect)) {
+			SDL_UnionRect(&dirtyRects[i], &grownRect, &dirtyRects[i]);
+			return;
+		}
+	}
+
+	if (dirtyRectCount == RENDERER_MAX_DIRTY_RECTS) {
+		fullRedraw = true;
+		return;
+	}
+
+	dirtyRects[dirtyRectCount++] = grownRect;
+}
+
+static void renderer_invalidate_texture(struct instrument* instr, int textureIndex) {
+	if (headless || fullRedraw)
+		return;
+
+	SDL_Rect rect;
+	renderer_texture_screen_rect(instr, textureIndex, &rect);
+	renderer_invalidate_rect(&rect);
+}
+
+static void renderer_window_callback(Uint8 windowEvent, int data1, int data2) {
+	switch (windowEvent) {
+		case SDL_WINDOWEVENT_SIZE_CHANGED:
+		case SDL_WINDOWEVENT_EXPOSED:
+		case SDL_WINDOWEVENT_RESTORED:
+		case SDL_WINDOWEVENT_SHOWN:
+			renderer_invalidate();
+			break;
+		default:
+			break;
+	}
+}
+
+// Make sure the canvas exists and matches the output size. Returns false
+// if there is no canvas to draw on.
+static bool renderer_update_canvas() {
+	if (!SDL_RenderTargetSupported(renderer))
+		return false;
+
+	int outputWidth, outputHeight;
+
+	if (SDL_GetRendererOutputSize(renderer, &outputWidth, &outputHeight) != 0)
+		return false;
+
+	if (canvas && outputWidth == canvasWidth && outputHeight == canvasHeight)
+		return true;
+
+	if (canvas)
+		SDL_DestroyTexture(canvas);
+
+	canvas = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_TARGET, outputWidth, outputHeight);
+
+	if (!canvas) {
+		debug_log(LOGLEVEL_WARN, "Renderer: Could not create canvas texture, every change will redraw the whole screen: %s\n", SDL_GetError());
+		return false;
+	}
+
+	canvasWidth = outputWidth;
+	canvasHeight = outputHeight;
+	fullRedraw = true;
+
+	return true;
+}
+
 int renderer_init() {
 	char* windowTitle = malloc(50);
 
@@ -85,6 +236,13 @@ int renderer_init() {
 
 	renderer = SDL_CreateRenderer(window, -1, SDL_RENDERER_ACCELERATED | SDL_RENDERER_PRESENTVSYNC);
 
+	// Some video drivers (e.g. the dummy one) only come with a software
+	// renderer.
+	if (!renderer) {
+		debug_log(LOGLEVEL_WARN, "Renderer: No accelerated SDL renderer, falling back to software rendering: %s\n", SDL_GetError());
+		renderer = SDL_CreateRenderer(window, -1, SDL_RENDERER_SOFTWARE);
+	}
+
 	if (!renderer) {
 		debug_log(LOGLEVEL_FATAL, "Renderer: Failed to create SDL renderer: %s\n", SDL_GetError());
 		return -1;
@@ -109,69 +267,186 @@ int renderer_init() {
 	event_register_keyboard_callback(SDLK_LEFT, KMOD_NONE, renderer_keyboard_pan_left);
 	event_register_mouse_wheel_callback(renderer_mouse_wheel_zoom);
 	event_register_mouse_callback(SDL_BUTTON_MMASK, renderer_mouse_pan);
+	event_register_window_callback(renderer_window_callback);
+	// Everything has to be drawn again after a reset.
+	event_register_render_reset_callback(renderer_invalidate);
 
 	if (!(IMG_Init(IMG_INIT_PNG) & IMG_INIT_PNG)) {
 		debug_log(LOGLEVEL_FATAL, "Renderer: SDL_image init failed: %s\n", IMG_GetError());
 		return -1;
 	}
 
+	if (texture_cache_init(renderer) != 0) {
+		debug_log(LOGLEVEL_FATAL, "Renderer: Texture cache init failed!\n");
+		return -1;
+	}
+
+	instrumentGrid = spatial_grid_create(RENDERER_GRID_CELL_SIZE);
+	overlayList = list_create();
+
 	return 0;
 }
 
+// Set up the renderer for running without a window, e.g. when rendering
+// audio offline.
+int renderer_init_headless() {
+	headless = true;
+
+	return 0;
+}
+
+// Put a texture into the first orderCount entries of the instrument's draw
+// order, after everything on a lower layer or on the same layer with a
+// lower index.
+static void renderer_insert_draw_order(struct instrument* instr, int textureIndex, int orderCount) {
+	int layer = instr->textures[textureIndex].layer;
+	int position = orderCount;
+
+	while (position > 0) {
+		struct renderer_instrument_texture* previous = &instr->textures[instr->textureDrawOrder[position-1]];
+
+		if (previous->layer < layer || (previous->layer == layer && instr->textureDrawOrder[position-1] < textureIndex))
+			break;
+
+		position--;
+	}
+
+	memmove((void*)&instr->textureDrawOrder[position+1], (void*)&instr->textureDrawOrder[position], sizeof(int)*(orderCount - position));
+	instr->textureDrawOrder[position] = textureIndex;
+}
+
+static bool renderer_frect_intersects(const SDL_FRect* a, const SDL_FRect* b) {
+	return a->x < b->x + b->w && b->x < a->x + a->w && a->y < b->y + b->h && b->y < a->y + a->h;
+}
+
+// Recalculate where the instrument and each of its textures are on the
+// stage and update the spatial index. Has to be called whenever the
+// instrument moves or its textures change.
+void renderer_update_instrument_bounds(struct instrument* instr) {
+	float minX = 0, minY = 0, maxX = 0, maxY = 0;
+
+	for (int i = 0; i < instr->textureCount; i++) {
+		struct renderer_instrument_texture* texture = &instr->textures[i];
+
+		texture->bounds = (SDL_FRect){instr->x + texture->offsetX, instr->y + texture->offsetY, texture->width, texture->height};
+
+		if (i == 0 || texture->bounds.x < minX)
+			minX = texture->bounds.x;
+		if (i == 0 || texture->bounds.y < minY)
+			minY = texture->bounds.y;
+		if (i == 0 || texture->bounds.x + texture->bounds.w > maxX)
+			maxX = texture->bounds.x + texture->bounds.w;
+		if (i == 0 || texture->bounds.y + texture->bounds.h > maxY)
+			maxY = texture->bounds.y + texture->bounds.h;
+	}
+
+	if (!instrumentGrid)
+		return;
+
+	if (instr->boundsIndexed)
+		spatial_grid_remove(instrumentGrid, (void*)instr, &instr->bounds);
+
+	instr->bounds = (SDL_FRect){minX, minY, maxX - minX, maxY - minY};
+	instr->boundsIndexed = instr->textureCount > 0;
+
+	// An instrument that couldn't be indexed won't be drawn.
+	if (instr->boundsIndexed && spatial_grid_insert(instrumentGrid, (void*)instr, &instr->bounds) != 0) {
+		debug_log(LOGLEVEL_ERROR, "Renderer: Failed to index bounds of instrument with ID=%d.\n", instr->id);
+		instr->boundsIndexed = false;
+	}
+}
+
 void renderer_free_instrument_textures(struct instrument* instr) {
+	if (instr->boundsIndexed)
+		spatial_grid_remove(instrumentGrid, (void*)instr, &instr->bounds);
+
+	instr->boundsIndexed = false;
+
 	for (int i = 0; i < instr->textureCount; i++)
-		SDL_DestroyTexture(instr->textures[i].loadedTexture);
+		texture_cache_release(instr->textures[i].image);
 
 	free((void*)instr->textures);
+	free((void*)instr->textureDrawOrder);
+
+	renderer_invalidate();
 }
 
 int renderer_load_instrument_texture(struct instrument* instr, const char* path, int offsetX, int offsetY, int layer) {
-	SDL_Surface* textureSurface = IMG_Load(path);
-	if (!textureSurface) {
-		debug_log(LOGLEVEL_ERROR, "Renderer: Texture file \"%s\" for instrument with ID=%d could not be loaded: %s\n", path, instr->id, IMG_GetError());
-		return -1;
+	struct texture_cache_entry* image = NULL;
+
+	// Images are shared, a path that was already loaded (by this or any
+	// other instrument) doesn't get decoded again.
+	if (!headless) {
+		image = texture_cache_acquire(path);
+		if (!image) {
+			debug_log(LOGLEVEL_ERROR, "Renderer: Texture for instrument with ID=%d could not be loaded.\n", instr->id);
+			return -1;
+		}
 	}
 
-	SDL_Texture* loadedTexture = SDL_CreateTextureFromSurface(renderer, textureSurface);
-
-	if (!loadedTexture) {
-		debug_log(LOGLEVEL_ERROR, "Renderer: Could not create texture from surface for instrument with ID=%d: %s\n", instr->id, SDL_GetError());
-		SDL_FreeSurface(textureSurface);
-		return -1;
-	}
+	if (instr->maxTexturesBeforeRealloc == 0) {
+		instr->textures = (struct renderer_instrument_texture*)calloc(16, sizeof(struct renderer_instrument_texture));
+		instr->textureDrawOrder = (int*)calloc(16, sizeof(int));
+
+		if (!instr->textures || !instr->textureDrawOrder) {
+			debug_log(LOGLEVEL_ERROR, "Renderer: Failed to allocate textures for instrument with ID=%d.\n", instr->id);
+			free((void*)instr->textures);
+			free((void*)instr->textureDrawOrder);
+			instr->textures = NULL;
+			instr->textureDrawOrder = NULL;
+			texture_cache_release(image);
+			return -1;
+		}
 
-	SDL_FreeSurface(textureSurface);
+		memset((void*)instr->textures, 0, sizeof(struct renderer_instrument_texture)*16);
 
-	if (instr->maxTexturesBeforeRealloc == 0) {
 		instr->maxTexturesBeforeRealloc = 16;
 		instr->textureCount = 0;
-
-		instr->textures = (struct renderer_instrument_texture*)calloc(16, sizeof(struct renderer_instrument_texture));
-		memset((void*)instr->textures, 0, sizeof(struct renderer_instrument_texture)*16);
 	} else if (instr->maxTexturesBeforeRealloc == instr->textureCount) {
 
 		// Reallocate and double the size of the texture array.
 
-		instr->maxTexturesBeforeRealloc *= 2;
+		int newMaxTextures = instr->maxTexturesBeforeRealloc * 2;
+
+		struct renderer_instrument_texture* newTexturesArray = (struct renderer_instrument_texture*)calloc(newMaxTextures, sizeof(struct renderer_instrument_texture));
+		int* newDrawOrder = (int*)realloc((void*)instr->textureDrawOrder, sizeof(int)*newMaxTextures);
 
-		struct renderer_instrument_texture* newTexturesArray = (struct renderer_instrument_texture*)calloc(instr->maxTexturesBeforeRealloc, sizeof(struct renderer_instrument_texture));
+		// A successful realloc already freed the old draw order.
+		if (newDrawOrder)
+			instr->textureDrawOrder = newDrawOrder;
 
-		memset((void*)newTexturesArray, 0, sizeof(struct renderer_instrument_texture)*instr->maxTexturesBeforeRealloc);
+		if (!newTexturesArray || !newDrawOrder) {
+			debug_log(LOGLEVEL_ERROR, "Renderer: Failed to grow textures for instrument with ID=%d.\n", instr->id);
+			free((void*)newTexturesArray);
+			texture_cache_release(image);
+			return -1;
+		}
+
+		memset((void*)newTexturesArray, 0, sizeof(struct renderer_instrument_texture)*newMaxTextures);
 
-		memcpy((void*)newTexturesArray, (void*)instr->textures, sizeof(struct renderer_instrument_texture)*(instr->maxTexturesBeforeRealloc/2));
+		memcpy((void*)newTexturesArray, (void*)instr->textures, sizeof(struct renderer_instrument_texture)*instr->maxTexturesBeforeRealloc);
 
 		free((void*)instr->textures);
 
 		instr->textures = newTexturesArray;
+		instr->maxTexturesBeforeRealloc = newMaxTextures;
 	}
 
-	instr->textures[instr->textureCount].loadedTexture = loadedTexture;
+	instr->textures[instr->textureCount].image = image;
+	instr->textures[instr->textureCount].width = image ? image->rect.w : 0;
+	instr->textures[instr->textureCount].height = image ? image->rect.h : 0;
 	instr->textures[instr->textureCount].offsetX = offsetX;
 	instr->textures[instr->textureCount].offsetY = offsetY;
 	instr->textures[instr->textureCount].layer = layer;
+	instr->textures[instr->textureCount].opacity = 100;
+
+	renderer_insert_draw_order(instr, instr->textureCount, instr->textureCount);
 
 	instr->textureCount++;
 
+	renderer_update_instrument_bounds(instr);
+	renderer_invalidate_texture(instr, instr->textureCount-1);
+
 	return instr->textureCount-1;
 }
 
@@ -184,8 +459,17 @@ void renderer_set_instrument_texture_offset(struct instrument* instr, int textur
 		return;
 	}
 	
+	if (instr->textures[textureIndex].offsetX == offsetX && instr->textures[textureIndex].offsetY == offsetY)
+		return;
+
+	// Both where the texture was and where it goes need to be redrawn.
+	renderer_invalidate_texture(instr, textureIndex);
+
 	instr->textures[textureIndex].offsetX = offsetX;
 	instr->textures[textureIndex].offsetY = offsetY;
+
+	renderer_update_instrument_bounds(instr);
+	renderer_invalidate_texture(instr, textureIndex);
 }
 
 // Opacity must be in the 0 - 100 range.
@@ -200,7 +484,13 @@ void renderer_set_instrument_texture_opacity(struct instrument* instr, int textu
 		return;
 	}
 
-	SDL_SetTextureAlphaMod(instr->textures[textureIndex].loadedTexture, (Uint8)(opacity*2.55));
+	if (instr->textures[textureIndex].opacity == opacity)
+		return;
+
+	// Applied when drawing, the atlas page is shared with other textures.
+	instr->textures[textureIndex].opacity = opacity;
+
+	renderer_invalidate_texture(instr, textureIndex);
 }
 
 void renderer_set_instrument_texture_layer(struct instrument* instr, int textureIndex, int layer) {
@@ -209,47 +499,353 @@ void renderer_set_instrument_texture_layer(struct instrument* instr, int texture
 		return;
 	}
 
+	if (instr->textures[textureIndex].layer == layer)
+		return;
+
+	// Take the texture out of the draw order and put it back in at its
+	// new layer.
+	int position = 0;
+	while (instr->textureDrawOrder[position] != textureIndex)
+		position++;
+
+	memmove((void*)&instr->textureDrawOrder[position], (void*)&instr->textureDrawOrder[position+1], sizeof(int)*(instr->textureCount - position - 1));
+
 	instr->textures[textureIndex].layer = layer;
+
+	renderer_insert_draw_order(instr, textureIndex, instr->textureCount-1);
+
+	renderer_invalidate_texture(instr, textureIndex);
 }
 
-void renderer_render_instrument(struct instrument* instr) {
-	SDL_Rect rect;
+// Make room for twice as many quads. Arrays that did grow stay grown,
+// they just won't be used past the old capacity.
+static int renderer_grow_quads() {
+	int newMax = maxQuadsBeforeRealloc ? maxQuadsBeforeRealloc*2 : 256;
 
-	int maxTextureLayer = 0;
+	struct renderer_quad* newQuads = realloc((void*)quads, sizeof(struct renderer_quad)*newMax);
+	if (newQuads)
+		quads = newQuads;
 
-	// Find the maximum texture layer
-	for (int i = 0; i < instr->textureCount; i++)
-		if (instr->textures[i].layer > maxTextureLayer)
-			maxTextureLayer = instr->textures[i].layer;
+	struct renderer_quad* newMergedQuads = realloc((void*)mergedQuads, sizeof(struct renderer_quad)*newMax);
+	if (newMergedQuads)
+		mergedQuads = newMergedQuads;
+
+	SDL_Vertex* newVertices = realloc((void*)vertices, sizeof(SDL_Vertex)*4*newMax);
+	if (newVertices)
+		vertices = newVertices;
+
+	int* newIndices = realloc((void*)indices, sizeof(int)*6*newMax);
+	if (newIndices)
+		indices = newIndices;
+
+	if (!newQuads || !newMergedQuads || !newVertices || !newIndices) {
+		debug_log(LOGLEVEL_ERROR, "Renderer: Failed to allocate %d quads!\n", newMax);
+		return -1;
+	}
+
+	maxQuadsBeforeRealloc = newMax;
+
+	// Two triangles per quad, the corners are always laid out the same way
+	// so the indices never change.
+	for (int j = 0; j < maxQuadsBeforeRealloc; j++) {
+		int* quadIndices = &indices[j*6];
+
+		quadIndices[0] = j*4;
+		quadIndices[1] = j*4 + 1;
+		quadIndices[2] = j*4 + 2;
+		quadIndices[3] = j*4 + 1;
+		quadIndices[4] = j*4 + 3;
+		quadIndices[5] = j*4 + 2;
+	}
+
+	return 0;
+}
+
+// Queue the textures of an instrument that overlap area (in stage
+// coordinates) for drawing in this frame. They come out sorted by layer.
+static void renderer_queue_instrument(struct instrument* instr, const SDL_FRect* area) {
+	for (int j = 0; j < instr->textureCount; j++) {
+		int i = instr->textureDrawOrder[j];
+		struct renderer_instrument_texture* texture = &instr->textures[i];
+
+		if (!texture->image || texture->opacity == 0 || !renderer_frect_intersects(&texture->bounds, area))
+			continue;
+
+		if (quadCount == maxQuadsBeforeRealloc && renderer_grow_quads() != 0)
+			return;
+
+		struct renderer_quad* quad = &quads[quadCount];
+
+		quad->image = texture->image;
+		quad->layer = texture->layer;
+		quad->alpha = (Uint8)(texture->opacity*2.55);
+
+		renderer_texture_screen_rect(instr, i, &quad->rect);
+
+		quadCount++;
+	}
+}
+
+// Merge the sorted runs of quads starting at runStarts[0] ...
+// runStarts[runCount-1] (the last one ending at quadCount) into a single
+// sorted run. Runs are merged pairwise, left before right, so quads on the
+// same layer stay in instrument order.
+static void renderer_merge_quads(int* runStarts, int runCount) {
+	while (runCount > 1) {
+		int mergedRunCount = 0;
+
+		for (int run = 0; run < runCount; run += 2) {
+			int leftStart = runStarts[run];
+			int leftEnd = (run + 1 < runCount) ? runStarts[run+1] : quadCount;
+			int rightEnd = (run + 2 < runCount) ? runStarts[run+2] : quadCount;
+
+			int left = leftStart;
+			int right = leftEnd;
+			int out = leftStart;
+
+			while (left < leftEnd && right < rightEnd) {
+				if (quads[right].layer < quads[left].layer)
+					mergedQuads[out++] = quads[right++];
+				else
+					mergedQuads[out++] = quads[left++];
+			}
+
+			while (left < leftEnd)
+				mergedQuads[out++] = quads[left++];
+			while (right < rightEnd)
+				mergedQuads[out++] = quads[right++];
+
+			runStarts[mergedRunCount++] = leftStart;
+		}
+
+		struct renderer_quad* swap = quads;
+		quads = mergedQuads;
+		mergedQuads = swap;
+
+		runCount = mergedRunCount;
+	}
+}
+
+static int renderer_instrument_compare(const void* a, const void* b) {
+	const struct instrument* instrA = *(const struct instrument* const*)a;
+	const struct instrument* instrB = *(const struct instrument* const*)b;
+
+	return instrA->id - instrB->id;
+}
+
+// The part of the stage that has to be drawn in this frame.
+static void renderer_get_redraw_area(SDL_FRect* area) {
+	SDL_Rect screenArea = {0, 0, 0, 0};
+
+	if (fullRedraw) {
+		SDL_GetRendererOutputSize(renderer, &screenArea.w, &screenArea.h);
+	} else {
+		screenArea = dirtyRects[0];
+
+		for (int i = 1; i < dirtyRectCount; i++)
+			SDL_UnionRect(&screenArea, &dirtyRects[i], &screenArea);
+	}
+
+	renderer_coord_screen_to_stage(screenArea.x, screenArea.y, &area->x, &area->y);
+	area->w = screenArea.w / zoomScale;
+	area->h = screenArea.h / zoomScale;
+}
+
+// Collect the textures of the instruments in view, in the order they have
+// to be drawn.
+static void renderer_build_quads() {
+	SDL_FRect area;
+	renderer_get_redraw_area(&area);
+
+	int visibleCount = spatial_grid_query(instrumentGrid, &area, &visibleInstruments, &maxVisibleInstruments);
+
+	// Instruments are drawn in the order they were created, which is also
+	// the order of their IDs. Sorting also puts the duplicates that come
+	// from instruments spanning several grid cells next to each other.
+	qsort((void*)visibleInstruments, visibleCount, sizeof(void*), renderer_instrument_compare);
+
+	// Where each instrument's quads start.
+	static int* runStarts;
+	static int maxRunsBeforeRealloc;
+	int runCount = 0;
+
+	quadCount = 0;
+
+	if (visibleCount > maxRunsBeforeRealloc) {
+		int* newRunStarts = (int*)realloc((void*)runStarts, sizeof(int)*visibleCount*2);
+
+		if (!newRunStarts) {
+			debug_log(LOGLEVEL_ERROR, "Renderer: Failed to allocate %d instrument runs!\n", visibleCount*2);
+			return;
+		}
+
+		runStarts = newRunStarts;
+		maxRunsBeforeRealloc = visibleCount*2;
+	}
+
+	for (int i = 0; i < visibleCount; i++) {
+		struct instrument* instr = (struct instrument*)visibleInstruments[i];
 
-	for(int i = 0; i <= maxTextureLayer; i++) {
-		for (int j = 0; j < instr->textureCount; j++) {
-			if(instr->textures[j].layer != i)
-				continue;
+		if ((i > 0 && visibleInstruments[i-1] == visibleInstruments[i]) || !renderer_frect_intersects(&instr->bounds, &area))
+			continue;
 
-			renderer_coord_stage_to_screen(instr->x + instr->textures[j].offsetX, instr->y + instr->textures[j].offsetY, &rect.x, &rect.y);
+		runStarts[runCount++] = quadCount;
+		renderer_queue_instrument(instr, &area);
+	}
+
+	renderer_merge_quads(runStarts, runCount);
+}
+
+// Draw the queued quads that fall inside region (in screen coordinates),
+// or all of them if region is NULL. Consecutive quads on the same atlas
+// page go out in a single draw call.
+static void renderer_submit_quads(const SDL_Rect* region) {
+	SDL_Texture* batchTexture = NULL;
+	int batchCount = 0;
 
-			SDL_QueryTexture(instr->textures[j].loadedTexture, NULL, NULL, &rect.w, &rect.h);
+	for (int i = 0; i < quadCount; i++) {
+		struct renderer_quad* quad = &quads[i];
 
-			rect.w *= zoomScale;
-			rect.h *= zoomScale;
+		if (region && !SDL_HasIntersection(&quad->rect, region))
+			continue;
 
-			SDL_RenderCopy(renderer, instr->textures[j].loadedTexture, NULL, &rect);
+		if (quad->image->page->texture != batchTexture) {
+			if (batchCount)
+				SDL_RenderGeometry(renderer, batchTexture, vertices, batchCount*4, indices, batchCount*6);
+
+			batchTexture = quad->image->page->texture;
+			batchCount = 0;
 		}
+
+		float pageWidth = (float)quad->image->page->width;
+		float pageHeight = (float)quad->image->page->height;
+
+		float left = quad->rect.x;
+		float top = quad->rect.y;
+		float right = quad->rect.x + quad->rect.w;
+		float bottom = quad->rect.y + quad->rect.h;
+
+		float texLeft = quad->image->rect.x / pageWidth;
+		float texTop = quad->image->rect.y / pageHeight;
+		float texRight = (quad->image->rect.x + quad->image->rect.w) / pageWidth;
+		float texBottom = (quad->image->rect.y + quad->image->rect.h) / pageHeight;
+
+		SDL_Color color = {0xFF, 0xFF, 0xFF, quad->alpha};
+		SDL_Vertex* quadVertices = &vertices[batchCount*4];
+
+		quadVertices[0] = (SDL_Vertex){{left, top}, color, {texLeft, texTop}};
+		quadVertices[1] = (SDL_Vertex){{right, top}, color, {texRight, texTop}};
+		quadVertices[2] = (SDL_Vertex){{left, bottom}, color, {texLeft, texBottom}};
+		quadVertices[3] = (SDL_Vertex){{right, bottom}, color, {texRight, texBottom}};
+
+		batchCount++;
 	}
+
+	if (batchCount)
+		SDL_RenderGeometry(renderer, batchTexture, vertices, batchCount*4, indices, batchCount*6);
+}
+
+static void renderer_draw_region(const SDL_Rect* region) {
+	SDL_RenderSetClipRect(renderer, region);
+
+	// SDL_RenderClear() ignores the clip rect, so only use it when
+	// everything is being redrawn anyway.
+	SDL_SetRenderDrawColor(renderer, 0xFF, 0xFF, 0xFF, 0xFF);
+
+	if (region)
+		SDL_RenderFillRect(renderer, region);
+	else
+		SDL_RenderClear(renderer);
+
+	renderer_submit_quads(region);
+
+	SDL_RenderSetClipRect(renderer, NULL);
 }
 
 void renderer_iteration() {
-	struct list* instrumentList = instrument_get_list();
+	// Show the keys the playback thread pressed or released since the last
+	// frame.
+	instrument_update_visuals();
+
+	bool haveCanvas = renderer_update_canvas();
+	bool haveOverlays = overlayList->nodeCount > 0;
 
-	list_foreach(node, instrumentList) {
-		renderer_render_instrument((struct instrument*)node->data);
+	// Nothing changed since the last frame, what's on screen is still good.
+	// Overlays are expected to change every frame.
+	if (!fullRedraw && dirtyRectCount == 0 && !haveOverlays)
+		return;
+
+	bool stageChanged = fullRedraw || dirtyRectCount > 0;
+
+	// Without a canvas nothing from the last frame survives, the whole
+	// screen is cleared and has to be drawn again.
+	if (!haveCanvas) {
+		fullRedraw = true;
+		renderer_build_quads();
+		renderer_draw_region(NULL);
+	} else {
+		if (stageChanged) {
+			renderer_build_quads();
+
+			SDL_SetRenderTarget(renderer, canvas);
+
+			if (fullRedraw) {
+				renderer_draw_region(NULL);
+			} else {
+				for (int i = 0; i < dirtyRectCount; i++)
+					renderer_draw_region(&dirtyRects[i]);
+			}
+
+			SDL_SetRenderTarget(renderer, NULL);
+		}
+
+		SDL_RenderCopy(renderer, canvas, NULL, NULL);
 	}
 
+	if (haveOverlays) {
+		int outputWidth, outputHeight;
+		SDL_GetRendererOutputSize(renderer, &outputWidth, &outputHeight);
+
+		list_foreach(node, overlayList) {
+			struct renderer_overlay* overlay = (struct renderer_overlay*)node->data;
+			overlay->draw(renderer, outputWidth, outputHeight);
+		}
+	}
+
+	Uint64 presentStart = PROFILER_BEGIN();
 	SDL_RenderPresent(renderer);
+	PROFILER_END("SDL_RenderPresent", presentStart);
 
-	SDL_SetRenderDrawColor(renderer, 0xFF, 0xFF, 0xFF, 0xFF);
-	SDL_RenderClear(renderer);
+	fullRedraw = false;
+	dirtyRectCount = 0;
+}
+
+// Draw something on top of the stage every frame, until the overlay is
+// removed. Overlays are drawn in the order they were added.
+struct renderer_overlay* renderer_add_overlay(void (*draw)(SDL_Renderer*, int, int)) {
+	if (headless)
+		return NULL;
+
+	struct renderer_overlay* overlay = malloc(sizeof(struct renderer_overlay));
+	if (!overlay)
+		return NULL;
+
+	overlay->draw = draw;
+
+	list_insert(overlayList, (void*)overlay);
+
+	return overlay;
+}
+
+void renderer_remove_overlay(struct renderer_overlay* overlay) {
+	if (!overlay)
+		return;
+
+	list_remove(overlayList, (void*)overlay);
+	free((void*)overlay);
+
+	// Get rid of what the overlay left on screen.
+	renderer_invalidate();
 }
 
 void renderer_get_screen_offset(float* x, float* y) {
@@ -260,22 +856,32 @@ void renderer_get_screen_offset(float* x, float* y) {
 void renderer_set_screen_offset(float x, float y) {
 	screenOffsetX = x;
 	screenOffsetY = y;
+
+	renderer_invalidate();
 }
 
 void renderer_keyboard_pan_up() {
 	screenOffsetY -= 10 / zoomScale;
+
+	renderer_invalidate();
 }
 
 void renderer_keyboard_pan_down() {
 	screenOffsetY += 10 / zoomScale;
+
+	renderer_invalidate();
 }
 
 void renderer_keyboard_pan_right() {
 	screenOffsetX += 10 / zoomScale;
+
+	renderer_invalidate();
 }
 
 void renderer_keyboard_pan_left() {
 	screenOffsetX -= 10 / zoomScale;
+
+	renderer_invalidate();
 }
 
 void renderer_mouse_wheel_zoom(int x, int y, float preciseX, float preciseY) {
@@ -301,9 +907,16 @@ void renderer_mouse_wheel_zoom(int x, int y, float preciseX, float preciseY) {
 
 	screenOffsetX += (mouseStageX1 - mouseStageX2);
 	screenOffsetY += (mouseStageY1 - mouseStageY2);
+
+	renderer_invalidate();
 }
 
 void renderer_mouse_pan(int relX, int relY) {
+	if (relX == 0 && relY == 0)
+		return;
+
 	screenOffsetY -= relY / zoomScale;
 	screenOffsetX -= relX / zoomScale;
+
+	renderer_invalidate();
 }
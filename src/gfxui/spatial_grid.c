@@ -0,0 +1,180 @@
+/*	
+ *	SPDX-License-Identifier: GPL-3.0-only
+ *
+ *  Virtual Orchestra - Musical Instrument Simulation
+ *  Copyright (C) 2024 Garnek0 (Popa Vlad) and Contributors
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <vo/gfxui/spatial_grid.h>
+#include <vo/debug.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#define SPATIAL_GRID_BUCKET_COUNT 256
+
+// Past this many cells a query just walks every bucket.
+#define SPATIAL_GRID_MAX_QUERY_CELLS (SPATIAL_GRID_BUCKET_COUNT*4)
+
+struct spatial_grid* spatial_grid_create(float cellSize) {
+	struct spatial_grid* grid = malloc(sizeof(struct spatial_grid));
+	memset((void*)grid, 0, sizeof(struct spatial_grid));
+
+	grid->cellSize = cellSize;
+	grid->bucketCount = SPATIAL_GRID_BUCKET_COUNT;
+	grid->buckets = (struct spatial_grid_bucket*)calloc(grid->bucketCount, sizeof(struct spatial_grid_bucket));
+
+	return grid;
+}
+
+void spatial_grid_destroy(struct spatial_grid* grid) {
+	if (!grid)
+		return;
+
+	for (int i = 0; i < grid->bucketCount; i++)
+		free((void*)grid->buckets[i].entries);
+
+	free((void*)grid->buckets);
+	free((void*)grid);
+}
+
+static struct spatial_grid_bucket* spatial_grid_get_bucket(struct spatial_grid* grid, int cellX, int cellY) {
+	unsigned int hash = (unsigned int)cellX * 73856093u ^ (unsigned int)cellY * 19349663u;
+
+	return &grid->buckets[hash % grid->bucketCount];
+}
+
+// The range of cells an area touches.
+static void spatial_grid_cell_range(struct spatial_grid* grid, const SDL_FRect* area, int* minX, int* minY, int* maxX, int* maxY) {
+	*minX = (int)floorf(area->x / grid->cellSize);
+	*minY = (int)floorf(area->y / grid->cellSize);
+	*maxX = (int)floorf((area->x + area->w) / grid->cellSize);
+	*maxY = (int)floorf((area->y + area->h) / grid->cellSize);
+}
+
+// Add an item to every cell its bounds touch. Returns -1 (with the item
+// not added anywhere) if out of memory.
+int spatial_grid_insert(struct spatial_grid* grid, void* item, const SDL_FRect* bounds) {
+	int minX, minY, maxX, maxY;
+	spatial_grid_cell_range(grid, bounds, &minX, &minY, &maxX, &maxY);
+
+	for (int y = minY; y <= maxY; y++) {
+		for (int x = minX; x <= maxX; x++) {
+			struct spatial_grid_bucket* bucket = spatial_grid_get_bucket(grid, x, y);
+
+			if (bucket->entryCount == bucket->maxEntriesBeforeRealloc) {
+				int newMaxEntries = bucket->maxEntriesBeforeRealloc ? bucket->maxEntriesBeforeRealloc*2 : 8;
+				struct spatial_grid_entry* newEntries = (struct spatial_grid_entry*)realloc((void*)bucket->entries, sizeof(struct spatial_grid_entry)*newMaxEntries);
+
+				if (!newEntries) {
+					debug_log(LOGLEVEL_ERROR, "Spatial Grid: Failed to grow bucket past %d entries!\n", bucket->entryCount);
+					spatial_grid_remove(grid, item, bounds);
+					return -1;
+				}
+
+				bucket->entries = newEntries;
+				bucket->maxEntriesBeforeRealloc = newMaxEntries;
+			}
+
+			bucket->entries[bucket->entryCount++] = (struct spatial_grid_entry){x, y, item};
+		}
+	}
+
+	return 0;
+}
+
+// Remove an item. bounds must be the same as when it was inserted.
+void spatial_grid_remove(struct spatial_grid* grid, void* item, const SDL_FRect* bounds) {
+	int minX, minY, maxX, maxY;
+	spatial_grid_cell_range(grid, bounds, &minX, &minY, &maxX, &maxY);
+
+	for (int y = minY; y <= maxY; y++) {
+		for (int x = minX; x <= maxX; x++) {
+			struct spatial_grid_bucket* bucket = spatial_grid_get_bucket(grid, x, y);
+
+			for (int i = 0; i < bucket->entryCount; i++) {
+				struct spatial_grid_entry* entry = &bucket->entries[i];
+
+				if (entry->item == item && entry->cellX == x && entry->cellY == y) {
+					*entry = bucket->entries[--bucket->entryCount];
+					break;
+				}
+			}
+		}
+	}
+}
+
+static int spatial_grid_add_result(void*** items, int* maxItems, int* itemCount, void* item) {
+	if (*itemCount == *maxItems) {
+		int newMaxItems = *maxItems ? *maxItems*2 : 16;
+		void** newItems = (void**)realloc((void*)*items, sizeof(void*)*newMaxItems);
+
+		if (!newItems) {
+			debug_log(LOGLEVEL_ERROR, "Spatial Grid: Failed to grow query results past %d items!\n", *itemCount);
+			return -1;
+		}
+
+		*items = newItems;
+		*maxItems = newMaxItems;
+	}
+
+	(*items)[(*itemCount)++] = item;
+
+	return 0;
+}
+
+// Collect the items in the cells an area touches into *items, which is
+// grown as needed (*maxItems is its size). Returns the number of items
+// found. An item may show up more than once and may not actually overlap
+// the area, only its cells. If out of memory, the items found so far are
+// returned.
+int spatial_grid_query(struct spatial_grid* grid, const SDL_FRect* area, void*** items, int* maxItems) {
+	int minX, minY, maxX, maxY;
+	spatial_grid_cell_range(grid, area, &minX, &minY, &maxX, &maxY);
+
+	int itemCount = 0;
+
+	if ((long)(maxX - minX + 1) * (maxY - minY + 1) > SPATIAL_GRID_MAX_QUERY_CELLS) {
+		for (int i = 0; i < grid->bucketCount; i++) {
+			struct spatial_grid_bucket* bucket = &grid->buckets[i];
+
+			for (int j = 0; j < bucket->entryCount; j++) {
+				struct spatial_grid_entry* entry = &bucket->entries[j];
+
+				if (entry->cellX >= minX && entry->cellX <= maxX && entry->cellY >= minY && entry->cellY <= maxY && spatial_grid_add_result(items, maxItems, &itemCount, entry->item) != 0)
+					return itemCount;
+			}
+		}
+
+		return itemCount;
+	}
+
+	for (int y = minY; y <= maxY; y++) {
+		for (int x = minX; x <= maxX; x++) {
+			struct spatial_grid_bucket* bucket = spatial_grid_get_bucket(grid, x, y);
+
+			for (int i = 0; i < bucket->entryCount; i++) {
+				struct spatial_grid_entry* entry = &bucket->entries[i];
+
+				if (entry->cellX == x && entry->cellY == y && spatial_grid_add_result(items, maxItems, &itemCount, entry->item) != 0)
+					return itemCount;
+			}
+		}
+	}
+
+	return itemCount;
+}
@@ -0,0 +1,311 @@
+/*	
+ *	SPDX-License-Identifier: GPL-3.0-only
+ *
+ *  Virtual Orchestra - Musical Instrument Simulation
+ *  Copyright (C) 2024 Garnek0 (Popa Vlad) and Contributors
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <vo/gfxui/texture_cache.h>
+#include <vo/debug.h>
+#include <vo/list.h>
+#include <vo/task.h>
+
+#include <SDL2/SDL_image.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Size of a regular atlas page. Images that don't fit get a page of
+// their own.
+#define TEXTURE_ATLAS_PAGE_SIZE 1024
+
+// Empty pixels left around every image so that filtering doesn't bleed
+// neighbouring images into it.
+#define TEXTURE_ATLAS_PADDING 1
+
+static SDL_Renderer* renderer;
+
+static struct list* entryList;
+static struct list* pageList;
+
+// An image being decoded on a worker thread before anyone asks for it.
+struct texture_cache_prefetch {
+	char* path;
+	struct task* task;
+
+	// Set by the task, NULL if the image couldn't be decoded.
+	SDL_Surface* surface;
+};
+
+static struct list* prefetchList;
+
+int texture_cache_init(SDL_Renderer* sdlRenderer) {
+	renderer = sdlRenderer;
+
+	entryList = list_create();
+	pageList = list_create();
+	prefetchList = list_create();
+
+	return 0;
+}
+
+static struct texture_atlas_page* texture_cache_new_page(int width, int height) {
+	struct texture_atlas_page* page = malloc(sizeof(struct texture_atlas_page));
+	memset((void*)page, 0, sizeof(struct texture_atlas_page));
+
+	page->texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_STATIC, width, height);
+
+	if (!page->texture) {
+		debug_log(LOGLEVEL_ERROR, "Texture Cache: Could not create %dx%d atlas page: %s\n", width, height, SDL_GetError());
+		free((void*)page);
+		return NULL;
+	}
+
+	SDL_SetTextureBlendMode(page->texture, SDL_BLENDMODE_BLEND);
+
+	// Static textures start out with undefined contents, make the padding
+	// between images transparent.
+	void* clearPixels = calloc((size_t)width * height, 4);
+	if (clearPixels) {
+		SDL_UpdateTexture(page->texture, NULL, clearPixels, width * 4);
+		free(clearPixels);
+	}
+
+	page->width = width;
+	page->height = height;
+
+	list_insert(pageList, (void*)page);
+
+	return page;
+}
+
+static void texture_cache_free_page(struct texture_atlas_page* page) {
+	list_remove(pageList, (void*)page);
+	SDL_DestroyTexture(page->texture);
+	free((void*)page);
+}
+
+// Find room for a w x h image. Returns the page and fills in rect.
+static struct texture_atlas_page* texture_cache_pack(int w, int h, SDL_Rect* rect) {
+	int paddedW = w + TEXTURE_ATLAS_PADDING*2;
+	int paddedH = h + TEXTURE_ATLAS_PADDING*2;
+
+	// Too big to share a page
+	if (paddedW > TEXTURE_ATLAS_PAGE_SIZE || paddedH > TEXTURE_ATLAS_PAGE_SIZE) {
+		struct texture_atlas_page* page = texture_cache_new_page(w, h);
+		if (!page)
+			return NULL;
+
+		// Nothing else will ever fit on this page.
+		page->shelfY = page->height;
+
+		*rect = (SDL_Rect){0, 0, w, h};
+		return page;
+	}
+
+	list_foreach(node, pageList) {
+		struct texture_atlas_page* page = (struct texture_atlas_page*)node->data;
+
+		// Start a new shelf if this one is full
+		if (page->shelfX + paddedW > page->width) {
+			page->shelfX = 0;
+			page->shelfY += page->shelfHeight;
+			page->shelfHeight = 0;
+		}
+
+		if (page->shelfY + paddedH > page->height)
+			continue;
+
+		*rect = (SDL_Rect){page->shelfX + TEXTURE_ATLAS_PADDING, page->shelfY + TEXTURE_ATLAS_PADDING, w, h};
+
+		page->shelfX += paddedW;
+		if (paddedH > page->shelfHeight)
+			page->shelfHeight = paddedH;
+
+		return page;
+	}
+
+	struct texture_atlas_page* page = texture_cache_new_page(TEXTURE_ATLAS_PAGE_SIZE, TEXTURE_ATLAS_PAGE_SIZE);
+	if (!page)
+		return NULL;
+
+	*rect = (SDL_Rect){TEXTURE_ATLAS_PADDING, TEXTURE_ATLAS_PADDING, w, h};
+
+	page->shelfX = paddedW;
+	page->shelfHeight = paddedH;
+
+	return page;
+}
+
+static struct texture_cache_entry* texture_cache_find(const char* path) {
+	list_foreach(node, entryList) {
+		struct texture_cache_entry* entry = (struct texture_cache_entry*)node->data;
+
+		if (strcmp(entry->path, path) == 0)
+			return entry;
+	}
+
+	return NULL;
+}
+
+// Read an image file into a surface in the atlas' pixel format. Doesn't
+// touch the SDL renderer, so any thread can do it.
+static SDL_Surface* texture_cache_decode(const char* path) {
+	SDL_Surface* loadedSurface = IMG_Load(path);
+	if (!loadedSurface) {
+		debug_log(LOGLEVEL_ERROR, "Texture Cache: Texture file \"%s\" could not be loaded: %s\n", path, IMG_GetError());
+		return NULL;
+	}
+
+	SDL_Surface* surface = SDL_ConvertSurfaceFormat(loadedSurface, SDL_PIXELFORMAT_ARGB8888, 0);
+	SDL_FreeSurface(loadedSurface);
+
+	if (!surface)
+		debug_log(LOGLEVEL_ERROR, "Texture Cache: Could not convert texture file \"%s\": %s\n", path, SDL_GetError());
+
+	return surface;
+}
+
+static int texture_cache_prefetch_task(void* data) {
+	struct texture_cache_prefetch* prefetch = (struct texture_cache_prefetch*)data;
+
+	prefetch->surface = texture_cache_decode(prefetch->path);
+
+	return prefetch->surface ? 0 : -1;
+}
+
+// Start decoding an image on a worker thread, so that acquiring it later
+// only has to upload it. Does nothing if the image is already loaded or
+// being decoded.
+void texture_cache_prefetch(const char* path) {
+	if (!prefetchList || texture_cache_find(path))
+		return;
+
+	list_foreach(node, prefetchList) {
+		if (strcmp(((struct texture_cache_prefetch*)node->data)->path, path) == 0)
+			return;
+	}
+
+	struct texture_cache_prefetch* prefetch = malloc(sizeof(struct texture_cache_prefetch));
+	if (!prefetch)
+		return;
+
+	prefetch->path = strdup(path);
+	prefetch->surface = NULL;
+	prefetch->task = task_start("vo-decode", texture_cache_prefetch_task, (void*)prefetch);
+
+	if (!prefetch->task) {
+		free((void*)prefetch->path);
+		free((void*)prefetch);
+		return;
+	}
+
+	list_insert(prefetchList, (void*)prefetch);
+}
+
+// Wait for a prefetched image and take its surface. Returns false if the
+// image wasn't prefetched.
+static bool texture_cache_take_prefetched(const char* path, SDL_Surface** surface) {
+	list_foreach(node, prefetchList) {
+		struct texture_cache_prefetch* prefetch = (struct texture_cache_prefetch*)node->data;
+
+		if (strcmp(prefetch->path, path) != 0)
+			continue;
+
+		task_wait(prefetch->task);
+		*surface = prefetch->surface;
+
+		list_remove(prefetchList, (void*)prefetch);
+		free((void*)prefetch->path);
+		free((void*)prefetch);
+
+		return true;
+	}
+
+	return false;
+}
+
+// Get the image at path, loading it into the atlas the first time it is
+// asked for. Every acquire must be matched by a texture_cache_release().
+struct texture_cache_entry* texture_cache_acquire(const char* path) {
+	struct texture_cache_entry* cachedEntry = texture_cache_find(path);
+
+	if (cachedEntry) {
+		cachedEntry->refCount++;
+		return cachedEntry;
+	}
+
+	// Decoding may already be done, uploading has to happen here, on the
+	// thread that owns the renderer.
+	SDL_Surface* surface;
+
+	if (!texture_cache_take_prefetched(path, &surface))
+		surface = texture_cache_decode(path);
+
+	if (!surface)
+		return NULL;
+
+	struct texture_cache_entry* entry = malloc(sizeof(struct texture_cache_entry));
+	if (!entry) {
+		SDL_FreeSurface(surface);
+		return NULL;
+	}
+
+	memset((void*)entry, 0, sizeof(struct texture_cache_entry));
+
+	entry->page = texture_cache_pack(surface->w, surface->h, &entry->rect);
+
+	if (!entry->page || SDL_UpdateTexture(entry->page->texture, &entry->rect, surface->pixels, surface->pitch) != 0) {
+		debug_log(LOGLEVEL_ERROR, "Texture Cache: Could not upload texture file \"%s\" to the atlas: %s\n", path, SDL_GetError());
+
+		// Don't keep a page around that was only made for this image. On a
+		// shared page the space is lost, like that of released images.
+		if (entry->page && entry->page->entryCount == 0)
+			texture_cache_free_page(entry->page);
+
+		SDL_FreeSurface(surface);
+		free((void*)entry);
+		return NULL;
+	}
+
+	SDL_FreeSurface(surface);
+
+	entry->path = strdup(path);
+	entry->refCount = 1;
+	entry->page->entryCount++;
+
+	list_insert(entryList, (void*)entry);
+
+	debug_log(LOGLEVEL_DEBUG, "Texture Cache: Loaded \"%s\" (%dx%d) into the atlas.\n", path, entry->rect.w, entry->rect.h);
+
+	return entry;
+}
+
+// Drop a reference to an image. The atlas space of released images isn't
+// reused, but a page is freed once nothing on it is used anymore.
+void texture_cache_release(struct texture_cache_entry* entry) {
+	if (!entry || --entry->refCount > 0)
+		return;
+
+	struct texture_atlas_page* page = entry->page;
+
+	list_remove(entryList, (void*)entry);
+	free((void*)entry->path);
+	free((void*)entry);
+
+	if (--page->entryCount == 0)
+		texture_cache_free_page(page);
+}
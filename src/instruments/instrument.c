@@ -41,8 +41,32 @@ int instrument_init() {
 	return 0;
 }
 
+// Create an instrument and call its init function.
 struct instrument* instrument_new(struct instrument_new_args args) {
+	struct instrument* newInstr = instrument_new_deferred(args);
+
+	if (!newInstr)
+		return NULL;
+
+	if (instrument_finish_new(newInstr) != 0) {
+		instrument_destroy(newInstr);
+		return NULL;
+	}
+
+	return newInstr;
+}
+
+// Create an instrument and start loading its sound, but leave calling its
+// init function (which loads its images) to instrument_finish_new(). Other
+// loading that needs the instrument, like parsing its notes, can be started
+// in between.
+struct instrument* instrument_new_deferred(struct instrument_new_args args) {
 	struct instrument* newInstr = (struct instrument*)malloc(sizeof(struct instrument));
+	if (!newInstr) {
+		debug_log(LOGLEVEL_ERROR, "Instrument: Failed to allocate new instrument.\n");
+		return NULL;
+	}
+
 	memset((void*)newInstr, 0, sizeof(struct instrument));
 
 	// Give the new instrument an ID
@@ -58,33 +82,48 @@ struct instrument* instrument_new(struct instrument_new_args args) {
 	newInstr->fini = args.fini;
 	newInstr->play_note = args.play_note;
 	newInstr->release_note = args.release_note;
+	newInstr->update_visuals = args.update_visuals;
 
 	newInstr->maxTexturesBeforeRealloc = 0;
 
 	newInstr->dynamic = DYNAMICS_MP;
 
-	if (newInstr->init(newInstr) != 0) {
-		debug_log(LOGLEVEL_ERROR, "Instrument: Could not initialize instrument with ID=%d.\n", newInstr->id);
-		goto fail;
-	}
+	newInstr->noteList = note_store_create();
+
+	// The soundfont loads in the background from here on.
 
 	if (audio_init_instrument(newInstr, args.soundfontPath, args.bank, args.preset, args.polyphony) != 0) {
 		debug_log(LOGLEVEL_ERROR, "Instrument: Audio engine could not initialize instrument with ID=%d.\n", newInstr->id);
-		goto fail;
+		note_store_destroy(newInstr->noteList);
+		free((void*)newInstr);
+		return NULL;
 	}
 
 	list_insert(instrumentList, (void*)newInstr);
 
 	return newInstr;
+}
 
-fail:
-	free((void*)newInstr);
-	return NULL;
+// Call the init function of an instrument made by
+// instrument_new_deferred(). On failure the instrument is left for the
+// caller to destroy once nothing else is loading into it.
+int instrument_finish_new(struct instrument* instr) {
+	if (instr->init(instr) != 0) {
+		debug_log(LOGLEVEL_ERROR, "Instrument: Could not initialize instrument with ID=%d.\n", instr->id);
+		return -1;
+	}
+
+	instr->initialized = true;
+
+	return 0;
 }
 
 void instrument_set_position(struct instrument* instr, float x, float y) {
 	instr->x = x;
 	instr->y = y;
+
+	renderer_update_instrument_bounds(instr);
+	renderer_invalidate();
 }
 
 void instrument_destroy(struct instrument* instr) {
@@ -97,14 +136,54 @@ void instrument_destroy(struct instrument* instr) {
 	
 	renderer_free_instrument_textures(instr);
 
-	if(instr->fini(instr) != 0)
+	audio_fini_instrument(instr);
+
+	if (instr->initialized && instr->fini(instr) != 0)
 		debug_log(LOGLEVEL_ERROR, "Instrument: Could not properly destroy instrument with ID=%d.\n", instr->id);
 
 	list_remove(instrumentList, (void*)instr);
 
+	note_store_destroy(instr->noteList);
 	free((void*)instr);
 }
 
+// Whether any instrument is still loading in the background.
+bool instrument_is_loading() {
+	list_foreach(node, instrumentList) {
+		if (audio_is_instrument_loading((struct instrument*)node->data))
+			return true;
+	}
+
+	return false;
+}
+
+// Wait until every instrument has finished loading. Instruments whose
+// soundfont failed to load stay silent.
+void instrument_wait_loaded() {
+	list_foreach(node, instrumentList) {
+		struct instrument* instr = (struct instrument*)node->data;
+
+		if (audio_wait_instrument(instr) != 0)
+			debug_log(LOGLEVEL_ERROR, "Instrument: Instrument with ID=%d will be silent, its sound could not be loaded.\n", instr->id);
+	}
+}
+
+// Bring every instrument's visuals up to date with the keys playback has
+// pressed. Must be called from the main thread.
+void instrument_update_visuals() {
+	list_foreach(node, instrumentList) {
+		struct instrument* instr = (struct instrument*)node->data;
+
+		if (!instr->update_visuals || key_state_get_sequence(&instr->keyState) == instr->visualKeyStateSequence)
+			continue;
+
+		struct key_state_snapshot keys;
+		instr->visualKeyStateSequence = key_state_read(&instr->keyState, &keys);
+
+		instr->update_visuals(instr, &keys);
+	}
+}
+
 struct list* instrument_get_list() {
 	return instrumentList;
 }
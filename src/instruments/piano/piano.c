@@ -23,88 +23,159 @@
 #include <vo/gfxui/renderer.h>
 #include <vo/note.h>
 #include <vo/audio.h>
+#include <vo/dynamics.h>
 
-int keyTextureIndexes[61];
-int pressedKeyTextureIndexes[61];
+#include <stdlib.h>
+#include <string.h>
 
-int piano_init(struct instrument* instr) {
+#define PIANO_WHITE_KEY_TEXTURE "res/instrument/piano/whitekey.png"
+#define PIANO_WHITE_KEY_PRESSED_TEXTURE "res/instrument/piano/whitekey-pressed.png"
+#define PIANO_BLACK_KEY_TEXTURE "res/instrument/piano/blackkey.png"
+#define PIANO_BLACK_KEY_PRESSED_TEXTURE "res/instrument/piano/blackkey-pressed.png"
 
-#define LOAD_WHITE_KEY_TEXTURE(i, x, xoff) \
-	if (((keyTextureIndexes[(i)/217*12 + (x)] = renderer_load_instrument_texture(instr, "res/instrument/piano/whitekey.png", (xoff), 0, 0)) < 0) || \
-		((pressedKeyTextureIndexes[(i)/217*12 + (x)] = renderer_load_instrument_texture(instr, "res/instrument/piano/whitekey-pressed.png", (xoff), 0, 1)) < 0)) \
-			goto fail;
+// Width of an octave on the keyboard, in pixels.
+#define PIANO_OCTAVE_WIDTH 217
 
-#define LOAD_BLACK_KEY_TEXTURE(i, x, xoff) \
-	if (((keyTextureIndexes[(i)/217*12 + (x)] = renderer_load_instrument_texture(instr, "res/instrument/piano/blackkey.png", (xoff), 0, 2)) < 0) || \
-		((pressedKeyTextureIndexes[(i)/217*12 + (x)] = renderer_load_instrument_texture(instr, "res/instrument/piano/blackkey-pressed.png", (xoff), 0, 3)) < 0)) \
-			goto fail;
-	
-	// Load piano key textures
-	for (int i = 0; i < 217 * 5; i+=217) {
-		LOAD_WHITE_KEY_TEXTURE(i, 0, i + 0);
-		LOAD_BLACK_KEY_TEXTURE(i, 1, i + 14);
-		LOAD_WHITE_KEY_TEXTURE(i, 2, i + 1 * 31);
-		LOAD_BLACK_KEY_TEXTURE(i, 3, i + 49);
-		LOAD_WHITE_KEY_TEXTURE(i, 4, i + 2 * 31);
-		LOAD_WHITE_KEY_TEXTURE(i, 5, i + 3 * 31);
-		LOAD_BLACK_KEY_TEXTURE(i, 6, i + 107);
-		LOAD_WHITE_KEY_TEXTURE(i, 7, i + 4 * 31);
-		LOAD_BLACK_KEY_TEXTURE(i, 8, i + 140);
-		LOAD_WHITE_KEY_TEXTURE(i, 9, i + 5 * 31);
-		LOAD_BLACK_KEY_TEXTURE(i, 10, i + 173);
-		LOAD_WHITE_KEY_TEXTURE(i, 11, i + 6 * 31);	
-	}
+// Where each key of an octave is, starting from C. White keys are 31
+// pixels apart, black keys sit between them.
+static const int pianoKeyOffsets[12] = {0, 14, 31, 49, 62, 93, 107, 124, 140, 155, 173, 186};
+
+static int piano_key_position(int midiKey) {
+	return (midiKey / 12) * PIANO_OCTAVE_WIDTH + pianoKeyOffsets[midiKey % 12];
+}
+
+// Start decoding the key images in the background, so that creating a
+// piano later only has to upload them.
+void piano_prefetch_textures() {
+	texture_cache_prefetch(PIANO_WHITE_KEY_TEXTURE);
+	texture_cache_prefetch(PIANO_WHITE_KEY_PRESSED_TEXTURE);
+	texture_cache_prefetch(PIANO_BLACK_KEY_TEXTURE);
+	texture_cache_prefetch(PIANO_BLACK_KEY_PRESSED_TEXTURE);
+}
+
+// Set up a piano with every key from lowestKey to highestKey (MIDI keys).
+static int piano_init_range(struct instrument* instr, int lowestKey, int highestKey) {
+	struct piano* piano = malloc(sizeof(struct piano));
+
+	memset((void*)piano, 0, sizeof(struct piano));
+
+	piano->lowestKey = lowestKey;
+	piano->highestKey = highestKey;
 
-#undef LOAD_WHITE_KEY_TEXTURE
-#undef LOAD_BLACK_KEY_TEXTURE
+	for (int i = 0; i < 128; i++)
+		piano->keyTextureIndexes[i] = piano->pressedKeyTextureIndexes[i] = -1;
 
-	// The last C
-	if (((keyTextureIndexes[60] = renderer_load_instrument_texture(instr, "res/instrument/piano/whitekey.png", 5*217, 0, 0)) < 0) || \
-		((pressedKeyTextureIndexes[60] = renderer_load_instrument_texture(instr, "res/instrument/piano/whitekey-pressed.png", 5*217, 0, 0)) < 0)) \
+	instr->data = (void*)piano;
+
+	// The lowest key is at the left edge of the piano.
+	int firstKeyPosition = piano_key_position(lowestKey);
+
+	for (int midiKey = lowestKey; midiKey <= highestKey; midiKey++) {
+		int offset = piano_key_position(midiKey) - firstKeyPosition;
+		bool white = NOTE_IS_NATURAL(midiKey % 12);
+
+		// Black keys go on top of the white ones.
+		int layer = white ? 0 : 2;
+
+		piano->keyTextureIndexes[midiKey] = renderer_load_instrument_texture(instr, white ? PIANO_WHITE_KEY_TEXTURE : PIANO_BLACK_KEY_TEXTURE, offset, 0, layer);
+		piano->pressedKeyTextureIndexes[midiKey] = renderer_load_instrument_texture(instr, white ? PIANO_WHITE_KEY_PRESSED_TEXTURE : PIANO_BLACK_KEY_PRESSED_TEXTURE, offset, 0, layer + 1);
+
+		if (piano->keyTextureIndexes[midiKey] < 0 || piano->pressedKeyTextureIndexes[midiKey] < 0)
 			goto fail;
 
-	// Hide all pressed textures
-	for (int i = 0; i < 61; i++)
-		renderer_set_instrument_texture_opacity(instr, pressedKeyTextureIndexes[i], 0);
+		// Pressed textures are hidden until the key is played
+		renderer_set_instrument_texture_opacity(instr, piano->pressedKeyTextureIndexes[midiKey], 0);
+	}
 
-	debug_log(LOGLEVEL_DEBUG, "Piano: New piano initialized! (ID=%d)\n", instr->id);
+	debug_log(LOGLEVEL_DEBUG, "Piano: New %d-key piano initialized! (ID=%d)\n", highestKey - lowestKey + 1, instr->id);
 	return 0;
 
 fail:
 	debug_log(LOGLEVEL_ERROR, "Piano: Failed to load key texture! (ID=%d)\n", instr->id);
+
+	free((void*)piano);
+	instr->data = NULL;
+
 	return -1;	
 }
 
+// 61 keys, C2 - C7
+int piano_init(struct instrument* instr) {
+	return piano_init_range(instr, 36, 96);
+}
+
+// 76 keys, E1 - G7
+int piano_init_76(struct instrument* instr) {
+	return piano_init_range(instr, 28, 103);
+}
+
+// 88 keys, A0 - C8
+int piano_init_88(struct instrument* instr) {
+	return piano_init_range(instr, 21, 108);
+}
+
 int piano_fini(struct instrument* instr) {
 	// Destroyed!?... Poor piano...
+	free(instr->data);
+	instr->data = NULL;
+
 	debug_log(LOGLEVEL_DEBUG, "Piano: Destroyed! (ID=%d)\n", instr->id);
 	return 0;
 }
 
-int piano_play_note(struct instrument* instr, struct complex_note note) {
-	if ((note.octave > 6) && (note.octave != 6) && (note.key != NOTE_C))
+// MIDI key of a note, or -1 if the piano doesn't have that key.
+static int piano_get_key(struct piano* piano, struct complex_note note) {
+	int midiKey = NOTE_TO_MIDI_KEY(note.key, note.octave);
+
+	if (note.key < 0 || note.key > 11 || midiKey < piano->lowestKey || midiKey > piano->highestKey)
 		return -1;
 
-	if (note.octave < 1)
+	return midiKey;
+}
+
+int piano_play_note(struct instrument* instr, struct complex_note note) {
+	int midiKey = piano_get_key((struct piano*)instr->data, note);
+
+	if (midiKey < 0)
 		return -1;
 
-	renderer_set_instrument_texture_opacity(instr, pressedKeyTextureIndexes[(note.octave-2)*12+note.key], 60);
+	key_state_set(&instr->keyState, midiKey, true);
 
-	audio_note_on(instr, (struct simple_note){.key = note.key, .octave = note.octave, .velocity = note.sfz ? 127 : 127 - (instr->dynamic - 1)*(127/8)});
+	int velocity = note.velocity;
+
+	if (!velocity)
+		velocity = note.sfz ? 127 : DYNAMICS_TO_VELOCITY(instr->dynamic);
+
+	audio_note_on(instr, (struct simple_note){.key = note.key, .octave = note.octave, .velocity = velocity, .scheduledTime = note.scheduledTime});
 
 	return 0;
 }
 
 int piano_release_note(struct instrument* instr, struct complex_note note) {
-	if ((note.octave > 6) && (note.octave != 6) && (note.key != NOTE_C))
-		return -1;
+	int midiKey = piano_get_key((struct piano*)instr->data, note);
 
-	if (note.octave < 1)
+	if (midiKey < 0)
 		return -1;
 
-	renderer_set_instrument_texture_opacity(instr, pressedKeyTextureIndexes[(note.octave-2)*12+note.key], 0);
+	key_state_set(&instr->keyState, midiKey, false);
 
-	audio_note_off(instr, (struct simple_note){.key = note.key, .octave = note.octave});
+	audio_note_off(instr, (struct simple_note){.key = note.key, .octave = note.octave, .scheduledTime = note.scheduledTime});
 
 	return 0;
 }
+
+// Show the pressed keys by fading in their pressed textures.
+void piano_update_visuals(struct instrument* instr, const struct key_state_snapshot* keys) {
+	struct piano* piano = (struct piano*)instr->data;
+
+	for (int midiKey = piano->lowestKey; midiKey <= piano->highestKey; midiKey++) {
+		bool pressed = KEY_STATE_IS_PRESSED(keys, midiKey);
+
+		if (pressed == KEY_STATE_IS_PRESSED(&piano->shownKeys, midiKey))
+			continue;
+
+		renderer_set_instrument_texture_opacity(instr, piano->pressedKeyTextureIndexes[midiKey], pressed ? 60 : 0);
+	}
+
+	piano->shownKeys = *keys;
+}
@@ -0,0 +1,209 @@
+/*	
+ *	SPDX-License-Identifier: GPL-3.0-only
+ *
+ *  Virtual Orchestra - Musical Instrument Simulation
+ *  Copyright (C) 2024 Garnek0 (Popa Vlad) and Contributors
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <vo/interval_index.h>
+#include <vo/debug.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+// Subtrees this deep or shallower are scanned linearly instead of being
+// walked.
+#define INTERVAL_INDEX_SCAN_LEVEL 3
+
+// Enough for any tree that fits in an int.
+#define INTERVAL_INDEX_STACK_SIZE 64
+
+struct interval_index* interval_index_create() {
+	struct interval_index* index = malloc(sizeof(struct interval_index));
+	memset((void*)index, 0, sizeof(struct interval_index));
+
+	index->rootLevel = -1;
+
+	return index;
+}
+
+void interval_index_destroy(struct interval_index* index) {
+	if (!index)
+		return;
+
+	free((void*)index->end);
+	free((void*)index->maxEnd);
+	free((void*)index);
+}
+
+// Index count intervals. start must be sorted, end is copied.
+int interval_index_build(struct interval_index* index, const int64_t* start, const int64_t* end, int count) {
+	if (count > index->capacity) {
+		int64_t* newEnd = realloc((void*)index->end, sizeof(int64_t)*count);
+		if (newEnd)
+			index->end = newEnd;
+
+		int64_t* newMaxEnd = realloc((void*)index->maxEnd, sizeof(int64_t)*count);
+		if (newMaxEnd)
+			index->maxEnd = newMaxEnd;
+
+		if (!newEnd || !newMaxEnd) {
+			debug_log(LOGLEVEL_ERROR, "Interval Index: Failed to allocate %d intervals!\n", count);
+			index->count = 0;
+			index->rootLevel = -1;
+			return -1;
+		}
+
+		index->capacity = count;
+	}
+
+	index->start = start;
+	index->count = count;
+	memcpy((void*)index->end, (void*)end, sizeof(int64_t)*count);
+
+	if (count == 0) {
+		index->rootLevel = -1;
+		return 0;
+	}
+
+	int lastIndex = 0;
+	int64_t lastMax = 0;
+
+	// Leaves
+	for (int i = 0; i < count; i += 2) {
+		lastIndex = i;
+		lastMax = index->maxEnd[i] = index->end[i];
+	}
+
+	// Every level above them. Nodes whose right subtree falls off the end
+	// of the array take the max of the last node that does exist instead.
+	int level;
+	for (level = 1; (1L << level) <= count; level++) {
+		int x = 1 << (level - 1);
+		int step = x << 2;
+
+		for (int i = (x << 1) - 1; i < count; i += step) {
+			int64_t leftMax = index->maxEnd[i - x];
+			int64_t rightMax = i + x < count ? index->maxEnd[i + x] : lastMax;
+			int64_t max = index->end[i];
+
+			if (leftMax > max)
+				max = leftMax;
+			if (rightMax > max)
+				max = rightMax;
+
+			index->maxEnd[i] = max;
+		}
+
+		lastIndex = (lastIndex >> level & 1) ? lastIndex - x : lastIndex + x;
+
+		if (lastIndex < count && index->maxEnd[lastIndex] > lastMax)
+			lastMax = index->maxEnd[lastIndex];
+	}
+
+	index->rootLevel = level - 1;
+
+	return 0;
+}
+
+static int interval_index_add_result(int** results, int* maxResults, int* resultCount, int result) {
+	if (*resultCount == *maxResults) {
+		int newMaxResults = *maxResults ? *maxResults*2 : 64;
+		int* newResults = (int*)realloc((void*)*results, sizeof(int)*newMaxResults);
+
+		if (!newResults) {
+			debug_log(LOGLEVEL_ERROR, "Interval Index: Failed to grow query results past %d intervals!\n", *resultCount);
+			return -1;
+		}
+
+		*results = newResults;
+		*maxResults = newMaxResults;
+	}
+
+	(*results)[(*resultCount)++] = result;
+
+	return 0;
+}
+
+// Collect the indexes of the intervals with start <= time < end into
+// *results, which is grown as needed (*maxResults is its size). Returns the
+// number of intervals found. If out of memory, the intervals found so far
+// are returned.
+int interval_index_query(struct interval_index* index, int64_t time, int** results, int* maxResults) {
+	struct {
+		int node;
+		int level;
+		// Whether the left subtree has already been dealt with.
+		int leftDone;
+	} stack[INTERVAL_INDEX_STACK_SIZE];
+
+	int resultCount = 0;
+	int top = 0;
+
+	if (index->rootLevel < 0)
+		return 0;
+
+	stack[top].node = (1 << index->rootLevel) - 1;
+	stack[top].level = index->rootLevel;
+	stack[top].leftDone = 0;
+	top++;
+
+	while (top > 0) {
+		top--;
+		int node = stack[top].node;
+		int level = stack[top].level;
+		int leftDone = stack[top].leftDone;
+
+		if (level <= INTERVAL_INDEX_SCAN_LEVEL) {
+			// Small subtree, just go through it.
+			int first = node >> level << level;
+			int last = first + (1 << (level + 1)) - 1;
+
+			if (last > index->count)
+				last = index->count;
+
+			for (int i = first; i < last && index->start[i] <= time; i++)
+				if (index->end[i] > time && interval_index_add_result(results, maxResults, &resultCount, i) != 0)
+					return resultCount;
+		} else if (!leftDone) {
+			int left = node - (1 << (level - 1));
+
+			stack[top].node = node;
+			stack[top].level = level;
+			stack[top].leftDone = 1;
+			top++;
+
+			// Nodes past the end of the array have no max of their own, the
+			// left child may still exist under them.
+			if (left >= index->count || index->maxEnd[left] > time) {
+				stack[top].node = left;
+				stack[top].level = level - 1;
+				stack[top].leftDone = 0;
+				top++;
+			}
+		} else if (node < index->count && index->start[node] <= time) {
+			if (index->end[node] > time && interval_index_add_result(results, maxResults, &resultCount, node) != 0)
+				return resultCount;
+
+			stack[top].node = node + (1 << (level - 1));
+			stack[top].level = level - 1;
+			stack[top].leftDone = 0;
+			top++;
+		}
+	}
+
+	return resultCount;
+}
@@ -0,0 +1,71 @@
+/*	
+ *	SPDX-License-Identifier: GPL-3.0-only
+ *
+ *  Virtual Orchestra - Musical Instrument Simulation
+ *  Copyright (C) 2024 Garnek0 (Popa Vlad) and Contributors
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <vo/key_state.h>
+
+// Only one thread may call this for a given key state.
+void key_state_set(struct key_state* state, int midiKey, bool pressed) {
+	if (midiKey < 0 || midiKey > 127)
+		return;
+
+	uint64_t word = atomic_load_explicit(&state->pressed[midiKey / 64], memory_order_relaxed);
+	uint64_t bit = (uint64_t)1 << (midiKey % 64);
+	uint64_t newWord = pressed ? (word | bit) : (word & ~bit);
+
+	if (newWord == word)
+		return;
+
+	unsigned int sequence = atomic_load_explicit(&state->sequence, memory_order_relaxed);
+
+	atomic_store_explicit(&state->sequence, sequence + 1, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+
+	atomic_store_explicit(&state->pressed[midiKey / 64], newWord, memory_order_relaxed);
+
+	atomic_store_explicit(&state->sequence, sequence + 2, memory_order_release);
+}
+
+// Changes every time the key state does. Cheap way to check whether
+// anything changed since the last key_state_read().
+unsigned int key_state_get_sequence(struct key_state* state) {
+	return atomic_load_explicit(&state->sequence, memory_order_acquire);
+}
+
+// Take a snapshot of the key state. Returns the sequence it was taken at.
+unsigned int key_state_read(struct key_state* state, struct key_state_snapshot* snapshot) {
+	unsigned int before, after = 0;
+
+	do {
+		before = atomic_load_explicit(&state->sequence, memory_order_acquire);
+
+		// A write is in progress, it won't take long.
+		if (before & 1)
+			continue;
+
+		snapshot->pressed[0] = atomic_load_explicit(&state->pressed[0], memory_order_relaxed);
+		snapshot->pressed[1] = atomic_load_explicit(&state->pressed[1], memory_order_relaxed);
+
+		atomic_thread_fence(memory_order_acquire);
+
+		after = atomic_load_explicit(&state->sequence, memory_order_relaxed);
+	} while ((before & 1) || before != after);
+
+	return before;
+}
@@ -75,10 +75,12 @@ void list_remove(struct list* deleteList, void* data) {
 				deleteList->tail = prev;
 
 			if (prev)
-				prev->next = NULL;
+				prev->next = node->next;
 
 			free((void*)node);
 
+			deleteList->nodeCount--;
+
 			break;
 		}
 
@@ -21,16 +21,25 @@
 #include <vo/ver.h>
 #include <vo/debug.h>
 #include <vo/gfxui/renderer.h>
+#include <vo/gfxui/profiler_hud.h>
+#include <vo/gfxui/audio_hud.h>
 #include <vo/event.h>
 #include <vo/note.h>
 #include <vo/audio.h>
 #include <vo/midi.h>
+#include <vo/midi_stream.h>
 #include <vo/playback.h>
+#include <vo/offline.h>
+#include <vo/frame.h>
+#include <vo/profiler.h>
+#include <vo/task.h>
 
 #include <vo/instruments/instrument.h>
 #include <vo/instruments/piano.h>
 
+#include <stdbool.h>
 #include <stdio.h>
+#include <string.h>
 #include <SDL2/SDL.h>
 
 void test_chord_callback() {
@@ -39,19 +48,19 @@ void test_chord_callback() {
 	list_foreach(node, instrumentList) {
 		struct instrument* instr = (struct instrument*)node->data;
 
-		struct complex_note note;
-		note.sfz = note.accent = note.staccato = note.marcato = false;
+		struct complex_note note = {0};
 		note.octave = 4;
+		note.scheduledTime = NOTE_TIME_NOW;
 
 		note.key = NOTE_C;
 		note.midiKey = NOTE_TO_MIDI_KEY(note.key, note.octave);
-		instr->play_note(instr, note);
+		playback_play_note(instr, note);
 		note.key = NOTE_E;
 		note.midiKey = NOTE_TO_MIDI_KEY(note.key, note.octave);
-		instr->play_note(instr, note);
+		playback_play_note(instr, note);
 		note.key = NOTE_G;
 		note.midiKey = NOTE_TO_MIDI_KEY(note.key, note.octave);
-		instr->play_note(instr, note);
+		playback_play_note(instr, note);
 	}
 }
 
@@ -61,52 +70,174 @@ void test_chord_release_callback() {
 	list_foreach(node, instrumentList) {
 		struct instrument* instr = (struct instrument*)node->data;
 
-		struct complex_note note;
-		note.sfz = note.accent = note.staccato = note.marcato = false;
+		struct complex_note note = {0};
 		note.octave = 4;
+		note.scheduledTime = NOTE_TIME_NOW;
 
 		note.key = NOTE_C;
 		note.midiKey = NOTE_TO_MIDI_KEY(note.key, note.octave);
-		instr->release_note(instr, note);
+		playback_release_note(instr, note);
 		note.key = NOTE_E;
 		note.midiKey = NOTE_TO_MIDI_KEY(note.key, note.octave);
-		instr->release_note(instr, note);
+		playback_release_note(instr, note);
 		note.key = NOTE_G;
 		note.midiKey = NOTE_TO_MIDI_KEY(note.key, note.octave);
-		instr->release_note(instr, note);
+		playback_release_note(instr, note);
 
 	}
 }
 
+// Put the instruments on the stage and start loading their notes on a
+// worker thread (parseTask). Shared by the interactive and offline modes so
+// both sound the same. When streaming, the notes are read while playing
+// instead and parseTask is left NULL.
+int setup_stage(const char* midiPath, struct midi_stream** stream, struct task** parseTask) {
+	struct instrument_new_args args;
+	args.x = args.y = 0;
+	args.init = piano_init_88;
+	args.fini = piano_fini;
+	args.play_note = piano_play_note;
+	args.release_note = piano_release_note;
+	args.update_visuals = piano_update_visuals;
+	args.soundfontPath = "res/soundfont/msbasic.sf3";
+	args.bank = 0;
+	args.preset = 0;
+	// One voice per key of the 88-key piano, twice over so that a
+	// restruck key can ring on while the new note starts.
+	args.polyphony = 88*2;
+
+	// The instruments' init functions wait for their images, so they are
+	// only called once the notes have started loading.
+	struct instrument* piano = instrument_new_deferred(args);
+	if (!piano)
+		return -1;
+
+	// Every instrument on the stage gets its notes from the same pass over
+	// the MIDI file.
+	struct midi_route routes[] = {
+		{.track = 1, .channel = MIDI_ROUTE_ANY, .instr = piano}
+	};
+
+	int routeCount = sizeof(routes)/sizeof(routes[0]);
+
+	if (stream) {
+		*stream = midi_stream_open(midiPath, routes, routeCount);
+		if (!*stream)
+			return -1;
+
+		playback_set_stream(*stream);
+	} else {
+		*parseTask = midi_parse_file_async(midiPath, routes, routeCount);
+		if (!*parseTask)
+			return -1;
+	}
+
+	if (instrument_finish_new(piano) != 0) {
+		// Nothing may be loading notes into the piano once it's gone.
+		if (stream) {
+			playback_set_stream(NULL);
+			midi_stream_close(*stream);
+			*stream = NULL;
+		} else {
+			task_wait(*parseTask);
+			*parseTask = NULL;
+		}
+
+		instrument_destroy(piano);
+		return -1;
+	}
+
+	return 0;
+}
+
+// Whether everything finish_startup() waits for is done loading.
+bool startup_is_loaded(struct task* parseTask) {
+	return (!parseTask || task_is_done(parseTask)) && !instrument_is_loading();
+}
+
+// Wait for the notes and the instruments' sounds, then get playback ready.
+int finish_startup(struct task* parseTask) {
+	int parseResult = parseTask ? task_wait(parseTask) : 0;
+
+	instrument_wait_loaded();
+
+	if (parseResult != 0) {
+		debug_log(LOGLEVEL_FATAL, "Main: Failed to load the MIDI file!\n");
+		return -1;
+	}
+
+	if (playback_init() != 0) {
+		debug_log(LOGLEVEL_FATAL, "Main: Playback system init failed!\n");
+		return -1;
+	}
+
+	if (parseTask)
+		playback_reset();
+
+	return 0;
+}
+
+static double elapsed_ms(Uint64 since) {
+	return (double)(SDL_GetPerformanceCounter() - since) * 1000 / SDL_GetPerformanceFrequency();
+}
+
 int main(int argc, char** argv) {
+	Uint64 startupStart = SDL_GetPerformanceCounter();
+
 	printf("Virtual Orchestra v%d.%d.%d-%s by Garnek0 (Popa Vlad)\n", VO_VER_MAJOR, VO_VER_MINOR, VO_VER_PATCH, VO_VER_STAGE);
 
-	const char* midiPath;
+	const char* midiPath = NULL;
+	const char* renderPath = NULL;
+	bool streaming = false;
+	bool validArgs = true;
 
-	if (argc == 2) {
-		midiPath = argv[1];
-	} else {
-		debug_log(LOGLEVEL_FATAL, "Main: Invalid number of arguments!\nUsage: %s pathToMIDIFile\n", argv[0]);
+	for (int i = 1; i < argc && validArgs; i++) {
+		if (strcmp(argv[i], "-l") == 0 || strcmp(argv[i], "--latency") == 0) {
+			validArgs = ++i < argc && audio_set_latency_profile(argv[i]) == 0;
+		} else if (strcmp(argv[i], "-o") == 0 || strcmp(argv[i], "--render") == 0) {
+			validArgs = ++i < argc;
+			renderPath = validArgs ? argv[i] : NULL;
+		} else if (strcmp(argv[i], "--stream") == 0) {
+			streaming = true;
+		} else if (!midiPath) {
+			midiPath = argv[i];
+		} else {
+			validArgs = false;
+		}
+	}
+
+	// Offline rendering runs faster than the stream can be guaranteed to
+	// keep up with.
+	if (streaming && renderPath)
+		validArgs = false;
+
+	if (!validArgs || !midiPath) {
+		debug_log(LOGLEVEL_FATAL, "Main: Invalid arguments!\nUsage: %s [--latency low|medium|high|safe] [--render output.wav | --stream] pathToMIDIFile\n", argv[0]);
 		return 1;
 	}
 
- 
-	if (SDL_Init(SDL_INIT_EVERYTHING) != 0) {
+	// Offline rendering needs no window, no audio device and no waiting.
+	bool headless = renderPath != NULL;
+
+	if (SDL_Init(headless ? SDL_INIT_TIMER : SDL_INIT_EVERYTHING) != 0) {
 		debug_log(LOGLEVEL_FATAL, "Main: SDL init failed: %s\n", SDL_GetError());
 		return 1;
 	}
 
+	profiler_init();
+	profiler_register_thread("main");
+
 	if (event_init() != 0) {
 		debug_log(LOGLEVEL_FATAL, "Main: Events init failed!\n");
 		return 1;
 	}
 
-	if (renderer_init() != 0) {
+	if ((headless ? renderer_init_headless() : renderer_init()) != 0) {
 		debug_log(LOGLEVEL_FATAL, "Main: Renderer init failed!\n");
 		return 1;
 	}
 
-	if (audio_init() != 0) {
+	if ((headless ? audio_init_offline() : audio_init()) != 0) {
 		debug_log(LOGLEVEL_FATAL, "Main: Audio Engine init failed!\n");
 		return 1;
 	}
@@ -116,48 +247,102 @@ int main(int argc, char** argv) {
 		return 1;
 	}
 
-	if (playback_init() != 0) {
-		debug_log(LOGLEVEL_FATAL, "Main: Playback system init failed!\n");
+	// Startup runs in parallel from here: the key images are decoded, the
+	// soundfont is loaded and the MIDI file is parsed on worker threads.
+	// Only uploading the images to the GPU happens on this thread.
+	if (!headless)
+		piano_prefetch_textures();
+
+	struct midi_stream* stream = NULL;
+	struct task* parseTask = NULL;
+
+	if (setup_stage(midiPath, streaming ? &stream : NULL, &parseTask) != 0) {
+		debug_log(LOGLEVEL_FATAL, "Main: Failed to set up the stage!\n");
 		return 1;
 	}
 
-	struct instrument_new_args args;
-	args.x = args.y = 0;
-	args.init = piano_init;
-	args.fini = piano_fini;
-	args.play_note = piano_play_note;
-	args.release_note = piano_release_note;
-	args.soundfontPath = "res/soundfont/msbasic.sf3";
-	args.bank = 0;
-	args.preset = 0;
-	args.polyphony = 61;
+	if (headless) {
+		if (finish_startup(parseTask) != 0)
+			return 1;
+
+		int result = offline_render(renderPath);
+
+		SDL_Quit();
 
-	struct instrument* piano = instrument_new(args);
-	midi_load_file(piano, midiPath, 1);
+		return result == 0 ? 0 : 1;
+	}
+
+	if (profiler_hud_init() != 0) {
+		debug_log(LOGLEVEL_FATAL, "Main: Profiler HUD init failed!\n");
+		return 1;
+	}
+
+	if (audio_hud_init() != 0) {
+		debug_log(LOGLEVEL_FATAL, "Main: Audio HUD init failed!\n");
+		return 1;
+	}
 
-	(void)piano;
+	if (frame_init(60) != 0) {
+		debug_log(LOGLEVEL_FATAL, "Main: Frame scheduler init failed!\n");
+		return 1;
+	}
 
-	event_register_keyboard_callback(SDLK_c, KMOD_NONE, test_chord_callback);
-	event_register_keyboard_callback(SDLK_r, KMOD_NONE, test_chord_release_callback);
+	// Show the stage as soon as it's there, the rest keeps loading.
+	renderer_iteration();
+	debug_log(LOGLEVEL_INFO, "Main: First frame after %.1f ms.\n", elapsed_ms(startupStart));
 
-	unsigned int time1, time2;
-	double deltatime;
-	time2 = SDL_GetTicks();
+	bool loading = true;
 
 	while(!event_has_signaled_quit()) {
-		time1 = SDL_GetTicks();
-		deltatime = time1 - time2;
+		// Sleep until the next frame (~60/second) or until there is input
+		// to handle. Input is handled right away, drawing waits for the
+		// frame. Notes are dispatched by the playback thread meanwhile.
+		bool frameDue = frame_wait();
+
+		Uint64 start = PROFILER_BEGIN();
+		event_iteration();
+		PROFILER_END("event_iteration", start);
 
-		// Cap simulation at ~60 iterations/second
-		if (deltatime > 1000/60.0) {
-			time2 = time1;
+		// Playback controls only exist once everything they need is loaded.
+		if (loading && startup_is_loaded(parseTask)) {
+			loading = false;
 
+			if (finish_startup(parseTask) != 0)
+				return 1;
+
+			parseTask = NULL;
+
+			event_register_keyboard_callback(SDLK_c, KMOD_NONE, test_chord_callback);
+			event_register_keyboard_callback(SDLK_r, KMOD_NONE, test_chord_release_callback);
+
+			if (playback_start_thread() != 0) {
+				debug_log(LOGLEVEL_FATAL, "Main: Failed to start playback!\n");
+				return 1;
+			}
+
+			debug_log(LOGLEVEL_INFO, "Main: Ready to play after %.1f ms.\n", elapsed_ms(startupStart));
+		}
+
+		if (frameDue && frame_should_draw()) {
+			profiler_mark_frame();
+
+			start = PROFILER_BEGIN();
 			renderer_iteration();
-			playback_iteration();
-			event_iteration();
+			PROFILER_END("renderer_iteration", start);
 		}
 	}
 
+	// Quitting before startup finished, let the workers finish first.
+	if (loading) {
+		if (parseTask)
+			task_wait(parseTask);
+
+		instrument_wait_loaded();
+	}
+
+	playback_stop_thread();
+	midi_stream_close(stream);
+	audio_fini();
 	SDL_Quit();
 
 	return 0;
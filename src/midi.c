@@ -19,61 +19,341 @@
  */
 
 #include <vo/midi.h>
+#include <vo/note_cache.h>
+#include <vo/task.h>
 #include <vo/debug.h>
 #include <vo/note.h>
 #include <vo/playback.h>
 #include <smf.h>
+#include <stdbool.h>
+#include <stdlib.h>
 #include <string.h>
 
-int midi_load_file(struct instrument* instr, const char* path, int track) {
+void midi_tempo_map_init(struct midi_tempo_map* map, int division) {
+	map->division = division;
+	map->tempoTick = 0;
+	map->scaledTime = 0;
+	map->tempo = MIDI_DEFAULT_TEMPO;
+}
+
+// Switch to a new tempo from tick on. Ticks must not go backwards.
+void midi_tempo_map_set_tempo(struct midi_tempo_map* map, uint64_t tick, int64_t tempo) {
+	map->scaledTime += (int64_t)(tick - map->tempoTick) * map->tempo;
+	map->tempoTick = tick;
+	map->tempo = tempo;
+}
+
+// Playback time of a tick at or after the last tempo change.
+int64_t midi_tempo_map_get_time(struct midi_tempo_map* map, uint64_t tick) {
+	return (map->scaledTime + (int64_t)(tick - map->tempoTick) * map->tempo) / map->division;
+}
+
+// Follows the tempo changes of a loaded file as its events are read.
+struct midi_smf_clock {
+	smf_t* midiFile;
+	struct midi_tempo_map map;
+	int nextTempo; // First tempo change that isn't applied yet
+};
+
+static void midi_smf_clock_init(struct midi_smf_clock* clock, smf_t* midiFile) {
+	clock->midiFile = midiFile;
+	clock->nextTempo = 0;
+	midi_tempo_map_init(&clock->map, midiFile->ppqn);
+}
+
+// Playback time of a tick. Ticks must not go backwards.
+static int64_t midi_smf_clock_get_time(struct midi_smf_clock* clock, size_t tick) {
+	smf_tempo_t* tempo;
+
+	while ((tempo = smf_get_tempo_by_number(clock->midiFile, clock->nextTempo)) && tempo->time_pulses <= tick) {
+		midi_tempo_map_set_tempo(&clock->map, tempo->time_pulses, tempo->microseconds_per_quarter_note);
+		clock->nextTempo++;
+	}
+
+	return midi_tempo_map_get_time(&clock->map, tick);
+}
+
+// Notes that have started playing but haven't been stopped yet. There is
+// one stack for each (channel, key) pair, so every noteOff can be matched
+// with its noteOn the moment it is read instead of scanning ahead in the file.
+struct midi_open_note_stack {
+	int* notes;
+	int count;
+	int capacity;
+};
+
+static int midi_open_note_push(struct midi_open_note_stack* stack, int note) {
+	if (stack->count == stack->capacity) {
+		int newCapacity = stack->capacity ? stack->capacity * 2 : 4;
+		int* newNotes = realloc((void*)stack->notes, sizeof(int)*newCapacity);
+
+		if (!newNotes)
+			return -1;
+
+		stack->notes = newNotes;
+		stack->capacity = newCapacity;
+	}
+
+	stack->notes[stack->count++] = note;
+
+	return 0;
+}
+
+// Returns the note store index of the most recently started note, or -1.
+static int midi_open_note_pop(struct midi_open_note_stack* stack) {
+	if (stack->count == 0)
+		return -1;
+
+	return stack->notes[--stack->count];
+}
+
+// Empty an instrument's note store, unless a previous route already did
+// so during this load.
+static void midi_reset_instrument_notes(const struct midi_route* routes, int routeIndex) {
+	struct instrument* instr = routes[routeIndex].instr;
+
+	for (int i = 0; i < routeIndex; i++)
+		if (routes[i].instr == instr)
+			return;
+
+	note_store_clear(instr->noteList);
+}
+
+// Resolve the routes into a (track, channel) -> instrument table, indexed by
+// track*MIDI_CHANNEL_COUNT + channel, so that each event only costs a
+// single lookup. Track numbers start at 1, so track 0 of the table goes
+// unused. Returns NULL if out of memory, free() the table when done.
+struct instrument** midi_resolve_routes(const char* path, const struct midi_route* routes, int routeCount, int trackCount) {
+	int trackSlots = trackCount + 1;
+
+	struct instrument** routeTable = calloc(trackSlots*MIDI_CHANNEL_COUNT, sizeof(struct instrument*));
+
+	if (!routeTable)
+		return NULL;
+
+	for (int i = 0; i < routeCount; i++) {
+		if (!routes[i].instr)
+			continue;
+
+		if (routes[i].track != MIDI_ROUTE_ANY && (routes[i].track < 1 || routes[i].track >= trackSlots))
+			debug_log(LOGLEVEL_WARN, "MIDI: File \"%s\" has no track %d, instrument with ID %d will be silent.\n", path, routes[i].track, routes[i].instr->id);
+
+		for (int track = 1; track < trackSlots; track++) {
+			if (routes[i].track != MIDI_ROUTE_ANY && routes[i].track != track)
+				continue;
+
+			for (int channel = 0; channel < MIDI_CHANNEL_COUNT; channel++) {
+				if (routes[i].channel != MIDI_ROUTE_ANY && routes[i].channel != channel)
+					continue;
+
+				if (!routeTable[track*MIDI_CHANNEL_COUNT + channel])
+					routeTable[track*MIDI_CHANNEL_COUNT + channel] = routes[i].instr;
+			}
+		}
+	}
+
+	return routeTable;
+}
+
+// Fill the routed instruments' note stores from a MIDI file. Nothing else
+// is touched, so this can run on any thread as long as those instruments
+// aren't being played meanwhile.
+int midi_parse_file_routed(const char* path, const struct midi_route* routes, int routeCount) {
+	Uint64 loadStart = SDL_GetPerformanceCounter();
+
+	// Skip parsing if this file was loaded with the same routes before.
+	struct note_cache_key cacheKey;
+	bool haveCacheKey = note_cache_make_key(path, routes, routeCount, &cacheKey) == 0;
+
+	if (haveCacheKey && note_cache_load(path, &cacheKey, routes, routeCount) == 0) {
+		double loadSeconds = (double)(SDL_GetPerformanceCounter() - loadStart) / SDL_GetPerformanceFrequency();
+		debug_log(LOGLEVEL_INFO, "MIDI: Loaded \"%s\" from the note cache in %.1f ms.\n", path, loadSeconds*1000);
+
+		return 0;
+	}
+
 	smf_t* midiFile = smf_load(path);
 
 	if (!midiFile) {
-		debug_log(LOGLEVEL_ERROR, "Failed to load MIDI file \"%s\" for instrument with ID %d!\n", path, instr->id);
+		debug_log(LOGLEVEL_ERROR, "MIDI: Failed to load MIDI file \"%s\"!\n", path);
 		return -1;
 	}
 
-	list_destroy(instr->noteList);
+	// Track numbers start at 1, so index 0 of the tables below goes unused.
 
-	instr->noteList = list_create();
+	int trackSlots = midiFile->number_of_tracks + 1;
 
-	// Load the notes from the MIDI file.	
-	
-	smf_event_t* event, * notePairEvent;
+	struct instrument** routeTable = midi_resolve_routes(path, routes, routeCount, midiFile->number_of_tracks);
+	struct midi_open_note_stack* openNotes = calloc(trackSlots*MIDI_CHANNEL_COUNT*MIDI_KEY_COUNT, sizeof(struct midi_open_note_stack));
+
+	if (!routeTable || !openNotes) {
+		debug_log(LOGLEVEL_ERROR, "MIDI: Failed to allocate note routing tables!\n");
+		free((void*)routeTable);
+		free((void*)openNotes);
+		smf_delete(midiFile);
+		return -1;
+	}
+
+	for (int i = 0; i < routeCount; i++)
+		if (routes[i].instr)
+			midi_reset_instrument_notes(routes, i);
+
+	// Load the notes from the MIDI file in a single pass. A noteOn with a
+	// velocity of 0 is treated as a noteOff, as most MIDI files use running
+	// status for this. Times come from the ticks rather than libsmf's
+	// seconds, which are floating point.
+
+	struct midi_smf_clock clock;
+	midi_smf_clock_init(&clock, midiFile);
+
+	int noteCount = 0;
+	smf_event_t* event;
 	while ((event = smf_get_next_event(midiFile)) != NULL) {
-		if (smf_event_is_metadata(event) || event->track_number != track)
-			continue;	
-
-		if ((event->midi_buffer[0] >> 4) == 0x9) {
-			struct complex_note* note = malloc(sizeof(struct complex_note));
-			memset((void*)note, 0, sizeof(struct complex_note));
-
-			note->startTime = note->endTime = (int)(event->time_seconds*1000);
-			note->midiKey = (int)event->midi_buffer[1];
-			note->key = NOTE_MIDI_TO_KEY(note->midiKey);
-			note->octave = NOTE_MIDI_TO_OCTAVE(note->midiKey);
-
-			// Find the noteOff event that corresponds to this noteOn event
-			
-			while ((notePairEvent = smf_get_next_event(midiFile)) != NULL) {
-				if (smf_event_is_metadata(notePairEvent) || notePairEvent->track->track_number != track)
-					continue;
+		if (smf_event_is_metadata(event) || event->midi_buffer_length < 3)
+			continue;
+
+		int status = event->midi_buffer[0] >> 4;
+		int channel = event->midi_buffer[0] & 0xF;
+		int midiKey = event->midi_buffer[1] & 0x7F;
+		int routeIndex = event->track_number*MIDI_CHANNEL_COUNT + channel;
+		struct instrument* instr = routeTable[routeIndex];
+
+		if (!instr)
+			continue;
 
-				if (((notePairEvent->midi_buffer[0] >> 4) == 0x8) && (notePairEvent->midi_buffer[1] == event->midi_buffer[1])) {
-					note->endTime = (int)(notePairEvent->time_seconds*1000);
-					break;
-				}
+		struct midi_open_note_stack* stack = &openNotes[routeIndex*MIDI_KEY_COUNT + midiKey];
+
+		int64_t eventTime = midi_smf_clock_get_time(&clock, event->time_pulses);
+
+		if (status == 0x9 && event->midi_buffer[2] != 0) {
+			int note = note_store_append(instr->noteList, eventTime, eventTime, midiKey, 0);
+
+			if (note < 0)
+				continue;
+
+			// A note that can't be paired with its noteOff would never
+			// end, take it back out. It was the last one appended.
+			if (midi_open_note_push(stack, note) != 0) {
+				debug_log(LOGLEVEL_WARN, "MIDI: Out of memory while pairing notes, note will be dropped.\n");
+				instr->noteList->count--;
+				continue;
 			}
 
-			list_insert(instr->noteList, (void*)note);
+			noteCount++;
+		} else if (status == 0x8 || status == 0x9) {
+			int note = midi_open_note_pop(stack);
 
-			(void)smf_seek_to_event(midiFile, event);
-			smf_skip_next_event(midiFile);
+			if (note >= 0)
+				instr->noteList->endTime[note] = eventTime;
 		}
 	}
 
-	playback_reset();
+	// Any notes left without a noteOff end with their track.
+
+	for (int track = 1; track < trackSlots; track++) {
+		smf_event_t* lastEvent = smf_track_get_last_event(smf_get_track_by_number(midiFile, track));
+
+		midi_smf_clock_init(&clock, midiFile);
+		int64_t trackEndTime = lastEvent ? midi_smf_clock_get_time(&clock, lastEvent->time_pulses) : 0;
+
+		for (int channel = 0; channel < MIDI_CHANNEL_COUNT; channel++) {
+			struct instrument* instr = routeTable[track*MIDI_CHANNEL_COUNT + channel];
+
+			for (int key = 0; key < MIDI_KEY_COUNT; key++) {
+				struct midi_open_note_stack* stack = &openNotes[(track*MIDI_CHANNEL_COUNT + channel)*MIDI_KEY_COUNT + key];
+				int note;
+
+				while ((note = midi_open_note_pop(stack)) >= 0)
+					if (trackEndTime > instr->noteList->startTime[note])
+						instr->noteList->endTime[note] = trackEndTime;
+
+				free((void*)stack->notes);
+			}
+		}
+	}
+
+	// Notes are appended in file order, which is already sorted by start
+	// time, so this is normally a no-op.
+	for (int i = 0; i < routeCount; i++)
+		if (routes[i].instr)
+			note_store_sort(routes[i].instr->noteList);
+
+	free((void*)openNotes);
+	free((void*)routeTable);
+
 	smf_delete(midiFile);
 
+	double loadSeconds = (double)(SDL_GetPerformanceCounter() - loadStart) / SDL_GetPerformanceFrequency();
+	debug_log(LOGLEVEL_INFO, "MIDI: Loaded %d notes from \"%s\" in %.1f ms (%.0f notes/s).\n", noteCount, path, loadSeconds*1000, loadSeconds > 0 ? noteCount / loadSeconds : 0.0);
+
+	if (haveCacheKey)
+		note_cache_save(path, &cacheKey, routes, routeCount);
+
 	return 0;
 }
+
+int midi_load_file_routed(const char* path, const struct midi_route* routes, int routeCount) {
+	if (midi_parse_file_routed(path, routes, routeCount) != 0)
+		return -1;
+
+	playback_reset();
+
+	return 0;
+}
+
+// Copy of the arguments of a background parse.
+struct midi_parse_job {
+	char* path;
+	struct midi_route* routes;
+	int routeCount;
+};
+
+static int midi_parse_task(void* data) {
+	struct midi_parse_job* job = (struct midi_parse_job*)data;
+
+	int result = midi_parse_file_routed(job->path, job->routes, job->routeCount);
+
+	free((void*)job->path);
+	free((void*)job->routes);
+	free((void*)job);
+
+	return result;
+}
+
+// Parse a MIDI file on a worker thread. Once task_wait() returns 0 the
+// notes are in place and playback_reset() has to be called before playing
+// them. Returns NULL if the parse couldn't be started.
+struct task* midi_parse_file_async(const char* path, const struct midi_route* routes, int routeCount) {
+	struct midi_parse_job* job = malloc(sizeof(struct midi_parse_job));
+	if (!job)
+		return NULL;
+
+	job->path = strdup(path);
+	job->routes = malloc(sizeof(struct midi_route)*(routeCount ? routeCount : 1));
+	job->routeCount = routeCount;
+
+	if (!job->path || !job->routes) {
+		free((void*)job->path);
+		free((void*)job->routes);
+		free((void*)job);
+		return NULL;
+	}
+
+	memcpy((void*)job->routes, (void*)routes, sizeof(struct midi_route)*routeCount);
+
+	struct task* parseTask = task_start("vo-midi", midi_parse_task, (void*)job);
+
+	if (!parseTask) {
+		free((void*)job->path);
+		free((void*)job->routes);
+		free((void*)job);
+	}
+
+	return parseTask;
+}
+
+int midi_load_file(struct instrument* instr, const char* path, int track) {
+	struct midi_route route = {.track = track, .channel = MIDI_ROUTE_ANY, .instr = instr};
+
+	return midi_load_file_routed(path, &route, 1);
+}
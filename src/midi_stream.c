@@ -0,0 +1,571 @@
+/*	
+ *	SPDX-License-Identifier: GPL-3.0-only
+ *
+ *  Virtual Orchestra - Musical Instrument Simulation
+ *  Copyright (C) 2024 Garnek0 (Popa Vlad) and Contributors
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <vo/midi_stream.h>
+#include <vo/timeline.h>
+#include <vo/debug.h>
+#include <vo/profiler.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+// How far ahead of the playback time the decoder reads.
+#define MIDI_STREAM_LOOKAHEAD_MS 3000
+
+// Most events that can be waiting to be played. Limits memory use when the
+// music is so dense that even the lookahead doesn't fit.
+#define MIDI_STREAM_QUEUE_SIZE 65536
+
+// How long the decoder sleeps when it is far enough ahead, unless it is
+// woken up earlier.
+#define MIDI_STREAM_IDLE_WAIT_MS 10
+
+static int midi_stream_read_byte(struct midi_stream* stream, struct midi_stream_track* track) {
+	if (track->position >= track->end)
+		return -1;
+
+	if (track->position < track->bufferStart || track->position >= track->bufferStart + track->bufferLength) {
+		long length = track->end - track->position;
+
+		if (length > MIDI_STREAM_READ_BUFFER_SIZE)
+			length = MIDI_STREAM_READ_BUFFER_SIZE;
+
+		if (fseek(stream->file, track->position, SEEK_SET) != 0)
+			return -1;
+
+		track->bufferStart = track->position;
+		track->bufferLength = (int)fread(track->buffer, 1, length, stream->file);
+
+		if (track->bufferLength <= 0)
+			return -1;
+	}
+
+	return track->buffer[track->position++ - track->bufferStart];
+}
+
+// Variable-length quantity, or -1 if it is cut off or too long.
+static long midi_stream_read_varlen(struct midi_stream* stream, struct midi_stream_track* track) {
+	long value = 0;
+
+	for (int i = 0; i < 4; i++) {
+		int byte = midi_stream_read_byte(stream, track);
+
+		if (byte < 0)
+			return -1;
+
+		value = (value << 7) | (byte & 0x7F);
+
+		if (!(byte & 0x80))
+			return value;
+	}
+
+	return -1;
+}
+
+static void midi_stream_skip(struct midi_stream_track* track, long length) {
+	track->position = (length > track->end - track->position) ? track->end : track->position + length;
+}
+
+// Read the delta time in front of the next event. Ends the track if there
+// is none.
+static void midi_stream_read_delta(struct midi_stream* stream, struct midi_stream_track* track) {
+	long delta = midi_stream_read_varlen(stream, track);
+
+	if (delta < 0)
+		track->ended = true;
+	else
+		track->tick += delta;
+}
+
+static int64_t midi_stream_tick_to_time(struct midi_stream* stream, uint64_t tick) {
+	// SMPTE time: frames per second (negative) and ticks per frame instead
+	// of ticks per quarter note. Tempo changes don't apply.
+	if (stream->division & 0x8000) {
+		int framesPerSecond = -(int8_t)(stream->division >> 8);
+		int ticksPerFrame = stream->division & 0xFF;
+
+		return (int64_t)tick * 1000000 / (framesPerSecond * ticksPerFrame);
+	}
+
+	return midi_tempo_map_get_time(&stream->tempoMap, tick);
+}
+
+static bool midi_stream_track_before(struct midi_stream* stream, int a, int b) {
+	if (stream->tracks[a].tick != stream->tracks[b].tick)
+		return stream->tracks[a].tick < stream->tracks[b].tick;
+
+	return a < b;
+}
+
+static void midi_stream_heap_sift_down(struct midi_stream* stream, int i) {
+	int* heap = stream->trackHeap;
+
+	while (true) {
+		int smallest = i;
+		int left = i*2 + 1;
+		int right = i*2 + 2;
+
+		if (left < stream->trackHeapSize && midi_stream_track_before(stream, heap[left], heap[smallest]))
+			smallest = left;
+		if (right < stream->trackHeapSize && midi_stream_track_before(stream, heap[right], heap[smallest]))
+			smallest = right;
+
+		if (smallest == i)
+			return;
+
+		int swap = heap[i];
+		heap[i] = heap[smallest];
+		heap[smallest] = swap;
+
+		i = smallest;
+	}
+}
+
+// Go back to the start of the file.
+static void midi_stream_reset(struct midi_stream* stream) {
+	stream->trackHeapSize = 0;
+
+	for (int i = 0; i < stream->trackCount; i++) {
+		struct midi_stream_track* track = &stream->tracks[i];
+
+		track->position = track->start;
+		track->bufferLength = 0;
+		track->tick = 0;
+		track->runningStatus = 0;
+		track->ended = false;
+
+		midi_stream_read_delta(stream, track);
+
+		if (!track->ended)
+			stream->trackHeap[stream->trackHeapSize++] = i;
+	}
+
+	for (int i = stream->trackHeapSize/2 - 1; i >= 0; i--)
+		midi_stream_heap_sift_down(stream, i);
+
+	midi_tempo_map_init(&stream->tempoMap, stream->division);
+
+	memset((void*)stream->openNotes, 0, sizeof(uint16_t)*stream->trackCount*MIDI_CHANNEL_COUNT*MIDI_KEY_COUNT);
+}
+
+// Queue an event once it falls within the lookahead window. Returns false
+// if the stream was rewound or closed in the meantime.
+static bool midi_stream_emit(struct midi_stream* stream, unsigned int generation, struct instrument* instr, uint8_t type, int midiKey, int64_t time) {
+	struct midi_stream_event event = {
+		.time = time,
+		.generation = generation,
+		.instr = instr,
+		.type = type,
+		.midiKey = (uint8_t)midiKey
+	};
+
+	while (true) {
+		if (atomic_load(&stream->quit) || atomic_load(&stream->generation) != generation)
+			return false;
+
+		if (time <= atomic_load(&stream->playbackTime) + NOTE_TIME_FROM_MS(MIDI_STREAM_LOOKAHEAD_MS) && ringbuffer_push(stream->events, &event))
+			return true;
+
+		PROFILER_END("midi_stream_decode", stream->decodeStart);
+		SDL_SemWaitTimeout(stream->wakeSemaphore, MIDI_STREAM_IDLE_WAIT_MS);
+		stream->decodeStart = PROFILER_BEGIN();
+	}
+}
+
+static bool midi_stream_note(struct midi_stream* stream, int trackIndex, unsigned int generation, int status, int midiKey, int velocity) {
+	int channel = status & 0xF;
+
+	// Track numbers start at 1 in the route table.
+	struct instrument* instr = stream->routeTable[(trackIndex + 1)*MIDI_CHANNEL_COUNT + channel];
+
+	if (!instr)
+		return true;
+
+	uint16_t* openCount = &stream->openNotes[(trackIndex*MIDI_CHANNEL_COUNT + channel)*MIDI_KEY_COUNT + midiKey];
+	int64_t time = midi_stream_tick_to_time(stream, stream->tracks[trackIndex].tick);
+
+	// A noteOn with a velocity of 0 is a noteOff.
+	if ((status >> 4) == 0x9 && velocity != 0) {
+		if (*openCount < UINT16_MAX)
+			(*openCount)++;
+
+		return midi_stream_emit(stream, generation, instr, TIMELINE_EVENT_NOTE_ON, midiKey, time);
+	}
+
+	if (*openCount == 0)
+		return true;
+
+	(*openCount)--;
+
+	return midi_stream_emit(stream, generation, instr, TIMELINE_EVENT_NOTE_OFF, midiKey, time);
+}
+
+// Notes left without a noteOff end with their track.
+static bool midi_stream_end_track(struct midi_stream* stream, int trackIndex, unsigned int generation) {
+	struct midi_stream_track* track = &stream->tracks[trackIndex];
+
+	track->ended = true;
+
+	for (int channel = 0; channel < MIDI_CHANNEL_COUNT; channel++) {
+		for (int key = 0; key < MIDI_KEY_COUNT; key++) {
+			uint16_t* openCount = &stream->openNotes[(trackIndex*MIDI_CHANNEL_COUNT + channel)*MIDI_KEY_COUNT + key];
+
+			if (*openCount == 0)
+				continue;
+
+			*openCount = 1;
+
+			if (!midi_stream_note(stream, trackIndex, generation, 0x80 | channel, key, 0))
+				return false;
+		}
+	}
+
+	return true;
+}
+
+// Read and handle the next event of a track. Returns false if the stream
+// was rewound or closed in the meantime.
+static bool midi_stream_read_event(struct midi_stream* stream, int trackIndex, unsigned int generation) {
+	struct midi_stream_track* track = &stream->tracks[trackIndex];
+
+	int status = midi_stream_read_byte(stream, track);
+	int data1 = -1;
+
+	if (status < 0)
+		return midi_stream_end_track(stream, trackIndex, generation);
+
+	// Running status: the status byte was left out and this is already
+	// the first data byte.
+	if (status < 0x80) {
+		if (!track->runningStatus)
+			return midi_stream_end_track(stream, trackIndex, generation);
+
+		data1 = status;
+		status = track->runningStatus;
+	} else if (status < 0xF0) {
+		track->runningStatus = (uint8_t)status;
+	}
+
+	if (status < 0xF0) {
+		if (data1 < 0)
+			data1 = midi_stream_read_byte(stream, track);
+
+		int data2 = 0;
+
+		// Program change and channel pressure only have one data byte.
+		if ((status >> 4) != 0xC && (status >> 4) != 0xD)
+			data2 = midi_stream_read_byte(stream, track);
+
+		if (data1 < 0 || data2 < 0)
+			return midi_stream_end_track(stream, trackIndex, generation);
+
+		if ((status >> 4) == 0x8 || (status >> 4) == 0x9)
+			return midi_stream_note(stream, trackIndex, generation, status, data1 & 0x7F, data2);
+
+		return true;
+	}
+
+	if (status == 0xF0 || status == 0xF7) {
+		// SysEx, not needed
+		track->runningStatus = 0;
+
+		long length = midi_stream_read_varlen(stream, track);
+		if (length < 0)
+			return midi_stream_end_track(stream, trackIndex, generation);
+
+		midi_stream_skip(track, length);
+		return true;
+	}
+
+	if (status == 0xFF) {
+		int type = midi_stream_read_byte(stream, track);
+		long length = midi_stream_read_varlen(stream, track);
+
+		if (type < 0 || length < 0 || type == 0x2F)
+			return midi_stream_end_track(stream, trackIndex, generation);
+
+		if (type == 0x51 && length == 3 && !(stream->division & 0x8000)) {
+			int tempo = 0;
+
+			for (int i = 0; i < 3; i++) {
+				int byte = midi_stream_read_byte(stream, track);
+				if (byte < 0)
+					return midi_stream_end_track(stream, trackIndex, generation);
+
+				tempo = (tempo << 8) | byte;
+			}
+
+			// Times before this point keep the old tempo.
+			midi_tempo_map_set_tempo(&stream->tempoMap, track->tick, tempo);
+		} else {
+			midi_stream_skip(track, length);
+		}
+
+		return true;
+	}
+
+	// Anything else doesn't belong in a file.
+	return midi_stream_end_track(stream, trackIndex, generation);
+}
+
+// Decode the whole file, events of all tracks in time order. Returns false
+// if the stream was rewound or closed before the end.
+static bool midi_stream_decode(struct midi_stream* stream, unsigned int generation) {
+	while (stream->trackHeapSize > 0) {
+		int trackIndex = stream->trackHeap[0];
+		struct midi_stream_track* track = &stream->tracks[trackIndex];
+
+		if (!midi_stream_read_event(stream, trackIndex, generation))
+			return false;
+
+		if (!track->ended)
+			midi_stream_read_delta(stream, track);
+
+		if (track->ended && !midi_stream_end_track(stream, trackIndex, generation))
+			return false;
+
+		if (track->ended)
+			stream->trackHeap[0] = stream->trackHeap[--stream->trackHeapSize];
+
+		midi_stream_heap_sift_down(stream, 0);
+	}
+
+	return true;
+}
+
+static int midi_stream_thread_main(void* data) {
+	struct midi_stream* stream = (struct midi_stream*)data;
+
+	profiler_register_thread("midi-stream");
+
+	while (!atomic_load(&stream->quit)) {
+		unsigned int generation = atomic_load(&stream->generation);
+
+		stream->decodeStart = PROFILER_BEGIN();
+		midi_stream_reset(stream);
+
+		bool finished = midi_stream_decode(stream, generation);
+		PROFILER_END("midi_stream_decode", stream->decodeStart);
+
+		if (finished) {
+			atomic_store(&stream->finishedGeneration, (int)generation);
+			debug_log(LOGLEVEL_DEBUG, "MIDI Stream: Reached the end of \"%s\".\n", stream->path);
+		}
+
+		// Nothing left to do until the stream is rewound.
+		while (!atomic_load(&stream->quit) && atomic_load(&stream->generation) == generation)
+			SDL_SemWaitTimeout(stream->wakeSemaphore, MIDI_STREAM_IDLE_WAIT_MS*10);
+	}
+
+	profiler_unregister_thread();
+
+	return 0;
+}
+
+static uint32_t midi_stream_read_u32(const uint8_t* bytes) {
+	return (uint32_t)bytes[0] << 24 | (uint32_t)bytes[1] << 16 | (uint32_t)bytes[2] << 8 | bytes[3];
+}
+
+// Read the file header and find where each track is.
+static int midi_stream_read_header(struct midi_stream* stream) {
+	uint8_t header[14];
+
+	if (fread(header, 1, sizeof(header), stream->file) != sizeof(header) || memcmp(header, "MThd", 4) != 0) {
+		debug_log(LOGLEVEL_ERROR, "MIDI Stream: \"%s\" is not a MIDI file!\n", stream->path);
+		return -1;
+	}
+
+	long headerLength = midi_stream_read_u32(&header[4]);
+	int declaredTracks = header[10] << 8 | header[11];
+	stream->division = header[12] << 8 | header[13];
+
+	if (stream->division == 0 || ((stream->division & 0x8000) && ((stream->division & 0xFF) == 0 || -(int8_t)(stream->division >> 8) <= 0))) {
+		debug_log(LOGLEVEL_ERROR, "MIDI Stream: \"%s\" has an invalid time division!\n", stream->path);
+		return -1;
+	}
+
+	if (fseek(stream->file, 0, SEEK_END) != 0)
+		return -1;
+
+	long fileSize = ftell(stream->file);
+	long offset = 8 + headerLength;
+
+	stream->tracks = calloc(declaredTracks > 0 ? declaredTracks : 1, sizeof(struct midi_stream_track));
+	if (!stream->tracks)
+		return -1;
+
+	// Unknown chunk types are skipped.
+	while (stream->trackCount < declaredTracks && offset + 8 <= fileSize) {
+		uint8_t chunkHeader[8];
+
+		if (fseek(stream->file, offset, SEEK_SET) != 0 || fread(chunkHeader, 1, sizeof(chunkHeader), stream->file) != sizeof(chunkHeader))
+			break;
+
+		long chunkLength = midi_stream_read_u32(&chunkHeader[4]);
+		long chunkStart = offset + 8;
+
+		// A truncated last track is played as far as it goes.
+		long chunkEnd = (chunkLength > fileSize - chunkStart) ? fileSize : chunkStart + chunkLength;
+
+		if (memcmp(chunkHeader, "MTrk", 4) == 0) {
+			stream->tracks[stream->trackCount].start = chunkStart;
+			stream->tracks[stream->trackCount].end = chunkEnd;
+			stream->trackCount++;
+		}
+
+		offset = chunkEnd;
+	}
+
+	if (stream->trackCount < declaredTracks)
+		debug_log(LOGLEVEL_WARN, "MIDI Stream: \"%s\" should have %d tracks but only %d were found.\n", stream->path, declaredTracks, stream->trackCount);
+
+	return 0;
+}
+
+// Start streaming a MIDI file. Only the header is read here, the notes
+// start coming in right away.
+struct midi_stream* midi_stream_open(const char* path, const struct midi_route* routes, int routeCount) {
+	struct midi_stream* stream = malloc(sizeof(struct midi_stream));
+
+	if (!stream) {
+		debug_log(LOGLEVEL_ERROR, "MIDI Stream: Failed to allocate stream for \"%s\"!\n", path);
+		return NULL;
+	}
+
+	memset((void*)stream, 0, sizeof(struct midi_stream));
+
+	stream->path = strdup(path);
+
+	if (!stream->path) {
+		debug_log(LOGLEVEL_ERROR, "MIDI Stream: Failed to allocate stream for \"%s\"!\n", path);
+		goto fail;
+	}
+
+	atomic_store(&stream->finishedGeneration, -1);
+
+	stream->file = fopen(path, "rb");
+
+	if (!stream->file) {
+		debug_log(LOGLEVEL_ERROR, "MIDI Stream: Failed to open MIDI file \"%s\"!\n", path);
+		goto fail;
+	}
+
+	if (midi_stream_read_header(stream) != 0)
+		goto fail;
+
+	stream->routeTable = midi_resolve_routes(path, routes, routeCount, stream->trackCount);
+	stream->trackHeap = calloc(stream->trackCount > 0 ? stream->trackCount : 1, sizeof(int));
+	stream->openNotes = calloc((size_t)(stream->trackCount > 0 ? stream->trackCount : 1)*MIDI_CHANNEL_COUNT*MIDI_KEY_COUNT, sizeof(uint16_t));
+	stream->events = ringbuffer_create(sizeof(struct midi_stream_event), MIDI_STREAM_QUEUE_SIZE);
+	stream->wakeSemaphore = SDL_CreateSemaphore(0);
+
+	if (!stream->routeTable || !stream->trackHeap || !stream->openNotes || !stream->events || !stream->wakeSemaphore) {
+		debug_log(LOGLEVEL_ERROR, "MIDI Stream: Failed to allocate stream for \"%s\"!\n", path);
+		goto fail;
+	}
+
+	stream->thread = SDL_CreateThread(midi_stream_thread_main, "vo-midi-stream", (void*)stream);
+
+	if (!stream->thread) {
+		debug_log(LOGLEVEL_ERROR, "MIDI Stream: Could not create decoder thread: %s\n", SDL_GetError());
+		goto fail;
+	}
+
+	debug_log(LOGLEVEL_INFO, "MIDI Stream: Streaming %d tracks from \"%s\".\n", stream->trackCount, path);
+
+	return stream;
+
+fail:
+	midi_stream_close(stream);
+	return NULL;
+}
+
+void midi_stream_close(struct midi_stream* stream) {
+	if (!stream)
+		return;
+
+	if (stream->thread) {
+		atomic_store(&stream->quit, true);
+		SDL_SemPost(stream->wakeSemaphore);
+		SDL_WaitThread(stream->thread, NULL);
+	}
+
+	if (stream->wakeSemaphore)
+		SDL_DestroySemaphore(stream->wakeSemaphore);
+
+	if (stream->file)
+		fclose(stream->file);
+
+	ringbuffer_destroy(stream->events);
+	free((void*)stream->openNotes);
+	free((void*)stream->trackHeap);
+	free((void*)stream->routeTable);
+	free((void*)stream->tracks);
+	free((void*)stream->path);
+	free((void*)stream);
+}
+
+// Let the decoder know how far playback has got. Only called by the
+// playback thread.
+void midi_stream_set_time(struct midi_stream* stream, int64_t time) {
+	atomic_store(&stream->playbackTime, time);
+
+	// The decoder polls every MIDI_STREAM_IDLE_WAIT_MS anyway, only wake it
+	// early once the lookahead window has moved further than that.
+	if (time < stream->lastWakeTime || time - stream->lastWakeTime >= NOTE_TIME_FROM_MS(MIDI_STREAM_IDLE_WAIT_MS)) {
+		stream->lastWakeTime = time;
+		SDL_SemPost(stream->wakeSemaphore);
+	}
+}
+
+// Start over from the beginning of the file. Events that were already
+// queued are dropped.
+void midi_stream_rewind(struct midi_stream* stream) {
+	atomic_store(&stream->playbackTime, 0);
+	atomic_fetch_add(&stream->generation, 1);
+	stream->lastWakeTime = 0;
+
+	SDL_SemPost(stream->wakeSemaphore);
+}
+
+// The next event to be played, if it has been decoded yet.
+bool midi_stream_peek(struct midi_stream* stream, struct midi_stream_event* event) {
+	unsigned int generation = atomic_load(&stream->generation);
+
+	while (ringbuffer_peek(stream->events, event)) {
+		if (event->generation == generation)
+			return true;
+
+		ringbuffer_pop(stream->events, NULL);
+	}
+
+	return false;
+}
+
+void midi_stream_pop(struct midi_stream* stream) {
+	ringbuffer_pop(stream->events, NULL);
+}
+
+// True once every event of the file has been played.
+bool midi_stream_finished(struct midi_stream* stream) {
+	struct midi_stream_event event;
+
+	return atomic_load(&stream->finishedGeneration) == (int)atomic_load(&stream->generation) && !midi_stream_peek(stream, &event);
+}
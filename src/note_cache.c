@@ -0,0 +1,432 @@
+/*	
+ *	SPDX-License-Identifier: GPL-3.0-only
+ *
+ *  Virtual Orchestra - Musical Instrument Simulation
+ *  Copyright (C) 2024 Garnek0 (Popa Vlad) and Contributors
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <vo/note_cache.h>
+#include <vo/note_store.h>
+#include <vo/debug.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Parsed notes are written to a cache file next to the MIDI file
+// ("song.mid.vocache"), or to the user's cache directory if that isn't
+// writable. Loading maps the file and lets the note stores use the arrays
+// in it as they are.
+//
+// Layout: a header, then one entry per instrument (in the order the
+// instruments first appear in the routes), then the arrays. Every array
+// starts at a multiple of NOTE_CACHE_ALIGNMENT. Numbers are in native byte
+// order, files from a machine with a different one are rejected by the
+// byteOrder check.
+
+#define NOTE_CACHE_MAGIC "VONOTES"
+#define NOTE_CACHE_BYTE_ORDER 0x01020304
+#define NOTE_CACHE_ALIGNMENT 8
+#define NOTE_CACHE_EXTENSION ".vocache"
+
+#define NOTE_CACHE_FNV_OFFSET 0xCBF29CE484222325ULL
+#define NOTE_CACHE_FNV_PRIME 0x100000001B3ULL
+
+struct note_cache_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t byteOrder;
+
+	struct note_cache_key key;
+
+	uint32_t storeCount;
+	uint32_t reserved;
+};
+
+struct note_cache_store_entry {
+	uint32_t count;
+	uint32_t reserved;
+
+	// From the start of the file.
+	uint64_t startTimeOffset;
+	uint64_t endTimeOffset;
+	uint64_t midiKeyOffset;
+	uint64_t flagsOffset;
+};
+
+static uint64_t note_cache_fnv1a(uint64_t hash, const void* data, size_t length) {
+	const uint8_t* bytes = data;
+
+	for (size_t i = 0; i < length; i++) {
+		hash ^= bytes[i];
+		hash *= NOTE_CACHE_FNV_PRIME;
+	}
+
+	return hash;
+}
+
+static uint64_t note_cache_align(uint64_t offset) {
+	return (offset + NOTE_CACHE_ALIGNMENT - 1) / NOTE_CACHE_ALIGNMENT * NOTE_CACHE_ALIGNMENT;
+}
+
+// The distinct instruments of the routes, in order of first appearance.
+// Returns how many there are, or -1 if out of memory.
+static int note_cache_get_instruments(const struct midi_route* routes, int routeCount, struct instrument*** instruments) {
+	*instruments = malloc(sizeof(struct instrument*)*(routeCount ? routeCount : 1));
+	if (!*instruments)
+		return -1;
+
+	int count = 0;
+
+	for (int i = 0; i < routeCount; i++) {
+		if (!routes[i].instr)
+			continue;
+
+		int j = 0;
+		while (j < count && (*instruments)[j] != routes[i].instr)
+			j++;
+
+		if (j == count)
+			(*instruments)[count++] = routes[i].instr;
+	}
+
+	return count;
+}
+
+// The two places a cache file can be. Returns false if there is no such
+// place.
+static bool note_cache_get_path(const char* midiPath, bool inCacheDirectory, char* path, size_t pathSize) {
+	if (!inCacheDirectory)
+		return snprintf(path, pathSize, "%s" NOTE_CACHE_EXTENSION, midiPath) < (int)pathSize;
+
+	char directory[PATH_MAX];
+	const char* xdgCacheHome = getenv("XDG_CACHE_HOME");
+	const char* home = getenv("HOME");
+
+	if (xdgCacheHome && xdgCacheHome[0])
+		snprintf(directory, sizeof(directory), "%s/virtual-orchestra", xdgCacheHome);
+	else if (home && home[0])
+		snprintf(directory, sizeof(directory), "%s/.cache/virtual-orchestra", home);
+	else
+		return false;
+
+	// Different MIDI files with the same name mustn't share a cache file.
+	char absolutePath[PATH_MAX];
+	const char* identity = realpath(midiPath, absolutePath) ? absolutePath : midiPath;
+	uint64_t pathHash = note_cache_fnv1a(NOTE_CACHE_FNV_OFFSET, identity, strlen(identity));
+
+	return snprintf(path, pathSize, "%s/%016llx" NOTE_CACHE_EXTENSION, directory, (unsigned long long)pathHash) < (int)pathSize;
+}
+
+// Create the user's cache directory (and its parent) if it doesn't exist.
+static void note_cache_create_directory(const char* cachePath) {
+	char directory[PATH_MAX];
+	snprintf(directory, sizeof(directory), "%s", cachePath);
+
+	char* lastSlash = strrchr(directory, '/');
+	if (!lastSlash)
+		return;
+	*lastSlash = '\0';
+
+	char* parentSlash = strrchr(directory, '/');
+	if (parentSlash) {
+		*parentSlash = '\0';
+		mkdir(directory, 0755);
+		*parentSlash = '/';
+	}
+
+	mkdir(directory, 0755);
+}
+
+int note_cache_make_key(const char* midiPath, const struct midi_route* routes, int routeCount, struct note_cache_key* key) {
+	int fd = open(midiPath, O_RDONLY);
+	if (fd < 0)
+		return -1;
+
+	struct stat sourceStat;
+	if (fstat(fd, &sourceStat) != 0 || sourceStat.st_size == 0) {
+		close(fd);
+		return -1;
+	}
+
+	void* source = mmap(NULL, sourceStat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+
+	if (source == MAP_FAILED)
+		return -1;
+
+	memset((void*)key, 0, sizeof(struct note_cache_key));
+
+	key->sourceSize = sourceStat.st_size;
+	key->sourceModifiedTime = sourceStat.st_mtime;
+	key->sourceHash = note_cache_fnv1a(NOTE_CACHE_FNV_OFFSET, source, sourceStat.st_size);
+
+	munmap(source, sourceStat.st_size);
+
+	// Which notes go to which instrument. The instruments themselves don't
+	// matter, only which routes share one.
+
+	struct instrument** instruments;
+	int instrumentCount = note_cache_get_instruments(routes, routeCount, &instruments);
+	if (instrumentCount < 0)
+		return -1;
+
+	uint64_t signature = NOTE_CACHE_FNV_OFFSET;
+
+	for (int i = 0; i < routeCount; i++) {
+		int32_t route[3] = {routes[i].track, routes[i].channel, -1};
+
+		for (int j = 0; j < instrumentCount; j++)
+			if (instruments[j] == routes[i].instr)
+				route[2] = j;
+
+		signature = note_cache_fnv1a(signature, route, sizeof(route));
+	}
+
+	key->routeSignature = signature;
+
+	free((void*)instruments);
+
+	return 0;
+}
+
+static bool note_cache_array_fits(uint64_t offset, uint64_t length, uint64_t fileSize) {
+	return offset % NOTE_CACHE_ALIGNMENT == 0 && offset <= fileSize && length <= fileSize - offset;
+}
+
+// Map a cache file and hand its notes to the instruments. Returns -1 if the
+// file doesn't exist or doesn't match.
+static int note_cache_load_file(const char* cachePath, const struct note_cache_key* key, struct instrument** instruments, int instrumentCount) {
+	int fd = open(cachePath, O_RDONLY);
+	if (fd < 0)
+		return -1;
+
+	struct stat cacheStat;
+	if (fstat(fd, &cacheStat) != 0 || (uint64_t)cacheStat.st_size < sizeof(struct note_cache_header) + sizeof(struct note_cache_store_entry)*instrumentCount) {
+		close(fd);
+		return -1;
+	}
+
+	uint64_t fileSize = cacheStat.st_size;
+
+	// Private and writable, the stores change note flags during playback.
+	uint8_t* file = mmap(NULL, fileSize, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	close(fd);
+
+	if (file == MAP_FAILED)
+		return -1;
+
+	struct note_cache_header* header = (struct note_cache_header*)file;
+	struct note_cache_store_entry* entries = (struct note_cache_store_entry*)(file + sizeof(struct note_cache_header));
+
+	bool valid = memcmp(header->magic, NOTE_CACHE_MAGIC, sizeof(header->magic)) == 0
+		&& header->version == NOTE_CACHE_VERSION
+		&& header->byteOrder == NOTE_CACHE_BYTE_ORDER
+		&& memcmp(&header->key, key, sizeof(struct note_cache_key)) == 0
+		&& header->storeCount == (uint32_t)instrumentCount;
+
+	for (int i = 0; valid && i < instrumentCount; i++) {
+		uint64_t count = entries[i].count;
+
+		valid = count <= INT_MAX
+			&& note_cache_array_fits(entries[i].startTimeOffset, count*sizeof(int64_t), fileSize)
+			&& note_cache_array_fits(entries[i].endTimeOffset, count*sizeof(int64_t), fileSize)
+			&& note_cache_array_fits(entries[i].midiKeyOffset, count, fileSize)
+			&& note_cache_array_fits(entries[i].flagsOffset, count, fileSize);
+	}
+
+	if (!valid) {
+		munmap((void*)file, fileSize);
+		return -1;
+	}
+
+	struct note_store_mapping* mapping = malloc(sizeof(struct note_store_mapping));
+	if (!mapping) {
+		munmap((void*)file, fileSize);
+		return -1;
+	}
+
+	mapping->address = file;
+	mapping->length = fileSize;
+	mapping->refCount = 0;
+
+	int noteCount = 0;
+
+	for (int i = 0; i < instrumentCount; i++) {
+		struct note_cache_store_entry* entry = &entries[i];
+
+		note_store_borrow(instruments[i]->noteList, mapping, entry->count, (int64_t*)(file + entry->startTimeOffset), (int64_t*)(file + entry->endTimeOffset), file + entry->midiKeyOffset, file + entry->flagsOffset);
+		noteCount += entry->count;
+	}
+
+	// Only possible with no instruments at all.
+	if (mapping->refCount == 0) {
+		munmap((void*)file, fileSize);
+		free((void*)mapping);
+	}
+
+	return noteCount;
+}
+
+// Fill the routed instruments' note stores from a matching cache file.
+// Returns -1 if there is none, the MIDI file then has to be parsed.
+int note_cache_load(const char* midiPath, const struct note_cache_key* key, const struct midi_route* routes, int routeCount) {
+	struct instrument** instruments;
+	int instrumentCount = note_cache_get_instruments(routes, routeCount, &instruments);
+	if (instrumentCount < 0)
+		return -1;
+
+	char cachePath[PATH_MAX];
+	int noteCount = -1;
+
+	for (int i = 0; i < 2 && noteCount < 0; i++) {
+		if (note_cache_get_path(midiPath, i == 1, cachePath, sizeof(cachePath)))
+			noteCount = note_cache_load_file(cachePath, key, instruments, instrumentCount);
+	}
+
+	free((void*)instruments);
+
+	if (noteCount < 0)
+		return -1;
+
+	debug_log(LOGLEVEL_INFO, "Note Cache: Using %d cached notes from \"%s\".\n", noteCount, cachePath);
+
+	return 0;
+}
+
+static int note_cache_write_padded(FILE* file, const void* data, size_t length) {
+	static const uint8_t padding[NOTE_CACHE_ALIGNMENT] = {0};
+
+	if (length && fwrite(data, 1, length, file) != length)
+		return -1;
+
+	size_t paddingLength = note_cache_align(length) - length;
+
+	if (paddingLength && fwrite(padding, 1, paddingLength, file) != paddingLength)
+		return -1;
+
+	return 0;
+}
+
+static int note_cache_write_file(const char* cachePath, const struct note_cache_key* key, struct instrument** instruments, int instrumentCount) {
+	// Written under a temporary name and renamed into place, so a crash or
+	// a second instance never leaves a half written cache behind.
+	char temporaryPath[PATH_MAX + 32];
+	snprintf(temporaryPath, sizeof(temporaryPath), "%s.%ld.tmp", cachePath, (long)getpid());
+
+	FILE* file = fopen(temporaryPath, "wb");
+	if (!file)
+		return -1;
+
+	struct note_cache_header header = {0};
+	memcpy(header.magic, NOTE_CACHE_MAGIC, sizeof(header.magic));
+	header.version = NOTE_CACHE_VERSION;
+	header.byteOrder = NOTE_CACHE_BYTE_ORDER;
+	header.key = *key;
+	header.storeCount = instrumentCount;
+
+	struct note_cache_store_entry* entries = calloc(instrumentCount ? instrumentCount : 1, sizeof(struct note_cache_store_entry));
+	if (!entries) {
+		fclose(file);
+		remove(temporaryPath);
+		return -1;
+	}
+
+	uint64_t offset = note_cache_align(sizeof(struct note_cache_header) + sizeof(struct note_cache_store_entry)*instrumentCount);
+
+	for (int i = 0; i < instrumentCount; i++) {
+		uint64_t count = instruments[i]->noteList->count;
+
+		entries[i].count = count;
+		entries[i].startTimeOffset = offset;
+		offset += note_cache_align(count*sizeof(int64_t));
+		entries[i].endTimeOffset = offset;
+		offset += note_cache_align(count*sizeof(int64_t));
+		entries[i].midiKeyOffset = offset;
+		offset += note_cache_align(count);
+		entries[i].flagsOffset = offset;
+		offset += note_cache_align(count);
+	}
+
+	int result = 0;
+
+	if (fwrite(&header, sizeof(header), 1, file) != 1 || note_cache_write_padded(file, entries, sizeof(struct note_cache_store_entry)*instrumentCount) != 0)
+		result = -1;
+
+	for (int i = 0; i < instrumentCount && result == 0; i++) {
+		struct note_store* store = instruments[i]->noteList;
+
+		if (note_cache_write_padded(file, store->startTime, sizeof(int64_t)*store->count) != 0
+			|| note_cache_write_padded(file, store->endTime, sizeof(int64_t)*store->count) != 0
+			|| note_cache_write_padded(file, store->midiKey, store->count) != 0
+			|| note_cache_write_padded(file, store->flags, store->count) != 0)
+			result = -1;
+	}
+
+	free((void*)entries);
+
+	if (fclose(file) != 0)
+		result = -1;
+
+	if (result == 0 && rename(temporaryPath, cachePath) != 0)
+		result = -1;
+
+	if (result != 0)
+		remove(temporaryPath);
+
+	return result;
+}
+
+// Write the routed instruments' notes to a cache file for the next time
+// this MIDI file is loaded with the same routes. Must be called right after
+// parsing, while the notes are sorted and carry no playback state.
+int note_cache_save(const char* midiPath, const struct note_cache_key* key, const struct midi_route* routes, int routeCount) {
+	struct instrument** instruments;
+	int instrumentCount = note_cache_get_instruments(routes, routeCount, &instruments);
+	if (instrumentCount < 0)
+		return -1;
+
+	char cachePath[PATH_MAX];
+	int result = -1;
+
+	for (int i = 0; i < 2 && result != 0; i++) {
+		if (!note_cache_get_path(midiPath, i == 1, cachePath, sizeof(cachePath)))
+			continue;
+
+		if (i == 1)
+			note_cache_create_directory(cachePath);
+
+		result = note_cache_write_file(cachePath, key, instruments, instrumentCount);
+	}
+
+	free((void*)instruments);
+
+	if (result != 0) {
+		debug_log(LOGLEVEL_WARN, "Note Cache: Could not write a note cache for \"%s\": %s\n", midiPath, strerror(errno));
+		return -1;
+	}
+
+	debug_log(LOGLEVEL_INFO, "Note Cache: Saved notes to \"%s\".\n", cachePath);
+
+	return 0;
+}
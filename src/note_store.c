@@ -0,0 +1,276 @@
+/*	
+ *	SPDX-License-Identifier: GPL-3.0-only
+ *
+ *  Virtual Orchestra - Musical Instrument Simulation
+ *  Copyright (C) 2024 Garnek0 (Popa Vlad) and Contributors
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <vo/note_store.h>
+#include <vo/debug.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+struct note_store* note_store_create() {
+	struct note_store* newStore = malloc(sizeof(struct note_store));
+	memset((void*)newStore, 0, sizeof(struct note_store));
+
+	newStore->sorted = true;
+
+	return newStore;
+}
+
+static void note_store_release_mapping(struct note_store* store) {
+	struct note_store_mapping* mapping = store->mapping;
+
+	store->mapping = NULL;
+	store->startTime = store->endTime = NULL;
+	store->midiKey = store->flags = NULL;
+	store->capacity = 0;
+
+	if (--mapping->refCount > 0)
+		return;
+
+	munmap(mapping->address, mapping->length);
+	free((void*)mapping);
+}
+
+void note_store_destroy(struct note_store* store) {
+	if (!store)
+		return;
+
+	if (store->mapping) {
+		note_store_release_mapping(store);
+	} else {
+		free((void*)store->startTime);
+		free((void*)store->endTime);
+		free((void*)store->midiKey);
+		free((void*)store->flags);
+	}
+
+	free((void*)store);
+}
+
+// Forget all notes but keep the arrays around for reuse. Borrowed arrays
+// are given back instead.
+void note_store_clear(struct note_store* store) {
+	if (store->mapping)
+		note_store_release_mapping(store);
+
+	store->count = 0;
+	store->sorted = true;
+}
+
+// Use count notes that already sit in memory (normally a mapped note cache)
+// without copying them. The arrays must stay valid while mapping has
+// references, the store takes one of them. The notes must be sorted.
+void note_store_borrow(struct note_store* store, struct note_store_mapping* mapping, int count, int64_t* startTime, int64_t* endTime, uint8_t* midiKey, uint8_t* flags) {
+	// Taken first, in case the store was already borrowing from the same
+	// mapping.
+	mapping->refCount++;
+
+	note_store_clear(store);
+
+	free((void*)store->startTime);
+	free((void*)store->endTime);
+	free((void*)store->midiKey);
+	free((void*)store->flags);
+
+	store->mapping = mapping;
+	store->count = store->capacity = count;
+	store->startTime = startTime;
+	store->endTime = endTime;
+	store->midiKey = midiKey;
+	store->flags = flags;
+}
+
+// Replace borrowed arrays with owned copies.
+static int note_store_copy_out(struct note_store* store) {
+	int count = store->count;
+
+	if (count == 0) {
+		note_store_release_mapping(store);
+		return 0;
+	}
+
+	int64_t* startTime = malloc(sizeof(int64_t)*count);
+	int64_t* endTime = malloc(sizeof(int64_t)*count);
+	uint8_t* midiKey = malloc(count);
+	uint8_t* flags = malloc(count);
+
+	if (!startTime || !endTime || !midiKey || !flags) {
+		free((void*)startTime);
+		free((void*)endTime);
+		free((void*)midiKey);
+		free((void*)flags);
+		return -1;
+	}
+
+	memcpy((void*)startTime, (void*)store->startTime, sizeof(int64_t)*count);
+	memcpy((void*)endTime, (void*)store->endTime, sizeof(int64_t)*count);
+	memcpy((void*)midiKey, (void*)store->midiKey, count);
+	memcpy((void*)flags, (void*)store->flags, count);
+
+	note_store_release_mapping(store);
+
+	store->startTime = startTime;
+	store->endTime = endTime;
+	store->midiKey = midiKey;
+	store->flags = flags;
+	store->capacity = count;
+
+	return 0;
+}
+
+static int note_store_grow(struct note_store* store) {
+	if (store->mapping && note_store_copy_out(store) != 0)
+		return -1;
+
+	int newCapacity = store->capacity ? store->capacity * 2 : 256;
+
+	int64_t* newStartTime = realloc((void*)store->startTime, sizeof(int64_t)*newCapacity);
+	if (newStartTime)
+		store->startTime = newStartTime;
+
+	int64_t* newEndTime = realloc((void*)store->endTime, sizeof(int64_t)*newCapacity);
+	if (newEndTime)
+		store->endTime = newEndTime;
+
+	uint8_t* newMidiKey = realloc((void*)store->midiKey, newCapacity);
+	if (newMidiKey)
+		store->midiKey = newMidiKey;
+
+	uint8_t* newFlags = realloc((void*)store->flags, newCapacity);
+	if (newFlags)
+		store->flags = newFlags;
+
+	// Arrays that did grow stay grown, they just won't be used past
+	// the old capacity.
+	if (!newStartTime || !newEndTime || !newMidiKey || !newFlags)
+		return -1;
+
+	store->capacity = newCapacity;
+
+	return 0;
+}
+
+// Returns the index of the new note or -1 on failure. Indexes stay valid
+// until the store is cleared or sorted.
+int note_store_append(struct note_store* store, int64_t startTime, int64_t endTime, int midiKey, uint8_t flags) {
+	if (store->count == store->capacity && note_store_grow(store) != 0) {
+		debug_log(LOGLEVEL_ERROR, "Note Store: Failed to grow note store past %d notes!\n", store->capacity);
+		return -1;
+	}
+
+	if (store->count > 0 && startTime < store->startTime[store->count-1])
+		store->sorted = false;
+
+	int index = store->count++;
+
+	store->startTime[index] = startTime;
+	store->endTime[index] = endTime;
+	store->midiKey[index] = (uint8_t)midiKey;
+	store->flags[index] = flags;
+
+	return index;
+}
+
+struct note_store_sort_key {
+	int64_t startTime;
+	int index;
+};
+
+static int note_store_compare_start(const void* a, const void* b) {
+	const struct note_store_sort_key* keyA = (const struct note_store_sort_key*)a;
+	const struct note_store_sort_key* keyB = (const struct note_store_sort_key*)b;
+
+	if (keyA->startTime != keyB->startTime)
+		return keyA->startTime < keyB->startTime ? -1 : 1;
+
+	// Keep notes that start together in the order they were added.
+	return keyA->index - keyB->index;
+}
+
+// Restore start time order after out-of-order appends.
+void note_store_sort(struct note_store* store) {
+	if (store->sorted)
+		return;
+
+	struct note_store_sort_key* order = malloc(sizeof(struct note_store_sort_key)*store->count);
+	int64_t* scratch = malloc(sizeof(int64_t)*store->count);
+
+	if (!order || !scratch) {
+		debug_log(LOGLEVEL_ERROR, "Note Store: Failed to allocate memory for sorting!\n");
+		free((void*)order);
+		free((void*)scratch);
+		return;
+	}
+
+	for (int i = 0; i < store->count; i++) {
+		order[i].startTime = store->startTime[i];
+		order[i].index = i;
+	}
+
+	qsort((void*)order, store->count, sizeof(struct note_store_sort_key), note_store_compare_start);
+
+	// Apply the permutation to every array, going through the scratch buffer.
+
+	for (int i = 0; i < store->count; i++)
+		scratch[i] = order[i].startTime;
+	memcpy((void*)store->startTime, (void*)scratch, sizeof(int64_t)*store->count);
+
+	for (int i = 0; i < store->count; i++)
+		scratch[i] = store->endTime[order[i].index];
+	memcpy((void*)store->endTime, (void*)scratch, sizeof(int64_t)*store->count);
+
+	uint8_t* byteScratch = (uint8_t*)scratch;
+
+	for (int i = 0; i < store->count; i++)
+		byteScratch[i] = store->midiKey[order[i].index];
+	memcpy((void*)store->midiKey, (void*)byteScratch, store->count);
+
+	for (int i = 0; i < store->count; i++)
+		byteScratch[i] = store->flags[order[i].index];
+	memcpy((void*)store->flags, (void*)byteScratch, store->count);
+
+	free((void*)order);
+	free((void*)scratch);
+
+	store->sorted = true;
+}
+
+// Unpack a note into the form the instruments expect.
+void note_store_get(struct note_store* store, int index, struct complex_note* note) {
+	uint8_t flags = store->flags[index];
+
+	note->midiKey = store->midiKey[index];
+	note->key = NOTE_MIDI_TO_KEY(note->midiKey);
+	note->octave = NOTE_MIDI_TO_OCTAVE(note->midiKey);
+
+	note->sfz = flags & NOTE_FLAG_SFZ;
+	note->accent = flags & NOTE_FLAG_ACCENT;
+	note->staccato = flags & NOTE_FLAG_STACCATO;
+	note->marcato = flags & NOTE_FLAG_MARCATO;
+	note->legatoNextNote = flags & NOTE_FLAG_LEGATO_NEXT_NOTE;
+	note->playing = flags & NOTE_FLAG_PLAYING;
+
+	note->startTime = store->startTime[index];
+	note->endTime = store->endTime[index];
+
+	note->velocity = 0;
+	note->scheduledTime = NOTE_TIME_NOW;
+}
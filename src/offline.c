@@ -0,0 +1,152 @@
+/*	
+ *	SPDX-License-Identifier: GPL-3.0-only
+ *
+ *  Virtual Orchestra - Musical Instrument Simulation
+ *  Copyright (C) 2024 Garnek0 (Popa Vlad) and Contributors
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <vo/offline.h>
+#include <vo/audio.h>
+#include <vo/debug.h>
+#include <vo/playback.h>
+
+#include <SDL2/SDL.h>
+#include <stdint.h>
+#include <stdio.h>
+
+// Frames rendered and written per step. Every note due within a block is
+// queued before the block is rendered. The audio engine grows the event
+// queues when rendering offline, so dense blocks don't lose notes.
+#define OFFLINE_BLOCK_SIZE 512
+
+// How long to keep rendering after the last noteOff, so that releases and
+// reverb tails aren't cut off.
+#define OFFLINE_TAIL_MS 2000
+
+static void offline_write_u16(FILE* file, uint16_t value) {
+	uint8_t bytes[2] = {value & 0xFF, value >> 8};
+	fwrite(bytes, 1, 2, file);
+}
+
+static void offline_write_u32(FILE* file, uint32_t value) {
+	uint8_t bytes[4] = {value & 0xFF, (value >> 8) & 0xFF, (value >> 16) & 0xFF, value >> 24};
+	fwrite(bytes, 1, 4, file);
+}
+
+// 16-bit stereo PCM. The chunk sizes are filled in by offline_finish_wav_header()
+// once the length is known.
+static void offline_write_wav_header(FILE* file, int sampleRate) {
+	fwrite("RIFF", 1, 4, file);
+	offline_write_u32(file, 0);
+	fwrite("WAVE", 1, 4, file);
+
+	fwrite("fmt ", 1, 4, file);
+	offline_write_u32(file, 16);
+	offline_write_u16(file, 1); // PCM
+	offline_write_u16(file, 2); // Channels
+	offline_write_u32(file, sampleRate);
+	offline_write_u32(file, sampleRate * 2 * 2); // Bytes per second
+	offline_write_u16(file, 2 * 2); // Bytes per frame
+	offline_write_u16(file, 16); // Bits per sample
+
+	fwrite("data", 1, 4, file);
+	offline_write_u32(file, 0);
+}
+
+static void offline_finish_wav_header(FILE* file, uint32_t dataSize) {
+	fseek(file, 4, SEEK_SET);
+	offline_write_u32(file, 36 + dataSize);
+	fseek(file, 40, SEEK_SET);
+	offline_write_u32(file, dataSize);
+}
+
+static int16_t offline_float_to_s16(float sample) {
+	if (sample > 1.0f)
+		sample = 1.0f;
+	else if (sample < -1.0f)
+		sample = -1.0f;
+
+	return (int16_t)(sample * 32767.0f);
+}
+
+// Play the loaded timeline from the start into a WAV file as fast as the
+// synth can go. Memory use doesn't depend on the length of the piece,
+// every block is written out as soon as it is rendered.
+int offline_render(const char* wavPath) {
+	FILE* wavFile = fopen(wavPath, "wb");
+
+	if (!wavFile) {
+		debug_log(LOGLEVEL_ERROR, "Offline: Could not open \"%s\" for writing!\n", wavPath);
+		return -1;
+	}
+
+	int sampleRate = (int)audio_get_sample_rate();
+
+	offline_write_wav_header(wavFile, sampleRate);
+
+	float left[OFFLINE_BLOCK_SIZE], right[OFFLINE_BLOCK_SIZE];
+	uint8_t pcm[OFFLINE_BLOCK_SIZE * 4];
+
+	uint64_t renderedFrames = 0;
+	uint64_t tailFrames = (uint64_t)sampleRate * OFFLINE_TAIL_MS / 1000;
+	int64_t playbackTime = 0;
+
+	Uint64 renderStart = SDL_GetPerformanceCounter();
+
+	playback_start();
+
+	while (tailFrames > 0) {
+		// Queue every note that is due by the end of this block, they get
+		// applied at their exact offset inside it.
+		int64_t blockEndTime = (int64_t)((renderedFrames + OFFLINE_BLOCK_SIZE) * 1000000 / sampleRate);
+
+		playback_advance(blockEndTime - playbackTime);
+		playbackTime = blockEndTime;
+
+		audio_render(left, right, OFFLINE_BLOCK_SIZE);
+
+		for (int i = 0; i < OFFLINE_BLOCK_SIZE; i++) {
+			int16_t leftSample = offline_float_to_s16(left[i]);
+			int16_t rightSample = offline_float_to_s16(right[i]);
+
+			pcm[i*4] = leftSample & 0xFF;
+			pcm[i*4 + 1] = (leftSample >> 8) & 0xFF;
+			pcm[i*4 + 2] = rightSample & 0xFF;
+			pcm[i*4 + 3] = (rightSample >> 8) & 0xFF;
+		}
+
+		if (fwrite(pcm, 1, sizeof(pcm), wavFile) != sizeof(pcm)) {
+			debug_log(LOGLEVEL_ERROR, "Offline: Failed to write to \"%s\"!\n", wavPath);
+			fclose(wavFile);
+			return -1;
+		}
+
+		renderedFrames += OFFLINE_BLOCK_SIZE;
+
+		if (playback_finished())
+			tailFrames = tailFrames > OFFLINE_BLOCK_SIZE ? tailFrames - OFFLINE_BLOCK_SIZE : 0;
+	}
+
+	offline_finish_wav_header(wavFile, (uint32_t)(renderedFrames * 4));
+	fclose(wavFile);
+
+	double renderSeconds = (double)(SDL_GetPerformanceCounter() - renderStart) / SDL_GetPerformanceFrequency();
+	double audioSeconds = (double)renderedFrames / sampleRate;
+
+	debug_log(LOGLEVEL_INFO, "Offline: Rendered %.1f s of audio to \"%s\" in %.1f s (%.1fx realtime).\n", audioSeconds, wavPath, renderSeconds, renderSeconds > 0 ? audioSeconds / renderSeconds : 0.0);
+
+	return 0;
+}
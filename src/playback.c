@@ -21,79 +21,554 @@
 #include <vo/playback.h>
 #include <vo/event.h>
 #include <vo/list.h>
+#include <vo/note_store.h>
+#include <vo/timeline.h>
+#include <vo/debug.h>
+#include <vo/audio.h>
+#include <vo/ringbuffer.h>
+#include <vo/profiler.h>
+#include <vo/midi_stream.h>
 #include <vo/instruments/instrument.h>
 #include <stdbool.h>
+#include <stdatomic.h>
+#include <stdint.h>
 #include <SDL2/SDL.h>
 
-int previousTime;
-int playbackTime;
-bool playing;
+// Longest the playback thread sleeps while playing. Events are scheduled
+// ahead of time by the audio engine, so waking up a bit late is fine.
+#define PLAYBACK_MAX_SLEEP_MS 10
 
-void playback_toggle_callback() {
-	if (playing)
-		playing = false;
+#define PLAYBACK_COMMAND_QUEUE_SIZE 256
+
+// How far dragging the mouse by one pixel moves the playback time.
+#define PLAYBACK_SCRUB_MS_PER_PIXEL 10
+
+// How far the skip keys move the playback time.
+#define PLAYBACK_SKIP_MS 5000
+
+#define PLAYBACK_COMMAND_TOGGLE 0
+#define PLAYBACK_COMMAND_STOP 1
+#define PLAYBACK_COMMAND_PLAY_NOTE 2
+#define PLAYBACK_COMMAND_RELEASE_NOTE 3
+#define PLAYBACK_COMMAND_SEEK 4
+#define PLAYBACK_COMMAND_SEEK_BY 5
+
+// Request from the main thread to the playback thread.
+struct playback_command {
+	uint8_t type;
+
+	// PLAYBACK_COMMAND_PLAY_NOTE / RELEASE_NOTE only
+	struct instrument* instr;
+	struct complex_note note;
+
+	// PLAYBACK_COMMAND_SEEK / SEEK_BY only
+	int64_t time;
+};
+
+// While playing, the playback time is anchorTime plus the time passed since
+// the performance counter read anchorCounter. It is worked out from the
+// anchor every iteration instead of adding up the time between iterations,
+// so rounding can't build up over a long performance.
+static Uint64 anchorCounter;
+static int64_t anchorTime;
+
+static int64_t playbackTime;
+static atomic_bool playing;
+
+static struct timeline* timeline;
+
+// Index of the next timeline event to be dispatched.
+static int timelineCursor;
+
+// When set, events come from here instead of the timeline.
+static struct midi_stream* stream;
+
+// Everything that touches instruments, notes or the audio event queues
+// runs on the playback thread once it is started. The main thread only
+// talks to it through the command queue.
+static SDL_Thread* thread;
+static SDL_sem* wakeSemaphore;
+static atomic_bool threadQuit;
+static struct ringbuffer* commandQueue;
+
+// Set when seeking while paused left notes to be struck on resume.
+static bool strikePending;
+
+// Notes sounding before and after a seek.
+static int* previousActiveNotes;
+static int maxPreviousActiveNotes;
+static int* nextActiveNotes;
+static int maxNextActiveNotes;
+
+// Let the transport run from time, as of now.
+static void playback_anchor(int64_t time) {
+	anchorCounter = SDL_GetPerformanceCounter();
+	anchorTime = time;
+}
+
+// Strike the notes that seeking while paused only pressed the keys of.
+static void playback_strike_pending() {
+	strikePending = false;
+
+	for (int i = 0; i < timeline->instrumentCount; i++) {
+		struct instrument* instr = timeline->instruments[i].instr;
+		struct note_store* notes = instr->noteList;
+		struct complex_note note;
+
+		int count = interval_index_query(timeline->instruments[i].activeNotes, playbackTime, &nextActiveNotes, &maxNextActiveNotes);
+
+		for (int j = 0; j < count; j++) {
+			int index = nextActiveNotes[j];
+
+			if (!(notes->flags[index] & NOTE_FLAG_STRIKE_PENDING))
+				continue;
+
+			notes->flags[index] &= ~NOTE_FLAG_STRIKE_PENDING;
+			note_store_get(notes, index, &note);
+			note.velocity = timeline_note_velocity(instr, notes->flags[index]);
+			note.scheduledTime = playbackTime;
+			instr->play_note(instr, note);
+		}
+	}
+}
+
+void playback_start() {
+	atomic_store(&playing, true);
+	playback_anchor(playbackTime);
+	audio_sync(playbackTime);
+
+	if (strikePending)
+		playback_strike_pending();
+}
+
+static void playback_toggle() {
+	if (atomic_load(&playing))
+		atomic_store(&playing, false);
 	else
-		playing = true;
+		playback_start();
 }
 
-void playback_stop_callback() {
-	playing = false;
+// Release every key an instrument has down. The note store doesn't know
+// about streamed notes, so the key state is all there is to go by.
+static void playback_release_all_keys(struct instrument* instr) {
+	struct key_state_snapshot keys;
+	key_state_read(&instr->keyState, &keys);
+
+	for (int midiKey = 0; midiKey < 128; midiKey++) {
+		if (!KEY_STATE_IS_PRESSED(&keys, midiKey))
+			continue;
+
+		struct complex_note note = {0};
+		note.midiKey = midiKey;
+		note.key = NOTE_MIDI_TO_KEY(midiKey);
+		note.octave = NOTE_MIDI_TO_OCTAVE(midiKey);
+		note.scheduledTime = NOTE_TIME_NOW;
+
+		instr->release_note(instr, note);
+	}
+}
+
+static void playback_stop() {
+	atomic_store(&playing, false);
 	playbackTime = 0;
+	timelineCursor = 0;
+	strikePending = false;
+
+	if (stream) {
+		list_foreach(i, instrument_get_list())
+			playback_release_all_keys((struct instrument*)i->data);
+
+		midi_stream_rewind(stream);
+		audio_flush();
+		return;
+	}
 
 	list_foreach(i, instrument_get_list()) {
 		struct instrument* instr = (struct instrument*)i->data;
 
-		list_foreach(j, instr->noteList) {
-			struct complex_note* note = (struct complex_note*)j->data;
+		struct note_store* notes = instr->noteList;
+
+		for (int j = 0; j < notes->count; j++) {
+			if (notes->flags[j] & NOTE_FLAG_PLAYING) {
+				struct complex_note note;
+				note_store_get(notes, j, &note);
 
-			if (note->playing) {
-				instr->release_note(instr, *note);
-				note->playing = false;
+				instr->release_note(instr, note);
+				notes->flags[j] &= ~(NOTE_FLAG_PLAYING | NOTE_FLAG_STRIKE_PENDING);
 			}
 		}
 	}
+
+	// Notes already queued for the audio thread shouldn't be heard either.
+	audio_flush();
+}
+
+// Jump to a point in time. Notes that keep sounding across the jump are
+// left alone, the ones that stop are released and the ones that should be
+// sounding at the new time are struck, so the synths and keys end up the
+// same as if playback had got there on its own. While paused, striking
+// waits until playback resumes.
+static void playback_seek_to(int64_t time) {
+	if (stream) {
+		debug_log(LOGLEVEL_WARN, "Playback: Seeking isn't supported while streaming.\n");
+		return;
+	}
+
+	int64_t endTime = timeline_get_end_time(timeline);
+
+	if (time > endTime)
+		time = endTime;
+	if (time < 0)
+		time = 0;
+
+	bool isPlaying = atomic_load(&playing);
+
+	// Whatever is struck now is heard together with the events from the
+	// new time on.
+	if (isPlaying) {
+		playback_anchor(time);
+		audio_sync(time);
+	}
+
+	int64_t scheduledTime = isPlaying ? time : NOTE_TIME_NOW;
+
+	for (int i = 0; i < timeline->instrumentCount; i++) {
+		struct instrument* instr = timeline->instruments[i].instr;
+		struct interval_index* activeNotes = timeline->instruments[i].activeNotes;
+		struct note_store* notes = instr->noteList;
+		struct complex_note note;
+
+		int previousCount = interval_index_query(activeNotes, playbackTime, &previousActiveNotes, &maxPreviousActiveNotes);
+		int nextCount = interval_index_query(activeNotes, time, &nextActiveNotes, &maxNextActiveNotes);
+
+		for (int j = 0; j < nextCount; j++)
+			notes->flags[nextActiveNotes[j]] |= NOTE_FLAG_SEEK_ACTIVE;
+
+		for (int j = 0; j < previousCount; j++) {
+			int index = previousActiveNotes[j];
+
+			if (!(notes->flags[index] & NOTE_FLAG_PLAYING) || (notes->flags[index] & NOTE_FLAG_SEEK_ACTIVE))
+				continue;
+
+			notes->flags[index] &= ~NOTE_FLAG_PLAYING;
+
+			// Never struck, only its key is down.
+			if (notes->flags[index] & NOTE_FLAG_STRIKE_PENDING) {
+				notes->flags[index] &= ~NOTE_FLAG_STRIKE_PENDING;
+				key_state_set(&instr->keyState, notes->midiKey[index], false);
+				continue;
+			}
+
+			note_store_get(notes, index, &note);
+			note.scheduledTime = scheduledTime;
+			instr->release_note(instr, note);
+		}
+
+		for (int j = 0; j < nextCount; j++) {
+			int index = nextActiveNotes[j];
+
+			notes->flags[index] &= ~NOTE_FLAG_SEEK_ACTIVE;
+
+			if (notes->flags[index] & NOTE_FLAG_PLAYING)
+				continue;
+
+			notes->flags[index] |= NOTE_FLAG_PLAYING;
+
+			// While paused only the key is pressed. Scrubbing would
+			// otherwise strike the whole chord again on every mouse motion
+			// and leave it ringing. It is struck once playback resumes.
+			if (!isPlaying) {
+				notes->flags[index] |= NOTE_FLAG_STRIKE_PENDING;
+				key_state_set(&instr->keyState, notes->midiKey[index], true);
+				strikePending = true;
+				continue;
+			}
+
+			note_store_get(notes, index, &note);
+			note.velocity = timeline_note_velocity(instr, notes->flags[index]);
+			note.scheduledTime = scheduledTime;
+			instr->play_note(instr, note);
+		}
+	}
+
+	playbackTime = time;
+	timelineCursor = timeline_find_event(timeline, time);
+}
+
+static void playback_apply_command(struct playback_command* command) {
+	switch (command->type) {
+		case PLAYBACK_COMMAND_TOGGLE:
+			playback_toggle();
+			break;
+		case PLAYBACK_COMMAND_STOP:
+			playback_stop();
+			break;
+		case PLAYBACK_COMMAND_PLAY_NOTE:
+			command->instr->play_note(command->instr, command->note);
+			break;
+		case PLAYBACK_COMMAND_RELEASE_NOTE:
+			command->instr->release_note(command->instr, command->note);
+			break;
+		case PLAYBACK_COMMAND_SEEK:
+			playback_seek_to(command->time);
+			break;
+		case PLAYBACK_COMMAND_SEEK_BY:
+			playback_seek_to(playbackTime + command->time);
+			break;
+		default:
+			break;
+	}
+}
+
+// Hand a command to the playback thread, or carry it out right away if
+// there is no playback thread. Must only be called from the main thread.
+static void playback_send_command(struct playback_command command) {
+	if (!thread) {
+		playback_apply_command(&command);
+		return;
+	}
+
+	if (!ringbuffer_push(commandQueue, &command)) {
+		debug_log(LOGLEVEL_WARN, "Playback: Command queue full, dropping command.\n");
+		return;
+	}
+
+	SDL_SemPost(wakeSemaphore);
+}
+
+void playback_toggle_callback() {
+	playback_send_command((struct playback_command){.type = PLAYBACK_COMMAND_TOGGLE});
+}
+
+void playback_stop_callback() {
+	playback_send_command((struct playback_command){.type = PLAYBACK_COMMAND_STOP});
+}
+
+// Jump to a point in playback time.
+void playback_seek(int64_t time) {
+	playback_send_command((struct playback_command){.type = PLAYBACK_COMMAND_SEEK, .time = time});
+}
+
+void playback_skip_forward_callback() {
+	playback_send_command((struct playback_command){.type = PLAYBACK_COMMAND_SEEK_BY, .time = NOTE_TIME_FROM_MS(PLAYBACK_SKIP_MS)});
+}
+
+void playback_skip_back_callback() {
+	playback_send_command((struct playback_command){.type = PLAYBACK_COMMAND_SEEK_BY, .time = -NOTE_TIME_FROM_MS(PLAYBACK_SKIP_MS)});
+}
+
+// Dragging with the left mouse button moves back and forth through the
+// song.
+void playback_mouse_scrub(int relX, int relY) {
+	if (relX == 0)
+		return;
+
+	playback_send_command((struct playback_command){.type = PLAYBACK_COMMAND_SEEK_BY, .time = NOTE_TIME_FROM_MS(relX * PLAYBACK_SCRUB_MS_PER_PIXEL)});
+}
+
+// Play a note outside of the timeline, e.g. from the keyboard. The
+// instrument's play_note is called on the playback thread.
+void playback_play_note(struct instrument* instr, struct complex_note note) {
+	playback_send_command((struct playback_command){.type = PLAYBACK_COMMAND_PLAY_NOTE, .instr = instr, .note = note});
+}
+
+void playback_release_note(struct instrument* instr, struct complex_note note) {
+	playback_send_command((struct playback_command){.type = PLAYBACK_COMMAND_RELEASE_NOTE, .instr = instr, .note = note});
 }
 
+// Stop playing and recompile the timeline from the instruments' notes.
+// Must not be called while the playback thread is running.
 void playback_reset() {
-	playback_stop_callback();
+	playback_stop();
+
+	if (timeline_build(timeline, instrument_get_list()) != 0)
+		debug_log(LOGLEVEL_ERROR, "Playback: Failed to compile the timeline, nothing will be played!\n");
+}
+
+// Dispatch the streamed events that became due. Events the decoder hasn't
+// got to yet are picked up late rather than skipped.
+static void playback_advance_stream() {
+	struct midi_stream_event event;
+
+	midi_stream_set_time(stream, playbackTime);
+
+	while (midi_stream_peek(stream, &event) && event.time <= playbackTime) {
+		midi_stream_pop(stream);
+
+		struct complex_note note = {0};
+		note.midiKey = event.midiKey;
+		note.key = NOTE_MIDI_TO_KEY(event.midiKey);
+		note.octave = NOTE_MIDI_TO_OCTAVE(event.midiKey);
+		note.scheduledTime = event.time;
+
+		if (event.type == TIMELINE_EVENT_NOTE_ON) {
+			note.velocity = timeline_note_velocity(event.instr, 0);
+			event.instr->play_note(event.instr, note);
+		} else {
+			event.instr->release_note(event.instr, note);
+		}
+	}
+}
+
+// Move the playback time forward (in microseconds) and dispatch the events
+// that became due.
+void playback_advance(int64_t deltaTime) {
+	if (!atomic_load(&playing))
+		return;
+
+	playbackTime += deltaTime;
+
+	if (stream) {
+		playback_advance_stream();
+		return;
+	}
+
+	// Only the events that are due are looked at.
+
+	while (timelineCursor < timeline->eventCount && timeline->events[timelineCursor].time <= playbackTime) {
+		struct timeline_event* event = &timeline->events[timelineCursor++];
+		struct instrument* instr = event->instr;
+		struct note_store* notes = instr->noteList;
+		struct complex_note note;
+
+		if (event->type == TIMELINE_EVENT_NOTE_ON) {
+			notes->flags[event->note] |= NOTE_FLAG_PLAYING;
+			note_store_get(notes, event->note, &note);
+			note.velocity = event->velocity;
+			note.scheduledTime = event->time;
+			instr->play_note(instr, note);
+		} else if (notes->flags[event->note] & NOTE_FLAG_PLAYING) {
+			notes->flags[event->note] &= ~NOTE_FLAG_PLAYING;
+			note_store_get(notes, event->note, &note);
+			note.scheduledTime = event->time;
+			instr->release_note(instr, note);
+		}
+	}
 }
 
 void playback_iteration() {
-	int now = SDL_GetPerformanceCounter();
-	double deltaTime = (double)(now - previousTime) / SDL_GetPerformanceFrequency();
-	previousTime = now;
+	Uint64 elapsed = SDL_GetPerformanceCounter() - anchorCounter;
+	Uint64 frequency = SDL_GetPerformanceFrequency();
 
-	if (playing) {
-		playbackTime += (int)(deltaTime * 1000);
+	// Whole seconds and the rest apart, so that the multiplication can't
+	// overflow however long playback has been running.
+	int64_t time = anchorTime + (int64_t)(elapsed / frequency * 1000000 + elapsed % frequency * 1000000 / frequency);
 
-		list_foreach(i, instrument_get_list()) {
-			struct instrument* instr = (struct instrument*)i->data;
+	playback_advance(time - playbackTime);
+}
 
-			list_foreach(j, instr->noteList) {
-				struct complex_note* note = (struct complex_note*)j->data;
+// How long the playback thread can sleep before the next event is due.
+static int playback_get_sleep_time() {
+	int64_t nextEventTime;
 
-				if ((note->endTime <= playbackTime) && note->playing) {
-					note->playing = false;
-					instr->release_note(instr, *note);
-					continue;
-				}
+	if (stream) {
+		struct midi_stream_event event;
 
-				if ((note->startTime <= playbackTime) && (note->endTime >= playbackTime) && !note->playing) {
-					note->playing = true;
-					instr->play_note(instr, *note);
-				}
-			}
+		if (!midi_stream_peek(stream, &event))
+			return PLAYBACK_MAX_SLEEP_MS;
+
+		nextEventTime = event.time;
+	} else {
+		if (timelineCursor >= timeline->eventCount)
+			return PLAYBACK_MAX_SLEEP_MS;
+
+		nextEventTime = timeline->events[timelineCursor].time;
+	}
+
+	// In ms, rounded up so the event is due by the time we wake up.
+	int64_t untilNextEvent = (nextEventTime - playbackTime + 999) / 1000;
+
+	if (untilNextEvent < 1)
+		return 1;
+
+	return untilNextEvent < PLAYBACK_MAX_SLEEP_MS ? (int)untilNextEvent : PLAYBACK_MAX_SLEEP_MS;
+}
+
+static int playback_thread_main(void* data) {
+	profiler_register_thread("playback");
+
+	while (!atomic_load(&threadQuit)) {
+		struct playback_command command;
+
+		while (ringbuffer_pop(commandQueue, &command))
+			playback_apply_command(&command);
+
+		// Nothing to do until the next command.
+		if (!atomic_load(&playing)) {
+			SDL_SemWait(wakeSemaphore);
+			continue;
 		}
 
-		return;
+		Uint64 start = PROFILER_BEGIN();
+		playback_iteration();
+		PROFILER_END("playback_iteration", start);
+
+		SDL_SemWaitTimeout(wakeSemaphore, playback_get_sleep_time());
 	}
+
+	return 0;
+}
+
+// Run playback on its own thread from now on, so that rendering can't hold
+// up note dispatch.
+int playback_start_thread() {
+	atomic_store(&threadQuit, false);
+
+	thread = SDL_CreateThread(playback_thread_main, "vo-playback", NULL);
+
+	if (!thread) {
+		debug_log(LOGLEVEL_ERROR, "Playback: Could not create playback thread: %s\n", SDL_GetError());
+		return -1;
+	}
+
+	return 0;
+}
+
+void playback_stop_thread() {
+	if (!thread)
+		return;
+
+	atomic_store(&threadQuit, true);
+	SDL_SemPost(wakeSemaphore);
+
+	SDL_WaitThread(thread, NULL);
+	thread = NULL;
+}
+
+bool playback_is_playing() {
+	return atomic_load(&playing);
+}
+
+// True once every event of the timeline has been dispatched.
+bool playback_finished() {
+	if (stream)
+		return midi_stream_finished(stream);
+
+	return timelineCursor >= timeline->eventCount;
+}
+
+// Play from a MIDI stream instead of the instruments' notes. Must be set
+// before the playback thread is started.
+void playback_set_stream(struct midi_stream* midiStream) {
+	stream = midiStream;
 }
 
 int playback_init() {
+	timeline = timeline_create();
+
+	commandQueue = ringbuffer_create(sizeof(struct playback_command), PLAYBACK_COMMAND_QUEUE_SIZE);
+	wakeSemaphore = SDL_CreateSemaphore(0);
+
+	if (!commandQueue || !wakeSemaphore) {
+		debug_log(LOGLEVEL_ERROR, "Playback: Could not create playback thread command queue!\n");
+		return -1;
+	}
+
 	event_register_keyboard_callback(SDLK_SPACE, KMOD_NONE, playback_toggle_callback);
 	event_register_keyboard_callback(SDLK_s, KMOD_NONE, playback_stop_callback);
-
-	previousTime = SDL_GetPerformanceCounter();
+	event_register_keyboard_callback(SDLK_RIGHTBRACKET, KMOD_NONE, playback_skip_forward_callback);
+	event_register_keyboard_callback(SDLK_LEFTBRACKET, KMOD_NONE, playback_skip_back_callback);
+	event_register_mouse_callback(SDL_BUTTON_LMASK, playback_mouse_scrub);
 
 	return 0;
 }
@@ -0,0 +1,323 @@
+/*	
+ *	SPDX-License-Identifier: GPL-3.0-only
+ *
+ *  Virtual Orchestra - Musical Instrument Simulation
+ *  Copyright (C) 2024 Garnek0 (Popa Vlad) and Contributors
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <vo/profiler.h>
+#include <vo/debug.h>
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Events recorded by one thread. Only that thread writes to it, other
+// threads copy events out without stopping it (see
+// profiler_get_events()).
+struct profiler_thread {
+	atomic_bool registered;
+	// Owned by a running thread. A slot is given back when its thread
+	// unregisters, and reused by the next thread with the same name.
+	atomic_bool active;
+	char name[32];
+
+	// Number of events ever recorded. The last PROFILER_EVENTS_PER_THREAD
+	// of them are in events.
+	_Atomic uint64_t head;
+	struct profiler_event events[PROFILER_EVENTS_PER_THREAD];
+};
+
+// A scope duration, while summarizing.
+struct profiler_sample {
+	int scope;
+	double duration;
+};
+
+atomic_bool profilerEnabled;
+
+static struct profiler_thread threads[PROFILER_MAX_THREADS];
+static atomic_int threadCount;
+static _Thread_local struct profiler_thread* currentThread;
+
+// Trace timestamps are relative to when the profiler was initialized.
+static Uint64 baseCounter;
+static Uint64 frequency;
+
+// Start of the current frame, 0 if not known. Main thread only.
+static Uint64 frameStart;
+
+// Scratch space for copying out the events of one thread and for the
+// samples of all of them. Main thread only.
+static struct profiler_event* eventCopy;
+static struct profiler_sample* samples;
+
+void profiler_init() {
+	baseCounter = SDL_GetPerformanceCounter();
+	frequency = SDL_GetPerformanceFrequency();
+}
+
+// Start recording the events of the calling thread. Events from threads
+// that never registered are ignored. Short-lived threads should call
+// profiler_unregister_thread() before exiting, so that the next thread
+// with the same name can record into the same slot.
+int profiler_register_thread(const char* name) {
+	int count = atomic_load(&threadCount);
+
+	for (int i = 0; i < count && i < PROFILER_MAX_THREADS; i++) {
+		struct profiler_thread* thread = &threads[i];
+		bool expected = false;
+
+		if (!atomic_load_explicit(&thread->registered, memory_order_acquire) || strncmp(thread->name, name, sizeof(thread->name) - 1) != 0)
+			continue;
+
+		if (atomic_compare_exchange_strong_explicit(&thread->active, &expected, true, memory_order_acquire, memory_order_relaxed)) {
+			currentThread = thread;
+			return 0;
+		}
+	}
+
+	int index = atomic_fetch_add(&threadCount, 1);
+
+	if (index >= PROFILER_MAX_THREADS) {
+		debug_log(LOGLEVEL_WARN, "Profiler: Too many threads, \"%s\" won't be profiled!\n", name);
+		return -1;
+	}
+
+	struct profiler_thread* thread = &threads[index];
+
+	snprintf(thread->name, sizeof(thread->name), "%s", name);
+	atomic_store_explicit(&thread->active, true, memory_order_relaxed);
+	atomic_store_explicit(&thread->registered, true, memory_order_release);
+
+	currentThread = thread;
+
+	return 0;
+}
+
+// Stop recording the events of the calling thread. The events it already
+// recorded are kept.
+void profiler_unregister_thread() {
+	struct profiler_thread* thread = currentThread;
+	if (!thread)
+		return;
+
+	currentThread = NULL;
+	atomic_store_explicit(&thread->active, false, memory_order_release);
+}
+
+void profiler_set_enabled(bool enabled) {
+	atomic_store(&profilerEnabled, enabled);
+}
+
+bool profiler_is_enabled() {
+	return atomic_load_explicit(&profilerEnabled, memory_order_relaxed);
+}
+
+void profiler_record(const char* name, Uint64 start, Uint64 end) {
+	struct profiler_thread* thread = currentThread;
+	if (!thread)
+		return;
+
+	uint64_t head = atomic_load_explicit(&thread->head, memory_order_relaxed);
+
+	thread->events[head % PROFILER_EVENTS_PER_THREAD] = (struct profiler_event){name, start, end};
+
+	atomic_store_explicit(&thread->head, head + 1, memory_order_release);
+}
+
+// Record the time since the previous call as a "frame" event. Called by
+// the main thread at the start of every frame it draws.
+void profiler_mark_frame() {
+	Uint64 now = SDL_GetPerformanceCounter();
+	bool enabled = profiler_is_enabled();
+
+	if (enabled && frameStart)
+		profiler_record("frame", frameStart, now);
+
+	// Don't count the time the profiler was off as one long frame.
+	frameStart = enabled ? now : 0;
+}
+
+// Copy the last (up to maxEvents) events of a thread, oldest first.
+// Returns how many were copied, or -1 if there is no such thread.
+int profiler_get_events(int thread, struct profiler_event* events, int maxEvents) {
+	if (thread < 0 || thread >= PROFILER_MAX_THREADS || !atomic_load_explicit(&threads[thread].registered, memory_order_acquire))
+		return -1;
+
+	struct profiler_thread* source = &threads[thread];
+
+	uint64_t head = atomic_load_explicit(&source->head, memory_order_acquire);
+	uint64_t first = head > PROFILER_EVENTS_PER_THREAD ? head - PROFILER_EVENTS_PER_THREAD : 0;
+
+	if (head - first > (uint64_t)maxEvents)
+		first = head - maxEvents;
+
+	for (uint64_t i = first; i < head; i++)
+		events[i - first] = source->events[i % PROFILER_EVENTS_PER_THREAD];
+
+	// The thread kept recording while the events were copied, and may
+	// have overwritten some of the oldest ones (including the slot of the
+	// event it is writing right now). Those copies could be torn, drop
+	// them.
+	atomic_thread_fence(memory_order_acquire);
+
+	uint64_t newHead = atomic_load_explicit(&source->head, memory_order_relaxed);
+	uint64_t firstIntact = newHead + 1 > PROFILER_EVENTS_PER_THREAD ? newHead + 1 - PROFILER_EVENTS_PER_THREAD : 0;
+	int count = (int)(head - first);
+
+	if (firstIntact > first) {
+		int dropped = firstIntact - first < (uint64_t)count ? (int)(firstIntact - first) : count;
+
+		count -= dropped;
+		memmove((void*)events, (void*)&events[dropped], sizeof(struct profiler_event)*count);
+	}
+
+	return count;
+}
+
+static int profiler_compare_samples(const void* a, const void* b) {
+	const struct profiler_sample* x = a;
+	const struct profiler_sample* y = b;
+
+	if (x->scope != y->scope)
+		return x->scope - y->scope;
+
+	return (x->duration > y->duration) - (x->duration < y->duration);
+}
+
+static int profiler_compare_stats(const void* a, const void* b) {
+	return strcmp(((const struct profiler_scope_stats*)a)->name, ((const struct profiler_scope_stats*)b)->name);
+}
+
+// Percentiles of every scope recorded on any thread in the last periodMs,
+// sorted by name. Returns how many scopes were filled in. Main thread
+// only.
+int profiler_summarize(struct profiler_scope_stats* stats, int maxScopes, int periodMs) {
+	if (!eventCopy) {
+		eventCopy = malloc(sizeof(struct profiler_event)*PROFILER_EVENTS_PER_THREAD);
+		samples = malloc(sizeof(struct profiler_sample)*PROFILER_EVENTS_PER_THREAD*PROFILER_MAX_THREADS);
+
+		if (!eventCopy || !samples) {
+			free((void*)eventCopy);
+			free((void*)samples);
+			eventCopy = NULL;
+			samples = NULL;
+			return 0;
+		}
+	}
+
+	Uint64 since = SDL_GetPerformanceCounter() - (Uint64)periodMs * frequency / 1000;
+	int scopeCount = 0;
+	int sampleCount = 0;
+
+	for (int i = 0; i < PROFILER_MAX_THREADS; i++) {
+		int eventCount = profiler_get_events(i, eventCopy, PROFILER_EVENTS_PER_THREAD);
+
+		for (int j = 0; j < eventCount; j++) {
+			struct profiler_event* event = &eventCopy[j];
+			if (event->end < since)
+				continue;
+
+			int scope = 0;
+			while (scope < scopeCount && strcmp(stats[scope].name, event->name) != 0)
+				scope++;
+
+			if (scope == scopeCount) {
+				if (scopeCount == maxScopes)
+					continue;
+
+				stats[scopeCount++] = (struct profiler_scope_stats){.name = event->name};
+			}
+
+			samples[sampleCount].scope = scope;
+			samples[sampleCount].duration = (double)(event->end - event->start) * 1000.0 / frequency;
+			sampleCount++;
+		}
+	}
+
+	qsort((void*)samples, sampleCount, sizeof(struct profiler_sample), profiler_compare_samples);
+
+	for (int first = 0, last = 0; first < sampleCount; first = last) {
+		while (last < sampleCount && samples[last].scope == samples[first].scope)
+			last++;
+
+		struct profiler_scope_stats* scope = &stats[samples[first].scope];
+		int count = last - first;
+
+		scope->count = count;
+		scope->p50 = samples[first + (int)((count - 1) * 0.50)].duration;
+		scope->p95 = samples[first + (int)((count - 1) * 0.95)].duration;
+		scope->p99 = samples[first + (int)((count - 1) * 0.99)].duration;
+		scope->max = samples[last - 1].duration;
+	}
+
+	qsort((void*)stats, scopeCount, sizeof(struct profiler_scope_stats), profiler_compare_stats);
+
+	return scopeCount;
+}
+
+// Write everything in the ring buffers as a Chrome trace (chrome://tracing
+// or https://ui.perfetto.dev), one track per thread.
+int profiler_export_trace(const char* path) {
+	struct profiler_event* events = malloc(sizeof(struct profiler_event)*PROFILER_EVENTS_PER_THREAD);
+	if (!events)
+		return -1;
+
+	FILE* file = fopen(path, "w");
+	if (!file) {
+		debug_log(LOGLEVEL_ERROR, "Profiler: Could not open %s for writing!\n", path);
+		free((void*)events);
+		return -1;
+	}
+
+	fprintf(file, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n");
+
+	bool firstEntry = true;
+	int eventTotal = 0;
+
+	for (int i = 0; i < PROFILER_MAX_THREADS; i++) {
+		int eventCount = profiler_get_events(i, events, PROFILER_EVENTS_PER_THREAD);
+		if (eventCount < 0)
+			continue;
+
+		fprintf(file, "%s{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": %d, \"args\": {\"name\": \"%s\"}}", firstEntry ? "" : ",\n", i + 1, threads[i].name);
+		firstEntry = false;
+
+		for (int j = 0; j < eventCount; j++) {
+			double start = (double)(events[j].start - baseCounter) * 1000000.0 / frequency;
+			double duration = (double)(events[j].end - events[j].start) * 1000000.0 / frequency;
+
+			fprintf(file, ",\n{\"name\": \"%s\", \"ph\": \"X\", \"ts\": %.3f, \"dur\": %.3f, \"pid\": 1, \"tid\": %d}", events[j].name, start, duration, i + 1);
+		}
+
+		eventTotal += eventCount;
+	}
+
+	fprintf(file, "\n]}\n");
+
+	free((void*)events);
+
+	if (fclose(file) != 0) {
+		debug_log(LOGLEVEL_ERROR, "Profiler: Failed to write %s!\n", path);
+		return -1;
+	}
+
+	debug_log(LOGLEVEL_INFO, "Profiler: Wrote %d events to %s\n", eventTotal, path);
+
+	return 0;
+}
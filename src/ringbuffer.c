@@ -0,0 +1,110 @@
+/*	
+ *	SPDX-License-Identifier: GPL-3.0-only
+ *
+ *  Virtual Orchestra - Musical Instrument Simulation
+ *  Copyright (C) 2024 Garnek0 (Popa Vlad) and Contributors
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <vo/ringbuffer.h>
+#include <vo/debug.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+// The capacity is rounded up to the next power of two.
+struct ringbuffer* ringbuffer_create(size_t elementSize, unsigned int capacity) {
+	unsigned int realCapacity = 1;
+
+	while (realCapacity < capacity)
+		realCapacity <<= 1;
+
+	struct ringbuffer* newRing = malloc(sizeof(struct ringbuffer));
+	if (!newRing)
+		return NULL;
+
+	newRing->data = calloc(realCapacity, elementSize);
+	if (!newRing->data) {
+		debug_log(LOGLEVEL_ERROR, "Ring Buffer: Failed to allocate %u elements!\n", realCapacity);
+		free((void*)newRing);
+		return NULL;
+	}
+
+	newRing->elementSize = elementSize;
+	newRing->capacity = realCapacity;
+
+	atomic_init(&newRing->head, 0);
+	atomic_init(&newRing->tail, 0);
+
+	return newRing;
+}
+
+void ringbuffer_destroy(struct ringbuffer* ring) {
+	if (!ring)
+		return;
+
+	free(ring->data);
+	free((void*)ring);
+}
+
+// Producer side. Returns false if the ring is full.
+bool ringbuffer_push(struct ringbuffer* ring, const void* element) {
+	unsigned int tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+	unsigned int head = atomic_load_explicit(&ring->head, memory_order_acquire);
+
+	if (tail - head == ring->capacity)
+		return false;
+
+	memcpy((char*)ring->data + (tail & (ring->capacity - 1))*ring->elementSize, element, ring->elementSize);
+
+	// Publish the element only after it has been written.
+	atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+
+	return true;
+}
+
+// Consumer side. Copies the oldest element without removing it.
+bool ringbuffer_peek(struct ringbuffer* ring, void* element) {
+	unsigned int head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+	unsigned int tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+
+	if (head == tail)
+		return false;
+
+	memcpy(element, (char*)ring->data + (head & (ring->capacity - 1))*ring->elementSize, ring->elementSize);
+
+	return true;
+}
+
+// Consumer side. element may be NULL to just drop the oldest element.
+bool ringbuffer_pop(struct ringbuffer* ring, void* element) {
+	unsigned int head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+	unsigned int tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+
+	if (head == tail)
+		return false;
+
+	if (element)
+		memcpy(element, (char*)ring->data + (head & (ring->capacity - 1))*ring->elementSize, ring->elementSize);
+
+	// Hand the slot back to the producer only after it has been read.
+	atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+
+	return true;
+}
+
+unsigned int ringbuffer_count(struct ringbuffer* ring) {
+	return atomic_load_explicit(&ring->tail, memory_order_acquire) - atomic_load_explicit(&ring->head, memory_order_acquire);
+}
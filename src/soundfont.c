@@ -0,0 +1,130 @@
+/*	
+ *	SPDX-License-Identifier: GPL-3.0-only
+ *
+ *  Virtual Orchestra - Musical Instrument Simulation
+ *  Copyright (C) 2024 Garnek0 (Popa Vlad) and Contributors
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <vo/soundfont.h>
+#include <vo/debug.h>
+#include <vo/list.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <SDL2/SDL.h>
+
+// Soundfonts loaded into the audio engine's synth, shared by every
+// instrument that uses the same file. The samples of a soundfont are only
+// loaded once and freed when the last instrument using it goes away.
+
+struct soundfont {
+	char* path;
+	int id; // FluidSynth's soundfont ID
+	int refCount;
+};
+
+static fluid_synth_t* soundfontSynth;
+static struct list* soundfontList;
+
+// Held while loading too, so two instruments asking for the same file at
+// once don't both load it.
+static SDL_mutex* soundfontMutex;
+
+int soundfont_init(fluid_synth_t* synth) {
+	soundfontList = list_create();
+	if (!soundfontList)
+		return -1;
+
+	soundfontMutex = SDL_CreateMutex();
+	if (!soundfontMutex) {
+		debug_log(LOGLEVEL_ERROR, "Soundfont: Failed to create mutex: %s\n", SDL_GetError());
+		list_destroy(soundfontList);
+		soundfontList = NULL;
+		return -1;
+	}
+
+	soundfontSynth = synth;
+
+	return 0;
+}
+
+// Load the soundfont at path, or take another reference to it if it is
+// loaded already. Returns its ID, or -1 if it can't be loaded. Safe to call
+// from any thread.
+int soundfont_acquire(const char* path) {
+	int soundfontID = -1;
+
+	SDL_LockMutex(soundfontMutex);
+
+	list_foreach(node, soundfontList) {
+		struct soundfont* font = (struct soundfont*)node->data;
+
+		if (strcmp(font->path, path) == 0) {
+			font->refCount++;
+			soundfontID = font->id;
+			goto done;
+		}
+	}
+
+	struct soundfont* font = malloc(sizeof(struct soundfont));
+	if (!font)
+		goto done;
+
+	font->path = strdup(path);
+
+	// Don't reset the presets, that would switch every other instrument's
+	// channel back to the default program.
+	if (!font->path || (font->id = fluid_synth_sfload(soundfontSynth, path, 0)) == FLUID_FAILED) {
+		debug_log(LOGLEVEL_ERROR, "Soundfont: FluidSynth: Failed to load soundfont file \"%s\"!\n", path);
+		free((void*)font->path);
+		free((void*)font);
+		goto done;
+	}
+
+	font->refCount = 1;
+	list_insert(soundfontList, (void*)font);
+
+	soundfontID = font->id;
+
+done:
+	SDL_UnlockMutex(soundfontMutex);
+
+	return soundfontID;
+}
+
+// Drop a reference taken by soundfont_acquire(). The soundfont is unloaded
+// once nothing uses it anymore, no channel may still be playing from it.
+void soundfont_release(int soundfontID) {
+	SDL_LockMutex(soundfontMutex);
+
+	list_foreach(node, soundfontList) {
+		struct soundfont* font = (struct soundfont*)node->data;
+
+		if (font->id != soundfontID)
+			continue;
+
+		if (--font->refCount == 0) {
+			fluid_synth_sfunload(soundfontSynth, font->id, 0);
+			list_remove(soundfontList, (void*)font);
+			free((void*)font->path);
+			free((void*)font);
+		}
+
+		break;
+	}
+
+	SDL_UnlockMutex(soundfontMutex);
+}
@@ -0,0 +1,86 @@
+/*	
+ *	SPDX-License-Identifier: GPL-3.0-only
+ *
+ *  Virtual Orchestra - Musical Instrument Simulation
+ *  Copyright (C) 2024 Garnek0 (Popa Vlad) and Contributors
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <vo/task.h>
+#include <vo/debug.h>
+#include <vo/profiler.h>
+
+#include <stdlib.h>
+
+static void task_run(struct task* task) {
+	Uint64 start = PROFILER_BEGIN();
+	task->result = task->function(task->data);
+	PROFILER_END(task->name, start);
+
+	atomic_store_explicit(&task->done, true, memory_order_release);
+}
+
+static int task_thread_main(void* data) {
+	struct task* task = (struct task*)data;
+
+	profiler_register_thread(task->name);
+	task_run(task);
+	profiler_unregister_thread();
+
+	return 0;
+}
+
+// Run function(data) on a new thread. If the thread can't be created the
+// function runs right away on the calling thread instead, so a task always
+// gets done. name must outlive the task, normally a string literal.
+// Returns NULL only if out of memory.
+struct task* task_start(const char* name, int (*function)(void* data), void* data) {
+	struct task* newTask = malloc(sizeof(struct task));
+	if (!newTask)
+		return NULL;
+
+	newTask->name = name;
+	newTask->function = function;
+	newTask->data = data;
+	newTask->result = 0;
+	atomic_init(&newTask->done, false);
+
+	newTask->thread = SDL_CreateThread(task_thread_main, name, (void*)newTask);
+
+	if (!newTask->thread) {
+		debug_log(LOGLEVEL_WARN, "Task: Could not create thread for \"%s\", running it right away: %s\n", name, SDL_GetError());
+		task_run(newTask);
+	}
+
+	return newTask;
+}
+
+// Whether task_wait() would return without blocking.
+bool task_is_done(struct task* task) {
+	return atomic_load_explicit(&task->done, memory_order_acquire);
+}
+
+// Wait for the task to finish and free it. Returns what its function
+// returned.
+int task_wait(struct task* task) {
+	if (task->thread)
+		SDL_WaitThread(task->thread, NULL);
+
+	int result = task->result;
+
+	free((void*)task);
+
+	return result;
+}
@@ -0,0 +1,219 @@
+/*	
+ *	SPDX-License-Identifier: GPL-3.0-only
+ *
+ *  Virtual Orchestra - Musical Instrument Simulation
+ *  Copyright (C) 2024 Garnek0 (Popa Vlad) and Contributors
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <vo/timeline.h>
+#include <vo/debug.h>
+#include <vo/dynamics.h>
+#include <vo/note_store.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+struct timeline* timeline_create() {
+	struct timeline* newTimeline = malloc(sizeof(struct timeline));
+	memset((void*)newTimeline, 0, sizeof(struct timeline));
+
+	return newTimeline;
+}
+
+void timeline_destroy(struct timeline* timeline) {
+	if (!timeline)
+		return;
+
+	for (int i = 0; i < timeline->maxInstrumentsBeforeRealloc; i++)
+		interval_index_destroy(timeline->instruments[i].activeNotes);
+
+	free((void*)timeline->instruments);
+	free((void*)timeline->events);
+	free((void*)timeline->noteEnds);
+	free((void*)timeline);
+}
+
+int timeline_note_velocity(struct instrument* instr, uint8_t flags) {
+	if (flags & NOTE_FLAG_SFZ)
+		return 127;
+
+	int velocity = DYNAMICS_TO_VELOCITY(instr->dynamic);
+
+	if (flags & NOTE_FLAG_MARCATO)
+		velocity += 24;
+	else if (flags & NOTE_FLAG_ACCENT)
+		velocity += 16;
+
+	return velocity > 127 ? 127 : velocity;
+}
+
+static int timeline_compare_events(const void* a, const void* b) {
+	const struct timeline_event* eventA = (const struct timeline_event*)a;
+	const struct timeline_event* eventB = (const struct timeline_event*)b;
+
+	if (eventA->time != eventB->time)
+		return eventA->time < eventB->time ? -1 : 1;
+
+	// Release before striking again, so a key that is repeated right
+	// away doesn't get cut off by its previous note.
+	if (eventA->type != eventB->type)
+		return eventA->type < eventB->type ? -1 : 1;
+
+	if (eventA->instr->id != eventB->instr->id)
+		return eventA->instr->id < eventB->instr->id ? -1 : 1;
+
+	return eventA->note - eventB->note;
+}
+
+// When a note actually stops sounding.
+static int64_t timeline_note_end(struct note_store* notes, int index) {
+	int64_t startTime = notes->startTime[index];
+	int64_t endTime = notes->endTime[index];
+
+	if (notes->flags[index] & NOTE_FLAG_STACCATO)
+		endTime = startTime + (endTime - startTime) / 2;
+
+	// Every noteOn needs a noteOff strictly after it, otherwise
+	// the sort would put the noteOff first.
+	if (endTime <= startTime)
+		endTime = startTime + 1;
+
+	return endTime;
+}
+
+// Index the notes of every instrument by the time they sound.
+static int timeline_build_instruments(struct timeline* timeline, struct list* instruments) {
+	if (instruments->nodeCount > timeline->maxInstrumentsBeforeRealloc) {
+		struct timeline_instrument* newInstruments = realloc((void*)timeline->instruments, sizeof(struct timeline_instrument)*instruments->nodeCount);
+
+		if (!newInstruments) {
+			debug_log(LOGLEVEL_ERROR, "Timeline: Failed to allocate %d instruments!\n", instruments->nodeCount);
+			return -1;
+		}
+
+		for (int i = timeline->maxInstrumentsBeforeRealloc; i < instruments->nodeCount; i++)
+			newInstruments[i].activeNotes = interval_index_create();
+
+		timeline->instruments = newInstruments;
+		timeline->maxInstrumentsBeforeRealloc = instruments->nodeCount;
+	}
+
+	timeline->instrumentCount = 0;
+
+	list_foreach(node, instruments) {
+		struct instrument* instr = (struct instrument*)node->data;
+		struct note_store* notes = instr->noteList;
+		struct timeline_instrument* timelineInstr = &timeline->instruments[timeline->instrumentCount++];
+
+		if (notes->count > timeline->maxNoteEndsBeforeRealloc) {
+			int64_t* newNoteEnds = realloc((void*)timeline->noteEnds, sizeof(int64_t)*notes->count*2);
+			if (!newNoteEnds)
+				return -1;
+
+			timeline->noteEnds = newNoteEnds;
+			timeline->maxNoteEndsBeforeRealloc = notes->count*2;
+		}
+
+		for (int i = 0; i < notes->count; i++)
+			timeline->noteEnds[i] = timeline_note_end(notes, i);
+
+		timelineInstr->instr = instr;
+
+		if (interval_index_build(timelineInstr->activeNotes, notes->startTime, timeline->noteEnds, notes->count) != 0)
+			return -1;
+	}
+
+	return 0;
+}
+
+// Compile the notes of every instrument in the list into the timeline.
+int timeline_build(struct timeline* timeline, struct list* instruments) {
+	int eventCount = 0;
+
+	list_foreach(node, instruments)
+		eventCount += ((struct instrument*)node->data)->noteList->count * 2;
+
+	if (eventCount > timeline->maxEventsBeforeRealloc) {
+		struct timeline_event* newEvents = realloc((void*)timeline->events, sizeof(struct timeline_event)*eventCount);
+
+		if (!newEvents) {
+			debug_log(LOGLEVEL_ERROR, "Timeline: Failed to allocate %d events!\n", eventCount);
+			return -1;
+		}
+
+		timeline->events = newEvents;
+		timeline->maxEventsBeforeRealloc = eventCount;
+	}
+
+	timeline->eventCount = 0;
+
+	list_foreach(node, instruments) {
+		struct instrument* instr = (struct instrument*)node->data;
+		struct note_store* notes = instr->noteList;
+
+		for (int i = 0; i < notes->count; i++) {
+			int64_t startTime = notes->startTime[i];
+			int64_t endTime = timeline_note_end(notes, i);
+
+			struct timeline_event* on = &timeline->events[timeline->eventCount++];
+			on->time = startTime;
+			on->instr = instr;
+			on->note = i;
+			on->type = TIMELINE_EVENT_NOTE_ON;
+			on->velocity = (uint8_t)timeline_note_velocity(instr, notes->flags[i]);
+
+			struct timeline_event* off = &timeline->events[timeline->eventCount++];
+			off->time = endTime;
+			off->instr = instr;
+			off->note = i;
+			off->type = TIMELINE_EVENT_NOTE_OFF;
+			off->velocity = 0;
+		}
+	}
+
+	qsort((void*)timeline->events, timeline->eventCount, sizeof(struct timeline_event), timeline_compare_events);
+
+	if (timeline_build_instruments(timeline, instruments) != 0) {
+		debug_log(LOGLEVEL_ERROR, "Timeline: Failed to index active notes!\n");
+		return -1;
+	}
+
+	debug_log(LOGLEVEL_DEBUG, "Timeline: Compiled %d events.\n", timeline->eventCount);
+
+	return 0;
+}
+
+// Index of the first event after time, or eventCount if there is none.
+int timeline_find_event(struct timeline* timeline, int64_t time) {
+	int low = 0;
+	int high = timeline->eventCount;
+
+	while (low < high) {
+		int middle = low + (high - low) / 2;
+
+		if (timeline->events[middle].time <= time)
+			low = middle + 1;
+		else
+			high = middle;
+	}
+
+	return low;
+}
+
+// Time of the last event.
+int64_t timeline_get_end_time(struct timeline* timeline) {
+	return timeline->eventCount > 0 ? timeline->events[timeline->eventCount-1].time : 0;
+}